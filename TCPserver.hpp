@@ -8,9 +8,11 @@
  * a derived version of TCPserver and connectionHandler should be made.
  * Both slimProto and shoutProto use this class.
  *
- * Currently, is uses a select()-based implementation, multiple connections
- * are handled in a single thread. the processRead() function should therefore
+ * Servers are hosted by an eventLoop, which uses epoll() on Linux, and select()
+ * elsewhere (or when compiled with NO_EPOLL). Multiple servers and all their
+ * connections are handled in a single thread. the processRead() function should therefore
  * not require much time (e.g. it should not block on large file-reads)
+ * Other threads can hand work to the loop with eventLoop::post().
  *
  * A derived TCPserver-class can be used to pass external information (e.g. configuration data)
  * to the derived connectionHandler class.
@@ -25,7 +27,11 @@
 
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <vector>
+#include <map>
+#include <pthread.h>
 
 //need to include winsock before windows. since util.hpp uses windows, include it here
 #ifdef WIN32
@@ -35,7 +41,13 @@
 	#define MSG_NOSIGNAL 0
 #else
     #include <sys/socket.h> //for MSG_NOSIGNAL
+	#include <sys/uio.h>		//for struct iovec
 	typedef int SOCKET;
+	#define HAVE_WRITEV
+#endif
+#ifdef __linux__
+	#include <sys/sendfile.h>
+	#define HAVE_SENDFILE
 #endif
 
 
@@ -43,36 +55,63 @@
 #include "util.hpp"	//for the buffer, which can be memory, file, or something else
 
 
+class TCPserver;
+class eventLoop;
+class eventTask;
+class blockingTask;
+
 
+/// True if the last socket call failed because it would block
+inline bool socketWouldBlock(void)
+{
+#ifdef WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+#endif
+}
 
 
 /// Base class for non-blocking connection handlers:
 class connectionHandler
 {
+	friend class TCPserver;
 private:
 	bool isActive;	//TODO: make this a mutex
 
 	const static size_t maxPacketSize = (1<<15);	//write out the data in small blocks, to keep concurrent connections responsive
-	char localBuf[maxPacketSize];
+	const static size_t maxSendfileSize = (1<<17);	//no copy, so larger blocks are cheap
+	const static size_t maxGather = 16;				//max. number of buffers sent in one call
+	char *localBuf;				//borrowed from nbuffer::pool while data is copied, otherwise NULL
+	size_t localPos, localLen;	//part of localBuf which still has to be sent
+	bool useSendfile;			//false if sendfile() failed for the current buffer
 
-	std::vector< nbuffer::buffer* > writeBufs;		//the current data queued to be sent out
+	nbuffer::queue writeBufs;		//the current data queued to be sent out
 	SOCKET socketFD;
+	TCPserver *server;			//set by the server once the connection is registered
+
+	friend class blockingTask;
+	std::vector<blockingTask*> offloaded;	//running in the threadPool, see offload()
 public:
 	bool closeAfterLastWrite;			//< Can be set by clients to indicate that connection is done after sending.
 
+	/// Traffic classes of the write scheduler, see eventLoop::weight
+	enum writeClass_e { WRITE_CONTROL, WRITE_STREAM, WRITE_WEB, nrWriteClasses };
+	writeClass_e writeClass;	///< can be changed by derived classes at any time
+
 	connectionHandler(SOCKET socketFD):
+			localBuf(NULL),
+			localPos(0), localLen(0),
+			useSendfile(true),
 			socketFD(socketFD),
-			closeAfterLastWrite(false)
+			server(NULL),
+			closeAfterLastWrite(false),
+			writeClass(WRITE_WEB)
 	{
 		isActive = true;
 	}
 
-	~connectionHandler()
-	{
-		isActive = false;
-		for(size_t i=0; i < writeBufs.size(); i++)
-			delete writeBufs[i];
-	}
+	virtual ~connectionHandler();
 
 	size_t bufsRemaining(void)
 	{
@@ -109,13 +148,19 @@ public:
 	/// Ready to close the connection ?
 	bool canClose(void)
 	{
-		return closeAfterLastWrite && ( writeBufs.size() == 0 );
+		return closeAfterLastWrite && ( writeBufs.size() == 0 ) && offloaded.empty();
 	}
 
-	/// Write part of the data
-	/// TODO: look for a fifo implementation instead of std::vector
-	///	return result of send(). if 0, write is completed, <0 means an error
-	int writeBuf(void)
+	/// A blockingTask of this connection hasn't finished yet, see offload()
+	bool isOffloading(void)
+	{
+		return !offloaded.empty();
+	}
+
+	/// Write part of the data, at most quota bytes
+	///	return result of send(). if 0, write is completed, <0 means an error,
+	/// or that the socket would block (see socketWouldBlock()).
+	int writeBuf(size_t quota = (size_t)-1)
 	{
 		if(!isActive)
 			return -1;
@@ -125,13 +170,18 @@ public:
 
 		if( writeBufs.size() == 0)
 			return 0;
+#ifdef HAVE_WRITEV
+		if( (writeBufs.front()->ptr() != NULL) && (localPos >= localLen) )
+			return writeGather(quota);
+#endif
 		size_t pos   = writeBufs[0]->pos();
 		// tricky multi-threading. require data before size, since nbuffer can
 		// still change this internally
 		const char *data = writeBufs[0]->ptr();		
-		size_t maxBytes = writeBufs[0]->size() - pos;
+		size_t maxBytes = util::min(writeBufs[0]->size() - pos, quota);
 
 		int nSend = 0;
+		int fd = useSendfile ? writeBufs[0]->fd() : -1;
 
 		if( data != NULL ) {
 			//the buffer resides in memory, just send it out:
@@ -140,31 +190,154 @@ public:
 			//db_printf(1,"(M) sent %i\n", nSend);
 			if(nSend > 0)
 				writeBufs[0]->seek( nSend );
+#ifdef HAVE_SENDFILE
+		} else if( (fd >= 0) && (localPos >= localLen) ) {
+			//the buffer is a file, let the kernel copy it:
+			off_t offset = (off_t)writeBufs[0]->fdOffset();
+			maxBytes = util::min(maxBytes, maxSendfileSize);
+			nSend = 0;
+			if( maxBytes > 0 )
+				nSend = sendfile( socketFD, fd, &offset, maxBytes);
+			if(nSend > 0)
+				writeBufs[0]->seek( nSend );
+			if( (nSend < 0) && ((errno == EINVAL) || (errno == ENOSYS)) )
+			{
+				useSendfile = false;	//not supported for this file, copy it instead
+				return 0;
+			}
+#endif
 		} else {
-			//need to use temporary data:
-			maxBytes = util::min(maxBytes, maxPacketSize);
-			if( maxBytes > 0)
+			//need to use temporary data, which is kept until it is sent completely:
+			if( localPos >= localLen )
 			{
-				nSend = writeBufs[0]->read( localBuf, maxBytes);
-				nSend = send( socketFD, localBuf, maxBytes, sendFlags);
-				if( nSend != (int)maxBytes)
+				localPos = 0;
+				localLen = 0;
+				maxBytes = util::min(maxBytes, maxPacketSize);	//a new block, not limited by the quota
+				if( maxBytes > 0)
 				{
-					db_printf(1,"(F) sending %llu bytes to socket %i, ", (LLU)maxBytes, socketFD);
-					db_printf(1,"(F) sent %i\n", nSend);
-					db_printf(1,"(F) buf._pos = %llu\n", (LLU)writeBufs[0]->pos() );
+					if( localBuf == NULL )
+						localBuf = (char*)nbuffer::pool::alloc(maxPacketSize);
+					int nRead = writeBufs[0]->read( localBuf, maxBytes);
+					localLen = util::max(nRead, 0);
 				}
 			}
+			maxBytes = util::min(localLen - localPos, quota);
+			if( maxBytes > 0 )
+			{
+				nSend = send( socketFD, localBuf + localPos, maxBytes, sendFlags);
+				if(nSend > 0)
+					localPos += nSend;
+			}
+			if( localPos >= localLen )
+			{
+				//all sent, give it back while the connection waits:
+				nbuffer::pool::release(localBuf, maxPacketSize);
+				localBuf = NULL;
+			}
 		}
 
-		//maxBytes = writeBufs[0]->size() - writeBufs[0]->pos();
+		if( (nSend < 0) && socketWouldBlock() )
+			return nSend;		//try again once the socket is writable
+
 		//Stop sending if we're done, or if we couldn't send anything:
-		if( ((maxBytes>0)&&(nSend <= 0)) || writeBufs[0]->eof() )
+		bool done = writeBufs[0]->eof() && (localPos >= localLen);
+		if( ((maxBytes>0)&&(nSend <= 0)) || done )
 		{
 			delete writeBufs[0];
-			writeBufs.erase( writeBufs.begin() );
+			writeBufs.pop_front();
+			localPos = localLen = 0;
+			useSendfile = true;
+		}
+		return nSend;
+	}
+
+
+#ifdef HAVE_WRITEV
+	/// Send the in-memory buffers at the front of the queue in a single
+	/// call, so many small messages don't cost a syscall each.
+	int writeGather(size_t quota)
+	{
+		struct iovec iov[maxGather];
+		size_t nIov = 0;
+		size_t total = 0;
+		quota = util::min(quota, maxSendfileSize);
+
+		for(size_t i=0; (i < writeBufs.size()) && (nIov < maxGather) && (total < quota); i++)
+		{
+			nbuffer::buffer *buf = writeBufs[i];
+			const char *data = buf->canRead() ? buf->ptr() : NULL;
+			if( data == NULL )
+				break;		//not in memory, or not ready yet
+			size_t len = util::min(buf->size() - buf->pos(), quota - total);
+			iov[nIov].iov_base = (void*)(data + buf->pos());
+			iov[nIov].iov_len  = len;
+			nIov++;
+			total += len;
+		}
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov    = iov;
+		msg.msg_iovlen = nIov;
+		int nSend = 0;
+		if( total > 0 )
+			nSend = sendmsg( socketFD, &msg, MSG_NOSIGNAL );
+
+		if( (nSend < 0) && socketWouldBlock() )
+			return nSend;		//try again once the socket is writable
+
+		if( (total > 0) && (nSend <= 0) )
+		{
+			//couldn't send anything, drop the buffer:
+			delete writeBufs.front();
+			writeBufs.pop_front();
+			return nSend;
+		}
+
+		//Advance through the buffers, and remove the ones which are done:
+		size_t left = nSend;
+		while( writeBufs.size() > 0 )
+		{
+			nbuffer::buffer *buf = writeBufs.front();
+			if( buf->ptr() == NULL )
+				break;
+			size_t n = util::min( left, buf->size() - buf->pos() );
+			buf->seek( n );
+			left -= n;
+			if( !buf->eof() )
+				break;
+			delete buf;
+			writeBufs.pop_front();
 		}
 		return nSend;
 	}
+#endif
+
+
+	/// Tell the server this connection has data to send, e.g. when a
+	/// buffer which was blocking becomes ready. Can be called from any thread.
+	void wakeWrite(void);
+
+	/// Timers of the loop running this connection, NULL if there are none.
+	/// Only use them from processRead() or other work in the loop's thread.
+	util::timerWheel* timers(void);
+
+	/// Threads for blocking work of the loop running this connection, NULL
+	/// if there are none. Can be used from any thread.
+	util::threadPool* ioPool(void);
+
+	/// Server running this connection, NULL until it's registered. It
+	/// outlives the connection, so it can post() work for it later on.
+	TCPserver* getServer(void)
+	{
+		return server;
+	}
+
+	/// Run task->work() in a thread of the loop's threadPool, and then
+	/// task->done() back in the loop, unless the connection closed by then.
+	/// Takes ownership of the task. Use it for anything which can block,
+	/// since processRead() holds up all other connections of the loop.
+	void offload(blockingTask *task);
 
 
 	//Interface which derived classes should use to send and receive:
@@ -179,16 +352,64 @@ public:
 	void write( nbuffer::buffer *buf)
 	{
 		if(isActive)
+		{
 			writeBufs.push_back( buf );
+			wakeWrite();
+		}
 	}
 
 };
 
 
 
+/// State of a single connection, as kept by the server
+struct connections_s
+{
+	SOCKET socket;
+	connectionHandler *handler;
+	//bool needsWrite;	//when handler->writeBuf() returns >0, this stays true
+
+	// Set by an event, cleared when a call would block:
+	bool canRead;
+	bool canWrite;
+
+	// Write scheduler, see TCPserver::service():
+	size_t deficit;			///< bytes the connection may still send this round
+	bool waiting;			///< has data and a writable socket, but used its turn
+	uint32_t waitingSince;	///< util::msTime() at the end of its last turn
+
+	/// Closes the connection when nothing was sent or received for a while
+	struct idleTimer_s : public util::timer
+	{
+		TCPserver *server;
+		SOCKET socket;
+		void expire(void);
+	} idleTimer;
+
+	bool needsWrite(void)
+	{
+		bool needsWrite = (handler->bufsRemaining() > 0) && (!handler->isWriteBufBlocking());
+		return needsWrite;
+	}
+
+	connections_s(SOCKET s, connectionHandler* h, TCPserver *server):
+		socket(s), handler(h),
+		canRead(false), canWrite(true),	//a new socket is writable
+		deficit(0), waiting(false), waitingSince(0)
+	//, needsWrite(false)
+	{
+		idleTimer.server = server;
+		idleTimer.socket = s;
+	}
+};
+
+
+
 /// Generic TCP server
 class TCPserver
 {
+	friend class eventLoop;
+	friend struct connections_s;
 private:
 	//serve function, for single connections:
 	// called by the base class, after network a connection has been set-up
@@ -201,6 +422,46 @@ private:
 	unsigned maxConnections;
 	unsigned maxConQueue;    //max number of waiting connections
 
+	eventLoop *loop;		///< the loop hosting this server, NULL if it's not running
+	int loopIdx;			///< index of this server in the loop
+	SOCKET listenSocket;
+	std::map<SOCKET, connections_s> connections;
+
+	std::vector<SOCKET> active;		///< connections to service in this iteration
+	std::vector<SOCKET> retry;		///< connections which didn't finish in the previous iteration
+
+	// Servers sharing a port, see share():
+	TCPserver *acceptor;			///< server accepting connections for this one, NULL if it's the first
+	std::vector<TCPserver*> workers;	///< servers this one spreads its connections over
+	size_t nextWorker;				///< round-robin counter, if SO_REUSEPORT is not available
+	bool reusePort;					///< each server has its own listen socket (SO_REUSEPORT)
+
+	pthread_mutex_t wakeMutex;
+	std::vector<SOCKET> wakeList;	///< connections with new data to send, see wake()
+	std::vector<SOCKET> adoptList;	///< sockets accepted by the acceptor, see adopt()
+
+	/// Create and register a handler for an accepted socket
+	connectionHandler* addHandler(SOCKET clientSocket);
+
+	/// Take the connections passed to wake() since the last call
+	void takeWakeList(std::vector<SOCKET> &list);
+
+	/// Hand over a socket accepted by the acceptor. Can be called from any thread.
+	void adopt(SOCKET s);
+
+	/// Start handling an accepted socket, returns false if it was refused
+	bool addConnection(SOCKET s);
+
+	// Called by the eventLoop:
+	bool open(void);				///< start listening
+	void close(void);				///< close all connections and the listen socket
+	void acceptAll(void);			///< accept all waiting connections
+	void setActive(SOCKET s, bool canRead, bool canWrite);	///< socket got an event
+	void serviceActive(void);		///< read/write on the active and woken connections
+	void service(connections_s *c);	///< read/write on a single connection
+	void closeConnection(connections_s *c);
+	void idleExpired(SOCKET s);		///< idle timer of a connection ran out
+	bool hasPending(void) { return !retry.empty(); }
 
 protected:
 	//int read(void *data, size_t len);
@@ -213,18 +474,218 @@ public:
     bool stop;  //set to true to abort.
 
 	TCPserver(int port, int maxConnections=10  );
-	//virtual ~TCPserver();
+	virtual ~TCPserver();
 
 	//run with blocking accept call (one connection at a time)
 	//int run();
 
-	/// Run with select, everyting non-blocking in a single thread
+	/// Close connections after this many ms without any data sent or
+	/// received, 0 to keep them open. Set it before the server runs.
+	uint32_t idleTimeout;
+
+	/// Run this server only, in its own eventLoop in the current thread
 	int runNonBlock();
 
 	int getPort(void) { return port; }
+
+	/// A connection has new data to send. Can be called from any thread.
+	void wake(SOCKET s);
+
+	/// Timers of the eventLoop running this server, NULL if it's not running,
+	/// or if the platform has none. Only use them in the thread of the loop.
+	util::timerWheel *timers(void);
+
+	/// Threads for blocking work of the eventLoop running this server,
+	/// NULL if it's not running or has none, see eventLoop::pool
+	util::threadPool *ioPool(void);
+
+	/// Run a task in the thread of this server's eventLoop, or right away
+	/// if it isn't running. Can be called from any thread.
+	void post(eventTask *task);
+
+	/// Run a blocking task of a connection, see connectionHandler::offload()
+	void offload(blockingTask *task);
+
+	/// Spread the connections on this port over another server, which runs
+	/// in another eventLoop. Each server listens on the port itself if the
+	/// system supports SO_REUSEPORT, otherwise this one accepts all connections
+	/// and hands them out round-robin. Must be called before either is running.
+	/// A connection stays in the server which got it.
+	void share(TCPserver *worker);
 };
 
 
+
+/// Work to be done inside an eventLoop, see eventLoop::post()
+class eventTask
+{
+public:
+	virtual ~eventTask() {}
+	virtual void run(void)=0;
+};
+
+
+/// Work for a connection which can block, like disk access, written as
+/// two steps: work() runs in a threadPool, and must not touch the connection.
+/// done() continues in the loop thread, with the connection which offloaded
+/// it. If the connection closed in the meantime, done() is skipped.
+/// See connectionHandler::offload()
+class blockingTask : public eventTask, public util::job
+{
+	friend class connectionHandler;
+	friend class eventLoop;
+private:
+	connectionHandler *owner;	//NULL once the connection is gone, only used in the loop thread
+	eventLoop *loop;			//which runs done()
+public:
+	blockingTask(): owner(NULL), loop(NULL) {}
+
+	virtual void done(connectionHandler *owner)=0;
+
+	void run(void);			///< calls done(), in the loop thread
+	void finished(void);	///< back to the loop, in the pool thread
+};
+
+
+
+/// Runs any number of TCPservers in a single thread.
+/// Other threads wake it through an eventfd (a pipe on non-Linux systems),
+/// instead of waiting for a time-out.
+class eventLoop
+{
+public:
+	/// Write scheduler statistics of a class
+	struct writeStats_s
+	{
+		uint64_t bytes;		///< sent in total
+		uint32_t turns;		///< times a connection waited for its next turn
+		uint64_t waitMs;	///< total time spent waiting for a turn
+		uint32_t maxWaitMs;	///< longest wait
+	};
+
+private:
+	std::vector<TCPserver*> servers;
+
+	int pollFD;			///< epoll instance, -1 when using select()
+	int wakeRead;		///< eventfd, or read end of the wake-up pipe
+	int wakeWrite;		///< same as wakeRead for an eventfd, or write end of the pipe
+
+	pthread_mutex_t mutex;	///< protects tasks
+	std::vector<eventTask*> tasks;
+
+	util::timerWheel timerList;	///< deadlines, see TCPserver::timers()
+	int pollTimeout(bool pending);
+
+	writeStats_s stats[connectionHandler::nrWriteClasses];
+
+	void watch(TCPserver *server, SOCKET s, bool isListen);
+	void runTasks(void);
+	void drainWake(void);
+	int runEpoll(void);
+	int runSelect(void);
+
+	friend class TCPserver;
+
+public:
+	/// Bytes per round for a connection of weight 1
+	static const size_t quantum = (1<<14);
+
+	/// Relative share of the write bandwidth for each connectionHandler::writeClass_e.
+	/// A connection may send weight*quantum bytes before the others get their turn.
+	uint32_t weight[connectionHandler::nrWriteClasses];
+
+	/// Statistics of the write scheduler, only read them in the loop's thread
+	const writeStats_s& writeStats(connectionHandler::writeClass_e c) { return stats[c]; }
+
+	/// Set to true to abort, also returns when all servers are stopped.
+	/// The loop sleeps until an event, so call wake() after setting it.
+	bool stop;
+
+	eventLoop();
+	~eventLoop();
+
+	/// Host a server in this loop, must be called before run()
+	bool add(TCPserver *server);
+
+	/// Handle all servers, until stopped
+	int run(void);
+
+	/// Wake the loop up from any thread
+	void wake(void);
+
+	/// Run a task in the loop thread, during the next iteration.
+	/// The loop takes ownership of the task.
+	void post(eventTask *task);
+
+	/// Threads for connectionHandler::offload(), shared by any number of loops.
+	/// If it's NULL, blocking tasks run in the loop itself. Must outlive the loop.
+	util::threadPool *pool;
+
+	/// Run a blocking task in the pool, see connectionHandler::offload()
+	void offload(blockingTask *task);
+};
+
+
+inline util::timerWheel* connectionHandler::timers(void)
+{
+	return (server != NULL) ? server->timers() : NULL;
+}
+
+
+inline util::threadPool* TCPserver::ioPool(void)
+{
+	return (loop != NULL) ? loop->pool : NULL;
+}
+
+
+inline util::threadPool* connectionHandler::ioPool(void)
+{
+	return (server != NULL) ? server->ioPool() : NULL;
+}
+
+
+inline void connectionHandler::wakeWrite(void)
+{
+	if( server != NULL )
+		server->wake( socketFD );
+}
+
+
+inline connectionHandler::~connectionHandler()
+{
+	isActive = false;
+	for(size_t i=0; i < writeBufs.size(); i++)
+		delete writeBufs[i];
+	nbuffer::pool::release(localBuf, maxPacketSize);
+	for(size_t i=0; i < offloaded.size(); i++)
+		offloaded[i]->owner = NULL;	//still running, forget about us
+}
+
+
+inline void connectionHandler::offload(blockingTask *task)
+{
+	task->owner = this;
+	offloaded.push_back( task );
+	server->offload( task );
+}
+
+
+inline void blockingTask::run(void)
+{
+	if( owner == NULL )
+		return;
+	std::vector<blockingTask*> &list = owner->offloaded;
+	list.erase( std::find(list.begin(), list.end(), this) );
+	done( owner );
+}
+
+
+inline void blockingTask::finished(void)
+{
+	loop->post( this );
+}
+
+
 /**@}
  *end of doxygen group
  */
@@ -8,6 +8,18 @@
 #include <errno.h>
 
 #include <memory.h>
+#include <map>
+#include <algorithm>
+
+// epoll scales with the number of active connections instead of all connections,
+// select() is kept for other platforms:
+#if defined(__linux__) && !defined(NO_EPOLL)
+	#define USE_EPOLL
+	#include <sys/epoll.h>
+#endif
+#ifdef __linux__
+	#include <sys/eventfd.h>
+#endif
 
 
 
@@ -33,59 +45,140 @@ connectionHandler::connectionBuffer::~connectionBuffer()
 */
 
 
-// Main server class
-TCPserver::TCPserver(int port, int maxCon):
-		port(port),
-		maxConnections(maxCon),
-		stop(false)
-{
-	db_printf(4,"TCPserver: port %i\n",port);
-}
-
-
-bool setBlocking(SOCKET socket, bool doBlock)
+static bool setBlocking(SOCKET socket, bool doBlock)
 {
 	//set to non-blocking:
 	int iof = fcntl(socket, F_GETFL, 0);
 	if (iof < 0)
 	{
 		perror("setsockopt() failed");
-		close(socket);
+		::close(socket);
 		return false;
 	}
 
 	if(doBlock)
-		fcntl(socket, F_SETFL, iof | O_NONBLOCK   );
-	else
 		fcntl(socket, F_SETFL, iof & (~O_NONBLOCK));
+	else
+		fcntl(socket, F_SETFL, iof | O_NONBLOCK   );
 	return true;
 }
 
 
 
-//info on all clients:
-struct connections_s
+// Main server class
+TCPserver::TCPserver(int port, int maxCon):
+		port(port),
+		maxConnections(maxCon),
+		loop(NULL),
+		loopIdx(-1),
+		listenSocket(-1),
+		acceptor(NULL),
+		nextWorker(0),
+		reusePort(false),
+		stop(false),
+		idleTimeout(0)
+{
+	pthread_mutex_init( &wakeMutex, NULL );
+	db_printf(4,"TCPserver: port %i\n",port);
+}
+
+
+TCPserver::~TCPserver()
+{
+	close();
+	pthread_mutex_destroy( &wakeMutex );
+}
+
+
+void TCPserver::wake(SOCKET s)
+{
+	pthread_mutex_lock( &wakeMutex );
+	wakeList.push_back( s );
+	eventLoop *l = loop;
+	pthread_mutex_unlock( &wakeMutex );
+	if( l != NULL )
+		l->wake();
+}
+
+
+void TCPserver::takeWakeList(std::vector<SOCKET> &list)
 {
-	SOCKET socket;
-	connectionHandler *handler;
-	//bool needsWrite;	//when handler->writeBuf() returns >0, this stays true
+	pthread_mutex_lock( &wakeMutex );
+	list.swap( wakeList );
+	wakeList.clear();
+	pthread_mutex_unlock( &wakeMutex );
+}
+
 
-	bool needsWrite(void)
+util::timerWheel *TCPserver::timers(void)
+{
+	return (loop != NULL) ? &loop->timerList : NULL;
+}
+
+
+void TCPserver::post(eventTask *task)
+{
+	pthread_mutex_lock( &wakeMutex );
+	eventLoop *l = loop;
+	pthread_mutex_unlock( &wakeMutex );
+	if( l != NULL )
+		l->post( task );
+	else
+	{
+		task->run();
+		delete task;
+	}
+}
+
+
+void TCPserver::offload(blockingTask *task)
+{
+	if( loop != NULL )
+		loop->offload( task );
+	else
 	{
-		bool needsWrite = (handler->bufsRemaining() > 0) && (!handler->isWriteBufBlocking());
-		return needsWrite;
+		task->work();
+		task->run();
+		delete task;
 	}
+}
+
+
+void TCPserver::share(TCPserver *worker)
+{
+	worker->acceptor = this;
+	workers.push_back( worker );
+}
+
+
+void TCPserver::adopt(SOCKET s)
+{
+	pthread_mutex_lock( &wakeMutex );
+	adoptList.push_back( s );
+	eventLoop *l = loop;
+	pthread_mutex_unlock( &wakeMutex );
+	if( l != NULL )
+		l->wake();
+}
+
+
+connectionHandler* TCPserver::addHandler(SOCKET clientSocket)
+{
+	//set client to non-blocking mode: (if server is non-blocking, the clients will also be)
+	setBlocking( clientSocket, false );
 
-	connections_s(SOCKET s, connectionHandler* h):
-		socket(s), handler(h)
-	//, needsWrite(false)
-	{}
-};
+	//create a new connection handler for this:
+	connectionHandler *C = newHandler(clientSocket);
+	C->server = this;
+	return C;
+}
 
 
 
 
-SOCKET setupListenSocket(int port)
+/// With reusePort set, try to share the port with other sockets, and
+/// report if that worked.
+SOCKET setupListenSocket(int port, bool *reusePort=NULL)
 {
     struct sockaddr_in serveraddr;
 
@@ -101,6 +194,18 @@ SOCKET setupListenSocket(int port)
 	if(ListenSocket< 0)
 		return -1;
 
+	// Allow a restart while old connections are in TIME_WAIT:
+	int reuse = 1;
+	setsockopt(ListenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	if( reusePort != NULL )
+	{
+#ifdef SO_REUSEPORT
+		*reusePort = (setsockopt(ListenSocket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == 0);
+#else
+		*reusePort = false;
+#endif
+	}
+
 	// Bind to a port
 	if( bind(ListenSocket, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0)
 		return -2;
@@ -124,186 +229,650 @@ SOCKET setupListenSocket(int port)
 
 
 
-int TCPserver::runNonBlock()
+bool TCPserver::open(void)
 {
-    // Buffer for incoming data:
-	char rxBuf[ 1<<15 ];	//receive max. 32kb at once, larger data will be handled in multiple iterations
+	// The acceptor hands out the connections:
+	if( (acceptor != NULL) && !acceptor->reusePort )
+		return true;
 
-	//struct sockaddr_in serveraddr;
-
-    SOCKET ListenSocket = setupListenSocket(port);
-	if( ListenSocket < 0)
+	bool share = (acceptor != NULL) || !workers.empty();
+	listenSocket = setupListenSocket(port, share ? &reusePort : NULL);
+	if( listenSocket < 0)
 	{
 		db_printf(1,"Could not open port %i for listening\n",port);
-		return -1;
+		return false;
 	}
+	return true;
+}
 
-	//set up FD-sets for select-calls:
-	fd_set tempset, readset, writeset;
 
-	FD_ZERO(&readset);
-	FD_SET(ListenSocket, &readset);
-	SOCKET maxfd = ListenSocket;
-	timeval tv;
+void TCPserver::close(void)
+{
+	for(std::map<SOCKET, connections_s>::iterator it = connections.begin(); it != connections.end(); it++)
+	{
+		::close( it->first );
+		delete it->second.handler;
+	}
+	connections.clear();
+	active.clear();
+	retry.clear();
 
+	pthread_mutex_lock( &wakeMutex );
+	for(size_t i=0; i < adoptList.size(); i++)
+		::close( adoptList[i] );
+	adoptList.clear();
+	pthread_mutex_unlock( &wakeMutex );
 
-	std::vector<connections_s> connections;	//TODO: use maxConnections to statically allocate
+	if( listenSocket >= 0 )
+	{
+		db_printf(1,"Closing server on port %i\n", port);
+		::close(listenSocket);
+	}
+	listenSocket = -1;
+}
 
 
-	//see  http://www.developerweb.net/forum/showthread.php?t=2933
-	int sresult;
-	while(!stop)
+void TCPserver::acceptAll(void)
+{
+	// Edge-triggered, so accept everything that's waiting:
+	while( true )
 	{
-		//(re-) initialize read sockets:
-		memcpy(&tempset, &readset, sizeof(tempset));
+		struct sockaddr_in peername;
+		socklen_t peerlen = sizeof(peername);
+		SOCKET clientSocket = accept(listenSocket, (struct sockaddr *) &peername, &peerlen);
+		if(clientSocket < 0)
+		{
+			if( errno == EINTR )
+				continue;
+			if( !socketWouldBlock() )
+				db_printf(1,"accept failed on port %i: %s\n", port, strerror(errno) );
+			break;
+		}
 
-		maxfd = ListenSocket;		//if connections are closing, this needs to be rebuild
-		// Add all clients which have needsWrite set to the write set.
-		FD_ZERO(&writeset);
-		for(size_t i=0; i<connections.size(); i++)
+		// Without SO_REUSEPORT, spread the connections over the workers:
+		size_t w = reusePort ? 0 : nextWorker++ % (workers.size()+1);
+		if( w > 0 )
+			workers[w-1]->adopt( clientSocket );
+		else
+			addConnection( clientSocket );
+	}
+}
+
+
+bool TCPserver::addConnection(SOCKET clientSocket)
+{
+	//for debug, get client info
+	struct sockaddr_in peername;
+	socklen_t peerlen = sizeof(peername);
+	char host[INET6_ADDRSTRLEN] = "?";
+	if( getpeername(clientSocket, (struct sockaddr *) &peername, &peerlen) == 0 )
+		inet_ntop( AF_INET, &peername.sin_addr, host, sizeof(host)  );
+
+	bool fits = (connections.size() < maxConnections);
+	if( loop->pollFD < 0 )
+		fits = fits && (clientSocket < FD_SETSIZE);		//select() can't handle it
+	if( !fits )
+	{
+		::close(clientSocket);
+		db_printf(2,"refused connection to %s, serverport %i\n", host, port );
+		return false;
+	}
+	db_printf(2,"accepting socket %i on serverport %i\n", clientSocket, port);
+
+	connectionHandler *C = addHandler(clientSocket);
+	connections_s *c = &connections.insert( std::make_pair( clientSocket, connections_s(clientSocket, C, this) ) ).first->second;
+	loop->watch(this, clientSocket, false);
+
+	if( idleTimeout > 0 )
+		loop->timerList.arm( &c->idleTimer, idleTimeout );
+	return true;
+}
+
+
+void connections_s::idleTimer_s::expire(void)
+{
+	server->idleExpired(socket);
+}
+
+
+void TCPserver::idleExpired(SOCKET s)
+{
+	std::map<SOCKET, connections_s>::iterator it = connections.find(s);
+	if( it == connections.end() )
+		return;
+	if( it->second.needsWrite() )
+	{
+		//a paused player stops reading, that's not idle:
+		loop->timerList.arm( &it->second.idleTimer, idleTimeout );
+		return;
+	}
+	db_printf(3,"Closing idle socket %i on port %i\n", s, port);
+	closeConnection( &it->second );
+}
+
+
+void TCPserver::setActive(SOCKET s, bool canRead, bool canWrite)
+{
+	std::map<SOCKET, connections_s>::iterator it = connections.find(s);
+	if( it == connections.end() )
+		return;
+	it->second.canRead  |= canRead;
+	it->second.canWrite |= canWrite;
+	active.push_back(s);
+}
+
+
+void TCPserver::serviceActive(void)
+{
+	std::vector<SOCKET> woken;
+
+	// Connections accepted by the acceptor:
+	pthread_mutex_lock( &wakeMutex );
+	woken.swap( adoptList );
+	pthread_mutex_unlock( &wakeMutex );
+	for(size_t i=0; i < woken.size(); i++)
+		if( addConnection( woken[i] ) )
+			active.push_back( woken[i] );
+	woken.clear();
+
+	// Connections which got data to send from elsewhere:
+	takeWakeList( woken );
+	active.insert( active.end(), woken.begin(), woken.end() );
+	active.insert( active.end(), retry.begin(), retry.end() );
+	retry.clear();
+
+	std::sort( active.begin(), active.end() );
+	active.erase( std::unique( active.begin(), active.end() ), active.end() );
+
+	for(size_t a=0; a < active.size(); a++)
+	{
+		std::map<SOCKET, connections_s>::iterator it = connections.find( active[a] );
+		if( it != connections.end() )	//otherwise it's closed already
+			service( &it->second );
+	}
+	active.clear();
+}
+
+
+/// Since edges are only reported once, a connection keeps reading/writing
+/// until the call would block, or until it used its share of the iteration
+/// (to keep other connections responsive).
+/// The share is scheduled by deficit round-robin: each iteration a connection
+/// gets eventLoop::weight * eventLoop::quantum bytes for its write class, and
+/// the rest of the data waits for the next iteration.
+void TCPserver::service(connections_s *c)
+{
+    // Buffer for incoming data, only borrowed while reading:
+	const size_t rxSize = 1<<15;	//receive max. 32kb at once, larger data will be handled in multiple iterations
+	char *rxBuf = NULL;
+	const int maxWritesPerIteration = 16;	//calls per connection, in case nothing gets sent
+
+	bool doClose = false;
+	bool peerClosed = false;	//recv() returned 0, nothing more will come in
+	bool progress = false;		//any data sent or received
+
+	// Read until the socket would block:
+	while( c->canRead && !c->handler->isReadBufBlocking() && !doClose )
+	{
+		if( rxBuf == NULL )
+			rxBuf = (char*)nbuffer::pool::alloc(rxSize);
+		int r = recv(c->socket, rxBuf, rxSize, 0);
+		if( r > 0 )
+		{
+			progress = true;
+			if( !c->handler->processRead(rxBuf, r) )
+				doClose = true;
+			// Even a short read can't stop here: data and a FIN can come in a
+			// single edge, and then only the next recv() returns 0.
+		}
+		else if( r == 0 )
+		{	//answer what was received, then close:
+			c->canRead = false;
+			c->handler->closeAfterLastWrite = true;
+			peerClosed = true;
+		}
+		else if( (r < 0) && socketWouldBlock() )
+			c->canRead = false;
+		else if( (r < 0) && (errno == EINTR) )
+			continue;
+		else
 		{
-			maxfd = util::max(maxfd, connections[i].socket );
-			if( connections[i].needsWrite() )
-				FD_SET(connections[i].socket, &writeset );
+			if( r < 0 )
+				db_printf(1,"Error on port %i socket %i in recv(): %s\n", port, c->socket, strerror(errno));
+			doClose = true;
 		}
+	}
+	nbuffer::pool::release(rxBuf, rxSize);
 
-        //Re-build list of connections to read from, some might not be ready
-        //for input
-        FD_ZERO(&tempset);
-        //TODO: Don't listen for new connections if max. connections is reached:
-        FD_SET(ListenSocket, &tempset);
-		for(size_t i=0; i<connections.size(); i++)
+	// If the handler blocks its input, canRead stays set, and the
+	// data is read after the next wake() of this connection. Only
+	// look whether the peer is gone, without taking any data:
+	if( c->canRead && c->handler->isReadBufBlocking() && !doClose && !peerClosed )
+	{
+		char peek;
+		if( recv(c->socket, &peek, 1, MSG_PEEK) == 0 )
 		{
-			//maxfd = util::max(maxfd, connections[i].socket );
-            if( !connections[i].handler->isReadBufBlocking() )
-				FD_SET(connections[i].socket, &tempset );
+			c->canRead = false;
+			c->handler->closeAfterLastWrite = true;
+			peerClosed = true;
 		}
+	}
 
+	// Write until the socket would block, or the iteration share is used:
+	int cls = c->handler->writeClass;
+	eventLoop::writeStats_s &stats = loop->stats[cls];
+	if( c->waiting )
+	{
+		uint32_t waitMs = util::msTime() - c->waitingSince;
+		stats.turns++;
+		stats.waitMs += waitMs;
+		stats.maxWaitMs = util::max(stats.maxWaitMs, waitMs);
+		c->waiting = false;
+	}
+	if( !doClose && c->canWrite && c->needsWrite() )
+		c->deficit += util::max<uint32_t>(loop->weight[cls], 1) * eventLoop::quantum;
 
-		// Time-out for the master-select()-call, If a write is to be initiated from another
-		// part of the software (e.g. web-gui starts playing through slim protocol),
-		// this value must be relatively small to keep the delay acceptable.
-		tv.tv_sec =   2;
-		tv.tv_usec =  0;
+	int nrWrites = 0;
+	while( !doClose && c->canWrite && c->needsWrite() && (c->deficit > 0) && (nrWrites < maxWritesPerIteration) )
+	{
+		int r = c->handler->writeBuf( c->deficit );
+		nrWrites++;
+		if( (r < 0) && socketWouldBlock() )
+			c->canWrite = false;
+		if( r > 0 )
+		{
+			progress = true;
+			stats.bytes += r;
+			c->deficit -= util::min<size_t>(r, c->deficit);
+		}
+	}
+	// Credit is only kept while the connection is waiting for its next turn:
+	if( !c->canWrite || !c->needsWrite() )
+		c->deficit = 0;
 
-		sresult = select(maxfd + 1, &tempset, &writeset, NULL, &tv);
+	if( !doClose && c->handler->canClose() )
+	{
+		db_printf(3,"Closing client socket %i on port %i, done sending\n", c->socket, port);
+		doClose = true;
+	}
+	// Don't wait for buffers which are blocking, like a long-poll, for a peer which is gone:
+	if( !doClose && peerClosed && !c->needsWrite() && !c->handler->isOffloading() )
+		doClose = true;
 
-		if (sresult == 0)
+	if( doClose )
+	{
+		db_printf(3,"Closing client socket %i, serverPort %i\n", c->socket, port);
+		closeConnection(c);
+		return;
+	}
+	if( c->canWrite && c->needsWrite() )
+	{
+		retry.push_back( c->socket );	//used its share, continue in the next iteration
+		c->waiting = true;
+		c->waitingSince = util::msTime();
+	}
+	else if( c->canRead && !c->handler->isReadBufBlocking() )
+		retry.push_back( c->socket );	//input was held back until the responses were sent
+	if( progress && (idleTimeout > 0) )
+		loop->timerList.arm( &c->idleTimer, idleTimeout );
+}
+
+
+void TCPserver::closeConnection(connections_s *c)
+{
+	SOCKET s = c->socket;
+	::close( s );		//also removes it from epoll
+	delete c->handler;
+	connections.erase( s );	//also cancels the idle timer
+}
+
+
+
+int TCPserver::runNonBlock()
+{
+	eventLoop loop;
+	if( !loop.add(this) )
+		return -1;
+	return loop.run();
+}
+
+
+
+//--------------------------- Event loop ---------------------------------------
+
+
+// The servers and the wake-up descriptor are identified by their index in the
+// high half of the epoll data, the socket is in the low half:
+static const uint32_t wakeIdx = 0xFFFFFFFF;
+
+static uint64_t pollKey(uint32_t idx, SOCKET s)
+{
+	return ((uint64_t)idx << 32) | (uint32_t)s;
+}
+
+
+eventLoop::eventLoop():
+	pollFD(-1),
+	wakeRead(-1),
+	wakeWrite(-1),
+	stop(false),
+	pool(NULL)
+{
+	pthread_mutex_init( &mutex, NULL );
+
+	// Control frames and audio keep flowing while large pages are sent:
+	weight[connectionHandler::WRITE_CONTROL] = 4;
+	weight[connectionHandler::WRITE_STREAM]  = 4;
+	weight[connectionHandler::WRITE_WEB]     = 1;
+	memset( stats, 0, sizeof(stats) );
+
+#ifdef __linux__
+	wakeRead = wakeWrite = eventfd(0, EFD_NONBLOCK);
+#endif
+	if( wakeRead < 0 )
+	{
+		int fds[2];
+		if( pipe(fds) == 0 )
 		{
-			db_printf(3,"select() timed out on port %i\n", port);
+			wakeRead  = fds[0];
+			wakeWrite = fds[1];
+			setBlocking(wakeRead , false);
+			setBlocking(wakeWrite, false);
 		}
-		else if( (sresult < 0)  && (errno != EINTR) )
+		else
+			perror("eventLoop: can't create a wake-up pipe");
+	}
+
+#ifdef USE_EPOLL
+	pollFD = epoll_create(16);
+	if( pollFD < 0 )
+		db_printf(1,"epoll_create() failed, using select(): %s\n", strerror(errno));
+	if( (pollFD >= 0) && (wakeRead >= 0) )
+	{
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events   = EPOLLIN | EPOLLET;
+		ev.data.u64 = pollKey(wakeIdx, wakeRead);
+		epoll_ctl(pollFD, EPOLL_CTL_ADD, wakeRead, &ev);
+	}
+#endif
+}
+
+
+eventLoop::~eventLoop()
+{
+	const char *className[connectionHandler::nrWriteClasses] = {"control", "stream", "web"};
+	for(int i=0; i < connectionHandler::nrWriteClasses; i++)
+		db_printf(2,"%s writes: %llu bytes, %u turns waited for, avg. %.1f ms, max. %u ms\n", className[i],
+			(LLU)stats[i].bytes, stats[i].turns, stats[i].turns ? (double)stats[i].waitMs / stats[i].turns : 0.0, stats[i].maxWaitMs );
+
+	for(size_t i=0; i < servers.size(); i++)
+	{
+		servers[i]->close();
+		servers[i]->loop = NULL;
+	}
+	for(size_t i=0; i < tasks.size(); i++)
+		delete tasks[i];
+
+	if( pollFD >= 0 )
+		close(pollFD);
+	if( wakeWrite != wakeRead )
+		close(wakeWrite);
+	if( wakeRead >= 0 )
+		close(wakeRead);
+	pthread_mutex_destroy( &mutex );
+}
+
+
+bool eventLoop::add(TCPserver *server)
+{
+	if( !server->open() )
+		return false;
+
+	pthread_mutex_lock( &server->wakeMutex );
+	server->loop    = this;
+	pthread_mutex_unlock( &server->wakeMutex );
+	server->loopIdx = servers.size();
+	servers.push_back( server );
+	if( server->listenSocket >= 0 )
+		watch(server, server->listenSocket, true);
+	return true;
+}
+
+
+void eventLoop::watch(TCPserver *server, SOCKET s, bool isListen)
+{
+#ifdef USE_EPOLL
+	if( pollFD < 0 )
+		return;		//select() gets the sockets from the servers
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = isListen ? (EPOLLIN | EPOLLET) : (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+	ev.data.u64 = pollKey(server->loopIdx, s);
+	epoll_ctl(pollFD, EPOLL_CTL_ADD, s, &ev);
+#endif
+}
+
+
+void eventLoop::wake(void)
+{
+	if( wakeWrite < 0 )
+		return;
+	uint64_t one = 1;	//an eventfd needs 8 bytes, a pipe takes anything
+	ssize_t r = write(wakeWrite, &one, sizeof(one));
+	(void)r;			//if the pipe is full, the loop is awake anyway
+}
+
+
+void eventLoop::drainWake(void)
+{
+	uint64_t buf[16];
+	while( read(wakeRead, buf, sizeof(buf)) > 0 )
+		;
+}
+
+
+void eventLoop::post(eventTask *task)
+{
+	pthread_mutex_lock( &mutex );
+	tasks.push_back( task );
+	pthread_mutex_unlock( &mutex );
+	wake();
+}
+
+
+void eventLoop::offload(blockingTask *task)
+{
+	task->loop = this;
+	if( pool != NULL )
+		pool->queue( task );	//posts it back when it's done
+	else
+	{
+		task->work();
+		task->run();
+		delete task;
+	}
+}
+
+
+void eventLoop::runTasks(void)
+{
+	std::vector<eventTask*> todo;
+	pthread_mutex_lock( &mutex );
+	todo.swap( tasks );
+	pthread_mutex_unlock( &mutex );
+
+	for(size_t i=0; i < todo.size(); i++)
+	{
+		todo[i]->run();
+		delete todo[i];
+	}
+}
+
+
+/// Time to wait for events: not at all if connections have work left,
+/// otherwise until the next timer, or forever (-1) if there is none.
+int eventLoop::pollTimeout(bool pending)
+{
+	if( pending )
+		return 0;
+	return timerList.nextTimeout();
+}
+
+
+int eventLoop::run(void)
+{
+	if( servers.empty() )
+		return -1;
+	if( pollFD >= 0 )
+		return runEpoll();
+	return runSelect();
+}
+
+
+int eventLoop::runEpoll(void)
+{
+#ifdef USE_EPOLL
+	const int maxEvents = 64;
+	struct epoll_event events[maxEvents];
+
+	while( !stop )
+	{
+		// Don't wait if some connections still have work to do:
+		bool pending = false;
+		bool running = false;
+		for(size_t i=0; i < servers.size(); i++)
 		{
-			db_printf(1,"Error in select(): %s\n", strerror(errno));
+			pending |= servers[i]->hasPending();
+			running |= !servers[i]->stop;
 		}
-		else if (sresult > 0)
+		if( !running )
+			break;
+
+		int timeOut = pollTimeout(pending);
+		int n = epoll_wait(pollFD, events, maxEvents, timeOut);
+		if( (n < 0) && (errno != EINTR) )
+		{
+			db_printf(1,"Error in epoll_wait(): %s\n", strerror(errno));
+			return -1;
+		}
+
+		for(int i=0; i < n; i++)
 		{
-			//select has got something, check if it's the server:
-			if (FD_ISSET(ListenSocket, &tempset))
+			uint32_t idx = (uint32_t)(events[i].data.u64 >> 32);
+			SOCKET s     = (SOCKET)(events[i].data.u64 & 0xFFFFFFFF);
+			if( idx == wakeIdx )
 			{
-				struct sockaddr_in peername;
-				socklen_t peerlen = sizeof(peername);
+				drainWake();
+				continue;
+			}
+			if( idx >= servers.size() )
+				continue;
+
+			TCPserver *server = servers[idx];
+			uint32_t e = events[i].events;
+			if( (s == server->listenSocket) && (s >= 0) )
+				server->acceptAll();
+			else
+				server->setActive(s,
+					(e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0,
+					(e & EPOLLOUT) != 0 );
+		}
 
-				SOCKET clientSocket = accept(ListenSocket, (struct sockaddr *) &peername, &peerlen);
-				if(clientSocket < 0)
-				{
-					db_printf(1,"accept failed on socket %d: %s\n", clientSocket, strerror(errno) );
-					//close(serverSocket);
-					continue;
-				}
+		runTasks();
+		timerList.advance();
+		for(size_t i=0; i < servers.size(); i++)
+			servers[i]->serviceActive();
+	}
+#endif
+	return 0;
+}
 
-				db_printf(2,"accepting socket %i on serverport %i\n", clientSocket, port);
 
-				//for debug, get client info
-				char host[INET6_ADDRSTRLEN];
-				//inet_ntop(peername.ss_family, );
-				inet_ntop( AF_INET, (struct sockaddr *)&peername, host, sizeof(host)  );
+int eventLoop::runSelect(void)
+{
+	fd_set readset, writeset;
+	timeval tv;
+
+	while( !stop )
+	{
+		bool pending = false;
+		bool running = false;
+		FD_ZERO(&readset);
+		FD_ZERO(&writeset);
+		int maxfd = -1;
+		if( wakeRead >= 0 )
+		{
+			FD_SET(wakeRead, &readset);
+			maxfd = wakeRead;
+		}
 
+		for(size_t i=0; i < servers.size(); i++)
+		{
+			TCPserver *server = servers[i];
+			pending |= server->hasPending();
+			running |= !server->stop;
 
-				if( connections.size() < maxConnections)
-				{
-					FD_SET(clientSocket, &readset);
-					maxfd = util::max<size_t>(maxfd, clientSocket);
-					FD_CLR(ListenSocket, &tempset);	//server is handled, don't do it again in the comming for() loop
+			//TODO: Don't listen for new connections if max. connections is reached:
+			if( server->listenSocket >= 0 )
+			{
+				FD_SET(server->listenSocket, &readset);
+				maxfd = util::max(maxfd, server->listenSocket);
+			}
 
-                    //set client to non-blocking mode: (if server is non-blocking, the clients will also be)
-					setBlocking( clientSocket, false );
+			std::map<SOCKET, connections_s>::iterator it;
+			for(it = server->connections.begin(); it != server->connections.end(); it++)
+			{
+				maxfd = util::max(maxfd, it->first);
+				//some might not be ready for input
+				if( !it->second.handler->isReadBufBlocking() )
+					FD_SET(it->first, &readset);
+				if( it->second.needsWrite() )
+					FD_SET(it->first, &writeset);
+			}
+		}
+		if( !running )
+			break;
 
-					//create a new connection handler for this:
-					connectionHandler *C = newHandler(clientSocket);
-					connections.push_back( connections_s(clientSocket, C) );
+		// Time-out for the master-select()-call, NULL blocks until an event.
+		// Writes initiated from other threads wake the loop through wake().
+		int timeOut = pollTimeout(pending);
+		tv.tv_sec  = timeOut / 1000;
+		tv.tv_usec = (timeOut % 1000) * 1000;
 
-					//db_printf(2,"connected to %s, port %s\n", host, serv );
-				}
-				else
-				{
-					close(clientSocket);
-					db_printf(2,"refused connection to %s, serverport %i\n", host, port );
-				}
+		int sresult = select(maxfd + 1, &readset, &writeset, NULL, (timeOut < 0) ? NULL : &tv);
 
-			} // if FD_ISSET(ListenSocket)
+		if( (sresult < 0)  && (errno != EINTR) )
+		{
+			db_printf(1,"Error in select(): %s\n", strerror(errno));
+			return -1;
+		}
+		if( sresult > 0 )
+		{
+			if( (wakeRead >= 0) && FD_ISSET(wakeRead, &readset) )
+				drainWake();
 
-			//Now iterate over all clients:
-			for(int conn=0; conn < (int)connections.size(); conn++)
+			for(size_t i=0; i < servers.size(); i++)
 			{
-				connections_s *it = &connections[conn];
-				if (FD_ISSET(it->socket, &tempset) )			//handle reads
-				{
-					sresult = recv(it->socket, rxBuf, sizeof(rxBuf), 0);
-					bool keepOpen = true;
-
-					if(sresult > 0)
-						//accept the data:
-						keepOpen = it->handler->processRead(rxBuf, sresult);
-						//it->needsWrite = true;
-
-					if ((sresult == 0) || (!keepOpen) )
-					{
-						db_printf(3,"Closing client socket %i. recv = %i, keepOpen = %i, serverPortL %i\n", it->socket, sresult, keepOpen, port);
-						FD_CLR(it->socket, &readset);	//maxFD is updated at the start of while(!stop)
-						FD_CLR(it->socket, &writeset);
-						close( it->socket );
-						delete it->handler;
-						connections.erase( connections.begin() + conn );
-						conn--;			//update for-loop status
-                        continue;          //need to break, to prevent using non-existing connections in code below
-					}
-					else 	if( sresult < 0)
-					{
-						printf("Error on port %i socket %i in recv(): %s\n", port, it->socket,  strerror(errno));
-						FD_CLR(it->socket, &readset);	//maxFD is updated at the start of while(!stop)
-						FD_CLR(it->socket, &writeset);
-						delete it->handler;
-						connections.erase( connections.begin() + conn );	//this also deletes any outstanding write buffers
-						conn--;			//update for-loop status
-                        continue;          //need to break, to prevent using non-existing connections in code below
-					}
-				}
-				if (FD_ISSET(it->socket, &writeset) )		//handle writes
+				TCPserver *server = servers[i];
+				if( (server->listenSocket >= 0) && FD_ISSET(server->listenSocket, &readset) )
+					server->acceptAll();
+
+				std::map<SOCKET, connections_s>::iterator it;
+				for(it = server->connections.begin(); it != server->connections.end(); it++)
 				{
-					sresult = it->handler->writeBuf();
-					//if( sresult <= 0)	it->needsWrite = false;
-
-					if( it->handler->canClose() )
-					{
-						db_printf(3,"Closing client socket %i on port %i, done sending\n", it->socket, port);
-						FD_CLR(it->socket, &readset);	//maxFD is updated at the start of while(!stop)
-						FD_CLR(it->socket, &writeset);
-						close( it->socket );
-						delete it->handler;
-						connections.erase( connections.begin() + conn );
-						conn--;			//update for-loop status
-                        continue;          //need to break, to prevent using non-existing connections in code below
-					}
+					bool r = FD_ISSET(it->first, &readset);
+					bool w = FD_ISSET(it->first, &writeset);
+					if( r || w )
+						server->setActive(it->first, r, w);
 				}
-			} //for j=0..all clients
-		} //select call succesfull
-	} //while !stop
-
-	db_printf(1,"Closing server on port %i\n", port);
-
-	//close server connection
-	close(ListenSocket);
+			}
+		}
 
+		runTasks();
+		timerList.advance();
+		for(size_t i=0; i < servers.size(); i++)
+			servers[i]->serviceActive();
+	}
 	return 0;
 }
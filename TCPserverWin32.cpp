@@ -46,37 +46,79 @@ const static winSockInit _winSockInit;
 TCPserver::TCPserver(int port, int maxCon): 
 		port(port),
 		maxConnections(maxCon),
-		stop(false)
+		loop(NULL),
+		loopIdx(-1),
+		listenSocket(INVALID_SOCKET),
+		acceptor(NULL),
+		nextWorker(0),
+		reusePort(false),
+		stop(false),
+		idleTimeout(0)
 {
+	pthread_mutex_init( &wakeMutex, NULL );
 	db_printf(2,"TCPserver: port %i\n",port);
 }
 
 
-// Info on all clients:
-struct connections_s
+TCPserver::~TCPserver()
 {
-	SOCKET socket;
-	connectionHandler *handler;
-	//bool needsWrite;	//when handler->writeBuf() returns >0, this stays true
+	pthread_mutex_destroy( &wakeMutex );
+}
 
-	bool needsWrite(void)
-	{
-		bool needsWrite = (handler->bufsRemaining() > 0) && (!handler->isWriteBufBlocking());
-		return needsWrite;
-	}
 
+// Nothing to wake yet, select() checks all connections each iteration:
+void TCPserver::wake(SOCKET s)
+{
+}
 
-	connections_s(SOCKET s, connectionHandler* h):
-		socket(s), handler(h)
-		//, needsWrite(false)
-	{}
 
-	~connections_s()
-	{
-	}
-};
+// Without a shared loop thread, tasks run right away:
+void TCPserver::post(eventTask *task)
+{
+	task->run();
+	delete task;
+}
+
+
+// The select() loop keeps no timers, idleTimeout is not enforced here:
+util::timerWheel *TCPserver::timers(void)
+{
+	return NULL;
+}
+
+
+void connections_s::idleTimer_s::expire(void)
+{
+}
+
+
+// Without a shared loop thread, blocking tasks run right away:
+void TCPserver::offload(blockingTask *task)
+{
+	task->work();
+	task->run();
+	delete task;
+}
+
+
+void eventLoop::offload(blockingTask *task)
+{
+	task->loop = this;
+	task->work();
+	task->run();
+	delete task;
+}
+
+
+// Winsock can't share a listening port, so only the first server accepts
+// connections, and the workers stay idle.
+void TCPserver::share(TCPserver *worker)
+{
+	worker->acceptor = this;
+	workers.push_back( worker );
+}
+
 
-	
 SOCKET setupListenSocket(int port)
 {
 	char portStr[6];
@@ -155,6 +197,9 @@ void closeHandler(std::vector<connections_s>& connections, size_t idx, fd_set *r
 /// handle multiple connections:
 int TCPserver::runNonBlock()
 {
+	if( acceptor != NULL )
+		return 0;		//see share()
+
 	// Buffer for incoming data:
 	char rxBuf[ 1<<15 ];	//receive max. 32kb at once, larger data will be handled in multiple iterations
 
@@ -305,7 +350,8 @@ int TCPserver::runNonBlock()
 
 					//create a new connection handler for this:
 					connectionHandler *C = newHandler(ClientSocket);
-					connections.push_back( connections_s(ClientSocket, C) );
+					C->server = this;
+					connections.push_back( connections_s(ClientSocket, C, this) );
 
 					//db_printf(2,"connected to %s, port %s\n", host, serv );
 					db_printf(2,"Opening client socket %4i on port %i, to %s:%s\n", ClientSocket, port, host,serv );
@@ -368,3 +414,81 @@ int TCPserver::runNonBlock()
 	return 0;
 }
 
+
+
+//--------------------------- Event loop ---------------------------------------
+// Winsock has no eventfd, so each server keeps running its own select() loop
+// in a thread, and slimIPC still wakes them with a loopback connect.
+
+static void *serverThread(void *ptr)
+{
+	TCPserver *server = (TCPserver *)ptr;
+	int i = server->runNonBlock();
+	db_printf(1,"server on port %i returned : %i\n", server->getPort(), i);
+	return 0;
+}
+
+
+eventLoop::eventLoop():
+	pollFD(-1),
+	wakeRead(-1),
+	wakeWrite(-1),
+	stop(false),
+	pool(NULL)
+{
+	pthread_mutex_init( &mutex, NULL );
+
+	// Control frames and audio keep flowing while large pages are sent:
+	weight[connectionHandler::WRITE_CONTROL] = 4;
+	weight[connectionHandler::WRITE_STREAM]  = 4;
+	weight[connectionHandler::WRITE_WEB]     = 1;
+	memset( stats, 0, sizeof(stats) );
+}
+
+
+eventLoop::~eventLoop()
+{
+	pthread_mutex_destroy( &mutex );
+}
+
+
+bool eventLoop::add(TCPserver *server)
+{
+	servers.push_back( server );
+	return true;
+}
+
+
+int eventLoop::run(void)
+{
+	if( servers.empty() )
+		return -1;
+
+	std::vector<pthread_t> threads( servers.size()-1 );
+	for(size_t i=1; i < servers.size(); i++)
+		pthread_create( &threads[i-1], NULL, serverThread, servers[i] );
+
+	int r = servers[0]->runNonBlock();
+
+	for(size_t i=1; i < servers.size(); i++)
+	{
+		servers[i]->stop = true;
+		pthread_join( threads[i-1], NULL );
+	}
+	return r;
+}
+
+
+void eventLoop::wake(void)
+{
+}
+
+
+/// Without a shared loop thread, tasks run right away, one at a time.
+void eventLoop::post(eventTask *task)
+{
+	pthread_mutex_lock( &mutex );
+	task->run();
+	pthread_mutex_unlock( &mutex );
+	delete task;
+}
@@ -25,6 +25,7 @@
 //--------------------------- Includes -----------------------------------------
 
 #include <string.h>
+#include <ctype.h>
 #include <stdint.h>
 
 #ifdef USE_TAGLIB
@@ -57,48 +58,796 @@ using namespace std;
 const std::string fileInfo::strEmpty; // = "";
 
 
-/// Get mime type, based on the extension of a filename
-std::string getMime(const char *extension)
+
+//--------------------------- Seek index ---------------------------------------
+
+namespace seek
 {
-	const char *mimeTable[][2] = {
-		{"mp3" , "audio/mpeg"},
-		{"aif" , "audio/x-aiff"},
-		{"wav" , "audio/x-wav"},
-		{"flac", "audio/flac"},
-		{"ogg" , "audio/ogg"},
-		{"txt" , "text/plain"},
-		{"html", "text/html"},
-		{"htm" , "text/html"},
-		{"png" , "image/png"},
-		{"jpg" , "image/jpeg"},
-		{"svg" , "image/svg+xml"},
-		{"z"   , "application/x-compress"},
-		{"m3u" , "audio/x-playlist"},		//not really an official type..
-
-		{"js"  , "text/javascript"},
-		{"json", "text/plain"},
+	uint32_t be32(const uint8_t *p)
+	{
+		return ((uint32_t)p[0]<<24) | ((uint32_t)p[1]<<16) | ((uint32_t)p[2]<<8) | p[3];
+	}
+
+	uint64_t be64(const uint8_t *p)
+	{
+		return ((uint64_t)be32(p)<<32) | be32(p+4);
+	}
+
+	/// Size of an ID3v2 tag at the start of the file, 0 if there is none
+	uint32_t id3v2Size(FILE *f)
+	{
+		uint8_t hdr[10];
+		fseek(f, 0, SEEK_SET);
+		if( fread(hdr, sizeof(hdr), 1, f) != 1 )
+			return 0;
+		if( memcmp(hdr, "ID3", 3) != 0 )
+			return 0;
+		uint32_t size = ((hdr[6]&0x7F)<<21) | ((hdr[7]&0x7F)<<14) | ((hdr[8]&0x7F)<<7) | (hdr[9]&0x7F);
+		size += 10;
+		if( hdr[5] & 0x10 )	//footer present
+			size += 10;
+		return size;
+	}
+
+	/// Decoded mpeg frame header
+	struct mpegFrame {
+		int version;		//0: mpeg1, 1: mpeg2, 2: mpeg2.5
+		int layer;
+		int bitrate;		//kbit/s
+		int sampleRate;
+		int samplesPerFrame;
+		int sideInfoSize;	//bytes between frame header and a Xing header
 	};
 
-	std::string mime;
+	bool parseMpegFrame(const uint8_t *h, mpegFrame *frame)
+	{
+		static const int bitrates[2][3][16] = {
+			{	{ 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0 },
+				{ 0, 32, 48, 56, 64,  80,  96,  112, 128, 160, 192, 224, 256, 320, 384, 0 },
+				{ 0, 32, 40, 48, 56,  64,  80,  96,  112, 128, 160, 192, 224, 256, 320, 0 } },
+			{	{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0 },
+				{ 0, 8,  16, 24, 32, 40, 48, 56,  64,  80,  96,  112, 128, 144, 160, 0 },
+				{ 0, 8,  16, 24, 32, 40, 48, 56,  64,  80,  96,  112, 128, 144, 160, 0 } }
+		};
+		static const int sampleRates[3][4] = {
+			{ 44100, 48000, 32000, 0 },
+			{ 22050, 24000, 16000, 0 },
+			{ 11025, 12000, 8000,  0 }
+		};
+
+		if( (h[0] != 0xFF) || ((h[1] & 0xE0) != 0xE0) )
+			return false;
+
+		int versionBits = (h[1] >> 3) & 3;
+		int layerBits   = (h[1] >> 1) & 3;
+		if( (versionBits == 1) || (layerBits == 0) )
+			return false;
+
+		frame->version = (versionBits == 3) ? 0 : (versionBits == 2 ? 1 : 2);
+		frame->layer   = 4 - layerBits;
+
+		int v = (frame->version == 0) ? 0 : 1;
+		frame->bitrate    = bitrates[v][frame->layer-1][h[2] >> 4];
+		frame->sampleRate = sampleRates[frame->version][(h[2] >> 2) & 3];
+		if( (frame->bitrate == 0) || (frame->sampleRate == 0) )
+			return false;
+
+		if( frame->layer == 1 )
+			frame->samplesPerFrame = 384;
+		else if( (frame->layer == 3) && (v == 1) )
+			frame->samplesPerFrame = 576;
+		else
+			frame->samplesPerFrame = 1152;
+
+		bool mono = ((h[3] >> 6) & 3) == 3;
+		if( v == 0 )
+			frame->sideInfoSize = mono ? 17 : 32;
+		else
+			frame->sideInfoSize = mono ? 9 : 17;
+		return true;
+	}
 
-	size_t mimeIdx = array_size(mimeTable);
-	if( extension != NULL)
+
+	bool buildMpeg(FILE *f, uint32_t fsize, seekIndex *idx)
 	{
-		if( *extension == '.')
-			extension++;
+		uint8_t buf[4096];
 
-		for(mimeIdx=0; mimeIdx< array_size(mimeTable); mimeIdx++)
-			if( strcasecmp(extension, mimeTable[mimeIdx][0]) == 0)
+		// Trailing ID3v1 tag is not audio:
+		idx->dataEnd = fsize;
+		if( fsize > 128 )
+		{
+			fseek(f, -128, SEEK_END);
+			if( (fread(buf, 3, 1, f) == 1) && (memcmp(buf, "TAG", 3) == 0) )
+				idx->dataEnd -= 128;
+		}
+
+		// Find the first frame after the ID3v2 tag:
+		uint32_t start = id3v2Size(f);
+		fseek(f, start, SEEK_SET);
+		size_t n = fread(buf, 1, sizeof(buf), f);
+		if( n < 4 )
+			return false;
+
+		mpegFrame frame;
+		size_t i;
+		for(i=0; i+4 <= n; i++)
+			if( parseMpegFrame(buf+i, &frame) )
 				break;
+		if( i+4 > n )
+			return false;
+		uint32_t firstFrame = start + i;
+
+		// Check for a Xing/Info header in the first frame:
+		uint32_t nrFrames = 0;
+		const uint8_t *xing = buf + i + 4 + frame.sideInfoSize;
+		if( (xing + 8 + 4 + 4 + 100 <= buf + n) &&
+			( (memcmp(xing, "Xing", 4) == 0) || (memcmp(xing, "Info", 4) == 0) ) )
+		{
+			uint32_t flags = be32(xing+4);
+			const uint8_t *p = xing + 8;
+			uint32_t nrBytes = 0;
+			if( flags & 1 ) { nrFrames = be32(p);	p += 4; }
+			if( flags & 2 ) { nrBytes  = be32(p);	p += 4; }
+			if( nrBytes == 0 )
+				nrBytes = idx->dataEnd - firstFrame;
+
+			if( (flags & 1) && (nrFrames > 0) )
+			{
+				idx->lengthMs = (uint32_t)( (uint64_t)nrFrames * frame.samplesPerFrame * 1000 / frame.sampleRate );
+				if( flags & 4 )
+				{
+					for(int t=0; t < 100; t++)
+						idx->points.push_back( seekIndex::point(
+								(uint32_t)( (uint64_t)idx->lengthMs * t / 100 ),
+								firstFrame + (uint32_t)( (uint64_t)p[t] * nrBytes / 256 ) ) );
+					idx->points.push_back( seekIndex::point(idx->lengthMs, idx->dataEnd) );
+					return true;
+				}
+			}
+		}
+
+		// No table of contents, assume a constant bitrate. The frames then have
+		// a constant average length (the padding byte keeps it exact), so a
+		// point about every second can be put at the start of a frame:
+		uint64_t num = (uint64_t)frame.samplesPerFrame * frame.bitrate * 125;	//bytes per frame = num/den
+		uint64_t den = frame.sampleRate;
+		if( nrFrames > 0 )
+		{	//from the Info header, also right for a variable bitrate on average:
+			num = idx->dataEnd - firstFrame;
+			den = nrFrames;
+		}
+		else
+		{
+			idx->lengthMs = (uint32_t)( (uint64_t)(idx->dataEnd - firstFrame) * 8 / frame.bitrate );
+			nrFrames = (uint32_t)( (uint64_t)(idx->dataEnd - firstFrame) * den / num );
+		}
+		uint32_t framesPerPoint = util::max( frame.sampleRate / frame.samplesPerFrame, 1 );
+		for(uint32_t k=0; k < nrFrames; k += framesPerPoint)
+			idx->points.push_back( seekIndex::point(
+					(uint32_t)( (uint64_t)k * frame.samplesPerFrame * 1000 / frame.sampleRate ),
+					firstFrame + (uint32_t)( k * num / den ) ) );
+		idx->points.push_back( seekIndex::point(idx->lengthMs, idx->dataEnd) );
+		return true;
 	}
-	if( mimeIdx < array_size(mimeTable))
-		mime = mimeTable[mimeIdx][1];
-	else
-		mime = "application/octet-stream";
-	return mime;
+
+
+	/// Sample number at which the flac frame with its header at 'h' starts,
+	/// or -1 if it isn't a valid header. 'h' must have room for the longest
+	/// header, 16 bytes. Fixed blocksize streams number their frames instead.
+	int64_t parseFlacFrame(const uint8_t *h, uint32_t blockSize)
+	{
+		if( (h[0] != 0xFF) || ((h[1] & 0xFE) != 0xF8) )
+			return -1;
+		int sizeCode = h[2] >> 4;
+		int rateCode = h[2] & 0x0F;
+		if( (sizeCode == 0) || (rateCode == 15) || ((h[3] >> 4) > 10) || (h[3] & 1) )
+			return -1;
+
+		// The frame or sample number is utf-8 coded:
+		size_t n = 4;
+		int ones = 0;
+		while( (ones < 8) && (h[n] & (0x80 >> ones)) )
+			ones++;
+		if( (ones == 1) || (ones == 8) )
+			return -1;
+		uint64_t number = h[n++] & (0x7F >> ones);
+		for(int i=1; i < ones; i++, n++)
+		{
+			if( (h[n] & 0xC0) != 0x80 )
+				return -1;
+			number = (number << 6) | (h[n] & 0x3F);
+		}
+		if( sizeCode == 6 ) n += 1;
+		if( sizeCode == 7 ) n += 2;
+		if( rateCode == 12 ) n += 1;
+		if( (rateCode == 13) || (rateCode == 14) ) n += 2;
+
+		// Audio data can look like a header too, the crc makes sure:
+		uint8_t crc = 0;
+		for(size_t i=0; i < n; i++)
+		{
+			crc ^= h[i];
+			for(int b=0; b < 8; b++)
+				crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+		}
+		if( crc != h[n] )
+			return -1;
+		return (h[1] & 1) ? (int64_t)number : (int64_t)(number * blockSize);
+	}
+
+
+	/// Without a seektable, find a frame about every second. Only the first
+	/// header after each guessed offset is read, not the whole file.
+	bool scanFlac(FILE *f, uint32_t sampleRate, uint32_t blockSize, uint32_t maxFrameSize, seekIndex *idx)
+	{
+		uint32_t firstFrame = idx->points.back().offset;
+		if( (idx->lengthMs < 1000) || (blockSize == 0) )
+			return false;
+
+		uint32_t bytesPerSec = (uint32_t)( (uint64_t)(idx->dataEnd - firstFrame) * 1000 / idx->lengthMs );
+		std::vector<uint8_t> buf( util::min<uint32_t>( (maxFrameSize > 0) ? maxFrameSize + 16 : 16384, 65536 ) );
+		for(uint32_t pos = firstFrame + bytesPerSec; (bytesPerSec > 0) && (pos < idx->dataEnd); pos += bytesPerSec)
+		{
+			fseek(f, pos, SEEK_SET);
+			size_t len = fread(&buf[0], 1, buf.size(), f);
+			for(size_t i=0; i+16 <= len; i++)
+			{
+				int64_t sample = parseFlacFrame(&buf[i], blockSize);
+				if( sample < 0 )
+					continue;
+				uint32_t ms = (uint32_t)( sample * 1000 / sampleRate );
+				if( (ms > idx->points.back().ms) && (ms < idx->lengthMs) && (pos + i > idx->points.back().offset) )
+					idx->points.push_back( seekIndex::point(ms, pos + (uint32_t)i) );
+				break;
+			}
+		}
+		return idx->points.size() > 1;
+	}
+
+
+	bool buildFlac(FILE *f, uint32_t fsize, seekIndex *idx)
+	{
+		uint8_t hdr[4];
+		uint32_t start = id3v2Size(f);
+		fseek(f, start, SEEK_SET);
+		if( (fread(hdr, 4, 1, f) != 1) || (memcmp(hdr, "fLaC", 4) != 0) )
+		{
+			// Only a few files have an ID3 tag in front, try without:
+			start = 0;
+			fseek(f, 0, SEEK_SET);
+			if( (fread(hdr, 4, 1, f) != 1) || (memcmp(hdr, "fLaC", 4) != 0) )
+				return false;
+		}
+
+		uint32_t sampleRate = 0;
+		uint64_t nrSamples  = 0;
+		uint32_t blockSize  = 0;
+		uint32_t maxFrameSize = 0;
+		std::vector<std::pair<uint64_t,uint64_t> > table;	//sample number, offset to first frame
+
+		// Walk all metadata blocks:
+		bool isLast = false;
+		while( !isLast )
+		{
+			if( fread(hdr, 4, 1, f) != 1 )
+				return false;
+			isLast = (hdr[0] & 0x80) != 0;
+			int type = hdr[0] & 0x7F;
+			uint32_t len = (hdr[1]<<16) | (hdr[2]<<8) | hdr[3];
+			long next = ftell(f) + len;
+
+			if( (type == 0) && (len >= 18) )	//STREAMINFO
+			{
+				uint8_t si[18];
+				if( fread(si, sizeof(si), 1, f) != 1 )
+					return false;
+				blockSize    = (si[2]<<8) | si[3];		//the maximum, all but the last frame for a fixed size
+				maxFrameSize = (si[7]<<16) | (si[8]<<8) | si[9];
+				sampleRate   = (si[10]<<12) | (si[11]<<4) | (si[12]>>4);
+				nrSamples    = ((uint64_t)(si[13] & 0x0F)<<32) | be32(si+14);
+			}
+			else if( type == 3 )				//SEEKTABLE
+			{
+				uint8_t sp[18];
+				for(uint32_t i=0; i < len/18; i++)
+				{
+					if( fread(sp, sizeof(sp), 1, f) != 1 )
+						return false;
+					uint64_t sample = be64(sp);
+					if( sample != (uint64_t)(-1) )	//skip placeholders
+						table.push_back( std::pair<uint64_t,uint64_t>( sample, be64(sp+8) ) );
+				}
+			}
+			fseek(f, next, SEEK_SET);
+		}
+		if( sampleRate == 0 )
+			return false;
+
+		uint32_t firstFrame = ftell(f);
+		idx->headerStart = start;
+		idx->headerSize  = firstFrame - start;
+		idx->dataEnd     = fsize;
+		idx->lengthMs    = (uint32_t)( nrSamples * 1000 / sampleRate );
+
+		idx->points.push_back( seekIndex::point(0, firstFrame) );
+		for(size_t i=0; i < table.size(); i++)
+		{
+			uint32_t ms = (uint32_t)( table[i].first * 1000 / sampleRate );
+			if( ms > idx->points.back().ms )
+				idx->points.push_back( seekIndex::point(ms, firstFrame + (uint32_t)table[i].second) );
+		}
+		// Only the start would restart the song, rather refuse to seek then:
+		if( (table.size() == 0) && !scanFlac(f, sampleRate, blockSize, maxFrameSize, idx) )
+			return false;
+		if( idx->lengthMs > idx->points.back().ms )
+			idx->points.push_back( seekIndex::point(idx->lengthMs, idx->dataEnd) );
+		return true;
+	}
+
+} //namespace seek
+
+
+
+//--------------------------- Native container parsers -------------------------
+
+// Used in both builds: taglib doesn't give the data offsets needed to stream these.
+
+uint16_t le16(const uint8_t *p)
+{
+	return p[0] | (p[1]<<8);
+}
+
+uint32_t le32(const uint8_t *p)
+{
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+uint64_t le64(const uint8_t *p)
+{
+	return le32(p) | ((uint64_t)le32(p+4)<<32);
+}
+
+
+/// Layout of uncompressed audio in a wav or aiff file
+struct pcmLayout
+{
+	int channels;
+	int bits;
+	uint32_t sampleRate;
+	uint32_t dataStart;		///< file offset of the first sample
+	uint32_t dataSize;		///< in bytes, clipped to the file size
+
+	pcmLayout(): channels(0), bits(0), sampleRate(0), dataStart(0), dataSize(0)
+	{ }
+
+	uint32_t blockAlign(void) const
+	{
+		return channels * ((bits+7)/8);
+	}
+
+	uint32_t lengthMs(void) const
+	{
+		if( (sampleRate == 0) || (blockAlign() == 0) )
+			return 0;
+		return (uint32_t)( (uint64_t)(dataSize / blockAlign()) * 1000 / sampleRate );
+	}
+
+	void setInfo(fileInfo *info) const
+	{
+		info->nrBits     = bits;
+		info->nrChannels = channels;
+		info->sampleRate = sampleRate;
+		info->length     = lengthMs() / 1000;
+		info->isAudioFile= (sampleRate > 0) && (channels > 0);
+	}
+
+	bool setIndex(seekIndex *idx) const
+	{
+		idx->dataEnd    = dataStart + dataSize;
+		idx->lengthMs   = lengthMs();
+		idx->blockAlign = blockAlign();
+		idx->points.push_back( seekIndex::point(0, dataStart) );
+		if( idx->lengthMs > 0 )
+			idx->points.push_back( seekIndex::point(idx->lengthMs, idx->dataEnd) );
+		return idx->blockAlign > 0;
+	}
+};
+
+
+namespace wav
+{
+	/// Walk the RIFF chunks up to the 'data' chunk
+	bool parse(FILE *f, uint32_t fsize, pcmLayout *pcm)
+	{
+		uint8_t hdr[12];
+		fseek(f, 0, SEEK_SET);
+		if( fread(hdr, sizeof(hdr), 1, f) != 1 )
+			return false;
+		if( (memcmp(hdr, "RIFF", 4) != 0) || (memcmp(hdr+8, "WAVE", 4) != 0) )
+			return false;
+
+		bool haveFmt = false;
+		uint32_t pos = sizeof(hdr);
+		while( pos + 8 <= fsize )
+		{
+			uint8_t chunk[8];
+			fseek(f, pos, SEEK_SET);
+			if( fread(chunk, sizeof(chunk), 1, f) != 1 )
+				return false;
+			uint32_t len = le32(chunk+4);
+
+			if( (memcmp(chunk, "fmt ", 4) == 0) && (len >= 16) )
+			{
+				uint8_t fmt[16];
+				if( fread(fmt, sizeof(fmt), 1, f) != 1 )
+					return false;
+				uint16_t tag = le16(fmt);
+				if( (tag != 1) && (tag != 0xFFFE) )	//only plain (or extensible) pcm
+					return false;
+				pcm->channels   = le16(fmt+2);
+				pcm->sampleRate = le32(fmt+4);
+				pcm->bits       = le16(fmt+14);
+				haveFmt = true;
+			}
+			else if( memcmp(chunk, "data", 4) == 0 )
+			{
+				pcm->dataStart = pos + 8;
+				pcm->dataSize  = util::min(len, fsize - pcm->dataStart);
+				return haveFmt;
+			}
+			pos += 8 + len + (len & 1);	//chunks are word aligned
+		}
+		return false;
+	}
+
+	bool probe(const char *fname, fileInfo *info)
+	{
+		FILE *f = fopen(fname, "rb");
+		if( f == NULL )
+			return false;
+		fseek(f, 0, SEEK_END);
+		uint32_t fsize = ftell(f);
+
+		pcmLayout pcm;
+		if( parse(f, fsize, &pcm) )
+			pcm.setInfo(info);
+		fclose(f);
+		return info->isAudioFile;
+	}
+
+	bool buildIndex(FILE *f, uint32_t fsize, seekIndex *idx)
+	{
+		pcmLayout pcm;
+		return parse(f, fsize, &pcm) && pcm.setIndex(idx);
+	}
+}
+
+
+namespace aiff
+{
+	/// Convert the 80 bit IEEE-754 extended sample rate
+	uint32_t extendedToInt(const uint8_t *p)
+	{
+		int exponent = ((p[0] & 0x7F)<<8) | p[1];
+		uint64_t mantissa = seek::be64(p+2);
+		int shift = 16383 + 63 - exponent;
+		if( (shift < 0) || (shift > 63) )
+			return 0;
+		return (uint32_t)(mantissa >> shift);
+	}
+
+	/// Walk the IFF chunks up to the 'SSND' chunk
+	bool parse(FILE *f, uint32_t fsize, pcmLayout *pcm)
+	{
+		uint8_t hdr[12];
+		fseek(f, 0, SEEK_SET);
+		if( fread(hdr, sizeof(hdr), 1, f) != 1 )
+			return false;
+		if( (memcmp(hdr, "FORM", 4) != 0) || (memcmp(hdr+8, "AIFF", 4) != 0) )
+			return false;
+
+		bool haveComm = false;
+		uint32_t pos = sizeof(hdr);
+		while( pos + 8 <= fsize )
+		{
+			uint8_t chunk[8];
+			fseek(f, pos, SEEK_SET);
+			if( fread(chunk, sizeof(chunk), 1, f) != 1 )
+				return false;
+			uint32_t len = seek::be32(chunk+4);
+
+			if( (memcmp(chunk, "COMM", 4) == 0) && (len >= 18) )
+			{
+				uint8_t comm[18];
+				if( fread(comm, sizeof(comm), 1, f) != 1 )
+					return false;
+				pcm->channels   = (comm[0]<<8) | comm[1];
+				pcm->bits       = (comm[6]<<8) | comm[7];
+				pcm->sampleRate = extendedToInt(comm+8);
+				haveComm = true;
+			}
+			else if( (memcmp(chunk, "SSND", 4) == 0) && (len >= 8) )
+			{
+				uint8_t ssnd[8];
+				if( fread(ssnd, sizeof(ssnd), 1, f) != 1 )
+					return false;
+				uint32_t offset = seek::be32(ssnd);
+				pcm->dataStart = pos + 16 + offset;
+				if( pcm->dataStart > fsize )
+					return false;
+				pcm->dataSize  = util::min(len - 8 - offset, fsize - pcm->dataStart);
+				return haveComm;
+			}
+			pos += 8 + len + (len & 1);
+		}
+		return false;
+	}
+
+	bool probe(const char *fname, fileInfo *info)
+	{
+		FILE *f = fopen(fname, "rb");
+		if( f == NULL )
+			return false;
+		fseek(f, 0, SEEK_END);
+		uint32_t fsize = ftell(f);
+
+		pcmLayout pcm;
+		if( parse(f, fsize, &pcm) )
+			pcm.setInfo(info);
+		fclose(f);
+		return info->isAudioFile;
+	}
+
+	bool buildIndex(FILE *f, uint32_t fsize, seekIndex *idx)
+	{
+		pcmLayout pcm;
+		return parse(f, fsize, &pcm) && pcm.setIndex(idx);
+	}
+}
+
+
+namespace ogg
+{
+	/// Ogg vorbis stream properties
+	struct stream
+	{
+		int channels;
+		uint32_t sampleRate;
+		uint32_t headerEnd;		///< end of the page with the last vorbis header packet
+		uint64_t nrSamples;		///< granule position of the last page
+		std::vector<std::string> comments;	///< "KEY=value" strings
+
+		stream(): channels(0), sampleRate(0), headerEnd(0), nrSamples(0)
+		{ }
+
+		uint32_t lengthMs(void) const
+		{
+			return (sampleRate > 0) ? (uint32_t)(nrSamples * 1000 / sampleRate) : 0;
+		}
+	};
+
+	/// Interpret one of the three vorbis header packets
+	bool parsePacket(int nr, const std::string &pkt, stream *s)
+	{
+		const uint8_t *p = (const uint8_t*)pkt.data();
+		if( (pkt.size() < 7) || (p[0] != 2*nr + 1) || (memcmp(p+1, "vorbis", 6) != 0) )
+			return false;
+
+		if( nr == 0 )	//identification
+		{
+			if( pkt.size() < 16 )
+				return false;
+			s->channels   = p[11];
+			s->sampleRate = le32(p+12);
+		}
+		else if( nr == 1 )	//comments
+		{
+			size_t pos = 7;
+			if( pos + 4 > pkt.size() )
+				return false;
+			pos += 4 + le32(p+pos);		//skip vendor string
+			if( pos + 4 > pkt.size() )
+				return false;
+			uint32_t count = le32(p+pos);
+			pos += 4;
+			for(uint32_t i=0; (i < count) && (pos + 4 <= pkt.size()); i++)
+			{
+				uint32_t len = le32(p+pos);
+				pos += 4;
+				if( pos + len > pkt.size() )
+					break;
+				s->comments.push_back( pkt.substr(pos, len) );
+				pos += len;
+			}
+		}
+		return true;
+	}
+
+	bool parse(FILE *f, uint32_t fsize, stream *s)
+	{
+		// The three header packets precede all audio, and the first audio
+		// packet starts on a new page:
+		std::vector<uint8_t> buf( util::min(fsize, (uint32_t)256*1024) );
+		fseek(f, 0, SEEK_SET);
+		if( buf.empty() || (fread(&buf[0], buf.size(), 1, f) != 1) )
+			return false;
+
+		std::string packet;
+		int nrPackets = 0;
+		uint32_t pos = 0;
+		while( nrPackets < 3 )
+		{
+			if( (pos + 27 > buf.size()) || (memcmp(&buf[pos], "OggS", 4) != 0) )
+				return false;
+			int nrSegments = buf[pos+26];
+			uint32_t body = pos + 27 + nrSegments;
+			if( body > buf.size() )
+				return false;
+			for(int i=0; i < nrSegments; i++)
+			{
+				int lace = buf[pos+27+i];
+				if( body + lace > buf.size() )
+					return false;
+				packet.append( (const char*)&buf[body], lace );
+				body += lace;
+				if( lace < 255 )	//packet complete
+				{
+					if( (nrPackets < 3) && !parsePacket(nrPackets, packet, s) )
+						return false;
+					nrPackets++;
+					packet.clear();
+				}
+			}
+			pos = body;
+		}
+		s->headerEnd = pos;
+
+		// The length follows from the granule position of the last page:
+		uint32_t tailSize = util::min(fsize, (uint32_t)64*1024);
+		buf.resize(tailSize);
+		fseek(f, fsize - tailSize, SEEK_SET);
+		if( fread(&buf[0], tailSize, 1, f) != 1 )
+			return false;
+		for(int i = (int)tailSize - 27; i >= 0; i--)
+			if( (memcmp(&buf[i], "OggS", 4) == 0) && (le64(&buf[i+6]) != (uint64_t)(-1)) )
+			{
+				s->nrSamples = le64(&buf[i+6]);
+				break;
+			}
+		return s->sampleRate > 0;
+	}
+
+	bool probe(const char *fname, fileInfo *info)
+	{
+		FILE *f = fopen(fname, "rb");
+		if( f == NULL )
+			return false;
+		fseek(f, 0, SEEK_END);
+		uint32_t fsize = ftell(f);
+
+		stream s;
+		bool ok = parse(f, fsize, &s);
+		fclose(f);
+		if( !ok )
+			return false;
+
+		info->nrBits     = 16;
+		info->nrChannels = s.channels;
+		info->sampleRate = s.sampleRate;
+		info->length     = s.lengthMs() / 1000;
+		info->isAudioFile= true;
+
+		const char *keys[][2] = {
+			{"ARTIST", "artist"},
+			{"ALBUM" , "album" },
+			{"TITLE" , "title" },
+			{"GENRE" , "genre" },
+			{"DATE"  , "year"  },
+			{"TRACKNUMBER", "track"},
+		};
+		for(size_t i=0; i < s.comments.size(); i++)
+		{
+			const std::string &c = s.comments[i];
+			size_t eq = c.find('=');
+			if( eq == std::string::npos )
+				continue;
+			std::string key   = c.substr(0, eq);
+			std::string value = c.substr(eq+1);
+
+			for(size_t k=0; k < array_size(keys); k++)
+				if( strcasecmp(key.c_str(), keys[k][0]) == 0 )
+					info->tags[ keys[k][1] ] = value;
+			if( strcasecmp(key.c_str(), "REPLAYGAIN_TRACK_GAIN") == 0 )
+				sscanf( value.c_str(), "%f", &info->gainTrack );
+			if( strcasecmp(key.c_str(), "REPLAYGAIN_ALBUM_GAIN") == 0 )
+				sscanf( value.c_str(), "%f", &info->gainAlbum );
+		}
+		return true;
+	}
+
+	/// The player needs the header pages, and re-synchronizes on the next
+	/// page boundary after a seek, so the points are estimates about every second.
+	bool buildIndex(FILE *f, uint32_t fsize, seekIndex *idx)
+	{
+		stream s;
+		if( !parse(f, fsize, &s) )
+			return false;
+		idx->headerStart = 0;
+		idx->headerSize  = s.headerEnd;
+		idx->dataEnd     = fsize;
+		idx->lengthMs    = s.lengthMs();
+		idx->points.push_back( seekIndex::point(0, s.headerEnd) );
+		if( idx->lengthMs > 0 )
+		{
+			uint32_t nrBytes = fsize - s.headerEnd;
+			for(uint32_t ms=1000; ms < idx->lengthMs; ms += 1000)
+				idx->points.push_back( seekIndex::point(ms,
+						s.headerEnd + (uint32_t)( (uint64_t)nrBytes * ms / idx->lengthMs ) ) );
+			idx->points.push_back( seekIndex::point(idx->lengthMs, fsize) );
+		}
+		return true;
+	}
+}
+
+
+
+
+bool seekIndex::build(const char *fname)
+{
+	points.clear();
+	headerStart = headerSize = dataEnd = lengthMs = blockAlign = 0;
+
+	const fileFormat *format = getFormat( strrchr(fname,'.') );
+	if( (format == NULL) || (format->buildIndex == NULL) )
+		return false;
+	FILE *f = fopen(fname, "rb");
+	if( f == NULL )
+		return false;
+
+	fseek(f, 0, SEEK_END);
+	uint32_t fsize = ftell(f);
+
+	bool ok = format->buildIndex(f, fsize, this);
+	fclose(f);
+
+	db_printf(5,"seekIndex(%s): %llu points, %u ms\n", fname, (LLU)points.size(), lengthMs );
+	return ok && (points.size() > 0);
+}
+
+
+uint32_t seekIndex::lookup(uint32_t ms, uint32_t *startMs) const
+{
+	if( startMs != NULL )
+		*startMs = 0;
+	if( points.size() == 0 )
+		return 0;
+
+	// last point at or before ms:
+	size_t i = 0;
+	while( (i+1 < points.size()) && (points[i+1].ms <= ms) )
+		i++;
+	const point &a = points[i];
+	if( startMs != NULL )
+		*startMs = a.ms;
+	if( i+1 >= points.size() )
+		return a.offset;
+
+	// Only pcm data can start anywhere, compressed data at its frames,
+	// which is where the points are:
+	const point &b = points[i+1];
+	if( blockAlign == 0 )
+		return a.offset;
+
+	// Interpolate towards the next point:
+	uint32_t offset = (uint32_t)( (uint64_t)(b.offset - a.offset) * (ms - a.ms) / (b.ms - a.ms) );
+	offset -= offset % blockAlign;	//don't start halfway a sample
+	if( (startMs != NULL) && (offset > 0) )
+		*startMs = a.ms + (uint32_t)( (uint64_t)(b.ms - a.ms) * offset / (b.offset - a.offset) );
+	return a.offset + offset;
 }
 
 
+
 #ifdef USE_TAGLIB
 
 //for some reason, TagLib::String::to8bit() crashed under win32...
@@ -616,176 +1365,278 @@ int readMpegHeader(FILE *f, fileInfo* info)
 
 
 
+//--------------------------- Format probes ------------------------------------
 
+#ifdef USE_TAGLIB
 
-
-/// Get mime-type, and eventually also tags from the audio data
-fileInfo::fileInfo(const char *fname)
+/// Audio properties, tags and replay gain, common to all taglib formats
+bool tagLibInfo(TagLib::File *pf, TagLib::ID3v2::Tag *id3v2, TagLib::Ogg::XiphComment *xiph, fileInfo *info)
 {
-	//set default values:
-	isAudioFile	= false;
-	nrBits = nrChannels = sampleRate = 0;
-	length = 0;
-	gainTrack = gainAlbum = 0;
-
-	// get mime type, now only based on extension:
-	const char *ext = strrchr(fname,'.');
-	mime = getMime(ext);
+	TagLib::AudioProperties *prop = pf->audioProperties();
+	if( prop == NULL)
+		return false;
+
+	info->length     = prop->length();
+	info->sampleRate = prop->sampleRate();
+	info->nrChannels = prop->channels();
+	info->isAudioFile= true;
+
+	//set generic tags
+	TagLib::Tag *tag = pf->tag();
+	if( tag != NULL)
+	{
+		std::ostringstream yearS,trackS;
+		yearS << tag->year();
+		trackS<< tag->track();
+
+		info->tags["artist"] = tagLibStr( tag->artist() );
+		info->tags["album"]  = tagLibStr( tag->album()  );
+		info->tags["title"]  = tagLibStr( tag->title()  );
+		info->tags["genre"]  = tagLibStr( tag->genre()  );
+		info->tags["year"]   = yearS.str();
+		info->tags["track"]  = trackS.str();
+	}
 
-	// if the extension doesn't indicate audio, don't even try to open it:
-	if( mime.compare(0,6,"audio/") != 0)
-		return; // info;
-#ifdef USE_TAGLIB
-	else
+	// Get replay-gain info
+	if(id3v2 != NULL)
 	{
-		//format independent info:
-		TagLib::File *pf = NULL;
-		TagLib::AudioProperties *prop = NULL;
-		TagLib::ID3v2::Tag *id3v2 = NULL;
-		TagLib::Ogg::XiphComment   *xiph  = NULL;
+		//it's officially stored here:
+		//const TagLib::ID3v2::FrameListMap map = id3v2->frameListMap();
+		//TagLib::ID3v2::FrameList rgad = id3v2->frameListMap()["RGAD"];
+		//if(!rgad.isEmpty())
+		//	float gain = ((TagLib::ID3v2::RelativeVolumeFrame*)rgad.front())->volumeAdjustment();
 
-		//first open using format specific code:
-		// and make sure that *pf is really of the correct type:
-		if( mime == "audio/flac" )
+		// But in practice stored here:
+		TagLib::ID3v2::FrameList list =	id3v2->frameListMap()["TXXX"];
+
+		for(size_t i=0; i < list.size(); i++)
 		{
-			TagLib::FLAC::File *flac = new TagLib::FLAC::File( fname );
-			if( !flac->isValid() )
-				return;
-			if( flac->audioProperties() == NULL)
-				return;
-			//might be here:
-			id3v2 = flac->ID3v2Tag();
-			xiph  = flac->xiphComment();
-
-			//FLAC specific info:
-			nrBits = flac->audioProperties()->sampleWidth();
-			//db_printf(5,"%i bits\n", info.nrBits);
-			pf = flac;
+			TagLib::ID3v2::Frame *f = list[i];
+			std::string content = f->toString().to8Bit();
+			std::string value;
+			if( content.find("replaygain_track_gain") != string::npos)
+				sscanf( content.c_str(), "%*s %*s %f %*s", &info->gainTrack );
+			if( content.find("replaygain_album_gain") != string::npos)
+				sscanf( content.c_str(), "%*s %*s %f %*s", &info->gainAlbum );
 		}
-		else if( mime == "audio/mpeg" )
-		{
-			TagLib::MPEG::File *mpeg = new TagLib::MPEG::File( fname , true, TagLib::AudioProperties::Accurate );
+	}
 
-			if( !mpeg->isValid() )
-				return;
-			id3v2 = mpeg->ID3v2Tag();
-			pf = mpeg;
+	//alternate source for replay-gain info
+	if( xiph != NULL)
+	{
+		if( xiph->fieldListMap().contains("REPLAYGAIN_TRACK_GAIN") )	//make it work under taglib 1.4
+		//if( xiph->contains("REPLAYGAIN_TRACK_GAIN") )
+		{
+			const char* strTrack = xiph->fieldListMap()["REPLAYGAIN_TRACK_GAIN"][0].toCString();
+			sscanf( strTrack, "%f %*s", &info->gainTrack );
 		}
+		if( xiph->fieldListMap().contains("REPLAYGAIN_ALBUM_GAIN") )	//make it work under taglib 1.4
+		//if( xiph->contains("REPLAYGAIN_ALBUM_GAIN") )
+		{
+			const char* str = xiph->fieldListMap()["REPLAYGAIN_ALBUM_GAIN"][0].toCString();
+			sscanf( str, "%f %*s", &info->gainAlbum );
+		}
+	}
+	return true;
+}
 
-		if( pf == NULL )
-			return;
-		prop = pf->audioProperties();
-		if( prop == NULL)
-			return;
 
-		length     = prop->length();
-		sampleRate = prop->sampleRate();
-		nrChannels = prop->channels();
-		isAudioFile= true;
+bool probeMpeg(const char *fname, fileInfo *info)
+{
+	TagLib::MPEG::File mpeg( fname , true, TagLib::AudioProperties::Accurate );
+	if( !mpeg.isValid() )
+		return false;
+	return tagLibInfo( &mpeg, mpeg.ID3v2Tag(), NULL, info );
+}
 
-		//db_printf(5,"\t%30s. %i seconds, %i Hz\n", fname, info.length, info.sampleRate );
 
-		//set generic tags
-		TagLib::Tag *tag = pf->tag();
-		if( tag != NULL)
-		{
-			std::ostringstream yearS,trackS;
-			yearS << tag->year();
-			trackS<< tag->track();
-
-			tags["artist"] = tagLibStr( tag->artist() );
-			tags["album"]  = tagLibStr( tag->album()  );
-			tags["title"]  = tagLibStr( tag->title()  );
-			tags["genre"]  = tagLibStr( tag->genre()  );
-			tags["year"]   = yearS.str();
-			tags["track"]  = trackS.str();
-		}
+bool probeFlac(const char *fname, fileInfo *info)
+{
+	TagLib::FLAC::File flac( fname );
+	if( !flac.isValid() || (flac.audioProperties() == NULL) )
+		return false;
 
-		// Get replay-gain info
-		if(id3v2 != NULL)
-		{
-			//it's officially stored here:
-			//const TagLib::ID3v2::FrameListMap map = id3v2->frameListMap();
-			//TagLib::ID3v2::FrameList rgad = id3v2->frameListMap()["RGAD"];
-			//if(!rgad.isEmpty())
-			//	float gain = ((TagLib::ID3v2::RelativeVolumeFrame*)rgad.front())->volumeAdjustment();
+	//FLAC specific info:
+	info->nrBits = flac.audioProperties()->sampleWidth();
+	return tagLibInfo( &flac, flac.ID3v2Tag(), flac.xiphComment(), info );
+}
 
-			// But in practice stored here:
-			TagLib::ID3v2::FrameList list =	id3v2->frameListMap()["TXXX"];
+#else
 
-			for(size_t i=0; i < list.size(); i++)
-			{
-				TagLib::ID3v2::Frame *f = list[i];
-				std::string content = f->toString().to8Bit();
-				std::string value;
-				if( content.find("replaygain_track_gain") != string::npos)
-					sscanf( content.c_str(), "%*s %*s %f %*s", &gainTrack );
-				if( content.find("replaygain_album_gain") != string::npos)
-					sscanf( content.c_str(), "%*s %*s %f %*s", &gainAlbum );
-			}
-		}
+bool probeMpeg(const char *fname, fileInfo *info)
+{
+	FILE *f = fopen(fname, "rb" );
+	if(f == NULL)
+		return false;
 
-		//alternate source for replay-gain info
-		if( xiph != NULL)
-		{
-			if( xiph->fieldListMap().contains("REPLAYGAIN_TRACK_GAIN") )	//make it work under taglib 1.4
-			//if( xiph->contains("REPLAYGAIN_TRACK_GAIN") )
-			{
-				const char* strTrack = xiph->fieldListMap()["REPLAYGAIN_TRACK_GAIN"][0].toCString();
-				sscanf( strTrack, "%f %*s", &gainTrack );
-			}
-			if( xiph->fieldListMap().contains("REPLAYGAIN_ALBUM_GAIN") )	//make it work under taglib 1.4
-			//if( xiph->contains("REPLAYGAIN_ALBUM_GAIN") )
-			{
-				const char* str = xiph->fieldListMap()["REPLAYGAIN_ALBUM_GAIN"][0].toCString();
-				sscanf( str, "%f %*s", &gainAlbum );
-			}
-		}
+	info->nrBits = '?';	//slim default
+	info->nrChannels = 2;
+	info->sampleRate = '?';
 
-		delete pf;
-	} //if mime == "audio"
+	//this matches winamp's behaviour if ID3v2 only contains
+	//	replay-gain tags, but song info is in ID3v1:
+	int r1 = tagID3v1(f, info->tags);	//try ID3v1
+	int r2 = tagID3v2(f, info->tags);	//overwrite results with ID3v2, if exists.
 
-	db_printf(15,"%30s, %i seconds. track gain %.4f\n", fname, length, gainTrack );
+	fseek(f, util::max(0, r2 -1 ), SEEK_SET);
+	readMpegHeader(f, info);
 
-#else
+	//try ID3v2 first, if that doesn't work, try ID3v1
+	//if(r != 0)	r = tagID3v1(f, info->tags);
+	//if(r == 0)	info->isAudioFile = true;
+	if( (r1>=0) || (r2>=0) )
+		info->isAudioFile = true;
+
+	fclose(f);
+	return info->isAudioFile;
+}
+
+
+bool probeFlac(const char *fname, fileInfo *info)
+{
 	FILE *f = fopen(fname, "rb" );
 	if(f == NULL)
-		return;
+		return false;
+
+	int r2 = tagID3v2(f, info->tags);
+	if( r2 > 0 )
+		fseek( f, r2, SEEK_SET);	//id3 found, seek to start of other data
+	else
+		fseek( f, 0 , SEEK_SET);	//nothing found, seek back
+	flac::parseHeader(f, info );
+
+	fclose(f);
+	return info->isAudioFile;
+}
 
-	if( mime == "audio/mpeg" )
+#endif
+
+
+
+//--------------------------- Format registry ----------------------------------
+
+/// All known file types.
+/// The slim format and endianness codes are those of the STRM command.
+static const fileFormat formatTable[] = {
+	//ext    mime                       slim pcmEndian audioOnly probe       buildIndex
+	{"mp3" , "audio/mpeg"              , 'm', '?', false, probeMpeg  , seek::buildMpeg },
+	{"flac", "audio/flac"              , 'f', '?', false, probeFlac  , seek::buildFlac },
+	{"ogg" , "audio/ogg"               , 'o', '?', false, ogg::probe , ogg::buildIndex },
+	{"wav" , "audio/x-wav"             , 'p', '1', true , wav::probe , wav::buildIndex },
+	{"aif" , "audio/x-aiff"            , 'p', '0', true , aiff::probe, aiff::buildIndex},
+	{"aiff", "audio/x-aiff"            , 'p', '0', true , aiff::probe, aiff::buildIndex},
+	{"txt" , "text/plain"              ,  0 , '?', false, NULL, NULL},
+	{"html", "text/html"               ,  0 , '?', false, NULL, NULL},
+	{"htm" , "text/html"               ,  0 , '?', false, NULL, NULL},
+	{"png" , "image/png"               ,  0 , '?', false, NULL, NULL},
+	{"jpg" , "image/jpeg"              ,  0 , '?', false, NULL, NULL},
+	{"svg" , "image/svg+xml"           ,  0 , '?', false, NULL, NULL},
+	{"z"   , "application/x-compress"  ,  0 , '?', false, NULL, NULL},
+	{"m3u" , "audio/x-playlist"        ,  0 , '?', false, NULL, NULL},		//not really an official type..
+	{"js"  , "text/javascript"         ,  0 , '?', false, NULL, NULL},
+	{"json", "text/plain"              ,  0 , '?', false, NULL, NULL},
+};
+
+
+/// Pack an extension of at most 4 characters into an integer, lowercase.
+/// Returns 0 for longer (so unknown) extensions.
+static uint32_t packExtension(const char *ext)
+{
+	uint32_t key = 0;
+	for(int i=0; ext[i] != 0; i++)
 	{
-		nrBits = '?';	//slim default
-		nrChannels = 2;
-		sampleRate = '?';
+		if( i >= 4 )
+			return 0;
+		key = (key<<8) | (uint8_t)tolower( ext[i] );
+	}
+	return key;
+}
 
-		//this matches winamp's behaviour if ID3v2 only contains
-		//	replay-gain tags, but song info is in ID3v1:
-		int r1 = tagID3v1(f, tags);	//try ID3v1
-		int r2 = tagID3v2(f, tags);	//overwrite results with ID3v2, if exists.
 
-		fseek(f, util::max(0, r2 -1 ), SEEK_SET);
-		readMpegHeader(f, this);
+/// Open addressing hash table on the packed extension.
+/// Filled once during static initialization, read-only afterwards, so
+/// lookups need no locking.
+class formatHash
+{
+	static const int nrSlots = 64;	//power of 2, well above the number of formats
+	uint32_t keys[nrSlots];
+	const fileFormat *slots[nrSlots];
 
-		//try ID3v2 first, if that doesn't work, try ID3v1
-		//if(r != 0)	r = tagID3v1(f, info->tags);
-		//if(r == 0)	info->isAudioFile = true;
-		if( (r1>=0) || (r2>=0) )
-			isAudioFile = true;
+	static int slot(uint32_t key)
+	{
+		return (key * 2654435761u) >> 26;	//Fibonacci hashing, top 6 bits
 	}
-	else if( mime == "audio/flac" )
+
+public:
+	formatHash()
 	{
-		int r2 = tagID3v2(f, tags);
-		if( r2 > 0 )
-			fseek( f, r2, SEEK_SET);	//id3 found, seek to start of other data
-		else
-			fseek( f, 0 , SEEK_SET);	//nothing found, seek back
-		flac::parseHeader(f, this );
+		memset(keys , 0, sizeof(keys) );
+		memset(slots, 0, sizeof(slots));
+		for(size_t i=0; i < array_size(formatTable); i++)
+		{
+			uint32_t key = packExtension( formatTable[i].ext );
+			int s = slot(key);
+			while( slots[s] != NULL )
+				s = (s+1) & (nrSlots-1);
+			keys[s]  = key;
+			slots[s] = &formatTable[i];
+		}
 	}
 
-	fclose(f);
-#endif
+	const fileFormat* find(uint32_t key) const
+	{
+		if( key == 0 )
+			return NULL;
+		for(int s = slot(key); slots[s] != NULL; s = (s+1) & (nrSlots-1) )
+			if( keys[s] == key )
+				return slots[s];
+		return NULL;
+	}
+};
+
+static const formatHash formats;
 
-//	return info;
+
+const fileFormat* getFormat(const char *extension)
+{
+	if( extension == NULL )
+		return NULL;
+	if( *extension == '.')
+		extension++;
+	return formats.find( packExtension(extension) );
 }
 
 
+/// Get mime type, based on the extension of a filename
+std::string getMime(const char *extension)
+{
+	const fileFormat *format = getFormat(extension);
+	if( format != NULL )
+		return format->mime;
+	return "application/octet-stream";
+}
+
+
+
+
+/// Get mime-type, and eventually also tags from the audio data
+fileInfo::fileInfo(const char *fname)
+{
+	//set default values:
+	isAudioFile	= false;
+	nrBits = nrChannels = sampleRate = 0;
+	length = 0;
+	gainTrack = gainAlbum = 0;
+
+	// get the file type, now only based on extension:
+	format = getFormat( strrchr(fname,'.') );
+	mime = (format != NULL) ? format->mime : getMime(NULL);
+
+	// if the extension doesn't indicate audio, don't even try to open it:
+	if( (format == NULL) || (format->probe == NULL) )
+		return;
+
+	format->probe(fname, this);
+
+	db_printf(15,"%30s, %i seconds. track gain %.4f\n", fname, length, gainTrack );
+}
@@ -9,10 +9,14 @@
 #define _FILEINFO_HPP_
 
 #include <string>
+#include <vector>
 #include <map>
 #include <memory>
+#include <stdint.h>
+#include <stdio.h>
 
 
+struct fileFormat;
 
 
 struct fileInfo
@@ -24,6 +28,7 @@ public:
 
 	std::string url;
 	std::string mime;	// mime-type
+	const fileFormat *format;	///< Registry entry of the file type, NULL if unknown
 	bool isAudioFile;	// Whether it is a valid file
 
 	//audio info (needed by slim, for non-mp3 files):
@@ -37,7 +42,7 @@ public:
 	std::map< std::string, std::string> tags;	//possible tags
 
 	/// Zero constructor
-	fileInfo(): isAudioFile(0),
+	fileInfo(): format(NULL), isAudioFile(0),
 				nrBits(0), nrChannels(0), sampleRate(0),
 				length(0),
 				gainTrack(0), gainAlbum(0)
@@ -58,7 +63,68 @@ public:
 };
 
 
-//Get mime type, based on the extension of a filename
+/// Mapping of play time to byte offsets within an audio file, so a stream
+/// can be started halfway a song.
+/// It is built from the Xing TOC (mp3), the SEEKTABLE block (flac), or
+/// estimated from the bitrate if neither is present. For pcm and ogg
+/// the play time is proportional to the file offset.
+struct seekIndex
+{
+	struct point {
+		uint32_t ms;		///< play time of this point, in milliseconds
+		uint32_t offset;	///< absolute file offset
+		point(uint32_t ms, uint32_t offset): ms(ms), offset(offset) {}
+	};
+
+	std::vector<point> points;	///< sorted on time, first point is the first frame
+
+	uint32_t headerStart;	///< start of the data a decoder needs before any frame (flac metadata)
+	uint32_t headerSize;	///< size of that header, 0 if the format doesn't need one (mp3)
+	uint32_t dataEnd;		///< end of the audio data, excluding trailing tags
+	uint32_t lengthMs;		///< total play time, in milliseconds
+	uint32_t blockAlign;	///< size of one sample frame for pcm data, offsets are rounded down to it. 0 for compressed formats
+
+	seekIndex(): headerStart(0), headerSize(0), dataEnd(0), lengthMs(0), blockAlign(0)
+	{ }
+
+	/// Build the index from the file headers, returns false if the
+	/// file isn't a seekable audio file
+	bool build(const char *fname);
+
+	/// File offset from which to stream to start playing at 'ms'.
+	/// Interpolates linearly between the index points for pcm data, for
+	/// compressed data it's the last point at or before 'ms'.
+	/// 'startMs' receives the play time at which that offset really starts.
+	uint32_t lookup(uint32_t ms, uint32_t *startMs=NULL) const;
+};
+
+
+
+/// Properties of a supported file type.
+/// All code which depends on the type of a file (mime-type, tag reading,
+/// seeking, slim decoder selection) is looked up here, so adding a
+/// format only requires a new entry in the table in fileInfo.cpp.
+struct fileFormat
+{
+	const char *ext;		///< extension, lowercase and without the dot
+	const char *mime;		///< mime-type
+	char slimFormat;		///< decoder code in the slim STRM command: [m]p3, [f]lac, [o]gg, [p]cm. 0 if it's not audio
+	char pcmEndian;			///< slim endianness code of pcm data: '0' big, '1' little, '?' if not pcm
+	bool audioOnly;			///< the player can't parse the container, stream only the audio data
+
+	/// Read audio properties and tags, NULL for non-audio files
+	bool (*probe)(const char *fname, fileInfo *info);
+
+	/// Fill a seek index, NULL if the format can't be seeked in
+	bool (*buildIndex)(FILE *f, uint32_t fsize, seekIndex *idx);
+};
+
+
+/// Registry entry for a file extension (with or without the leading dot),
+/// NULL if the type is unknown
+const fileFormat* getFormat(const char *extension);
+
+/// Get mime type, based on the extension of a filename
 std::string getMime(const char *extension);
 
 
@@ -89,6 +89,24 @@ function callback()
 
 
 
+// Push channel for updates of the player state, with server-sent events.
+// callbackFcn(response, status) is called for every update, like callback() does.
+// Returns false if the browser has no EventSource, use "/dynamic/notify" then.
+function events(template, callbackFcn)
+{
+	if( !window.EventSource )
+		return false;
+	try {
+		var source = new EventSource("/dynamic/events?url=" + template);
+		source.onmessage = function(e) { callbackFcn(e.data, 200); };
+	} catch (failed) {
+		return false;
+	}
+	return true;
+}
+
+
+
 //---------------------------------------------------------------
 // More generic functions:
 
@@ -11,28 +11,19 @@ class keywordMatcherDevice: public keywordMatcher
 {
 	const string *devName;
 	slimIPC *ipc;
-	vector<string> kw;
 public:
 	keywordMatcherDevice(slimIPC *ipc, const string& devName):
 	  devName(&devName),
 	  ipc(ipc)
 	{
-		kw.push_back("device.name");
 	}
 
-  	vector<string> keyWords(void)
+	void replace(keywordId id, const string& /*field*/, string& out)
 	{
-		return kw;
-	}
-
-	string replace(string keyword)
-	{
-		string out;
-		if (keyword == "device.name")
-			out = *devName;
-		else if (keyword == "device.group")
-			out = ipc->getGroup(*devName);
-		return out;
+		if (id == KW_DEVICE_NAME)
+			out.append( *devName );
+		else if (id == KW_DEVICE_GROUP)
+			out.append( ipc->getGroup(*devName) );
 	}
 };
 
@@ -42,9 +33,6 @@ public:
 class keywordMatcherSong: public keywordMatcher
 {
 private:
-	//slimIPC* ipc;
-	//string   clientName;
-	vector<string> kw;
 	const musicFile *current;
 	int playListIdx;
 public:
@@ -52,60 +40,43 @@ public:
 			current(&current),
 			playListIdx(playListIdx)
 	{
-		//groupName = ipc->getGroup(clientName);
-		kw.push_back("title");		// current song info
-		kw.push_back("album");
-		kw.push_back("artist");
-		kw.push_back("url");
-        kw.push_back("length");
-		kw.push_back("listidx");
-	}
-
-
-	vector<string> keyWords(void)
-	{
-		return kw;
 	}
 
 
-	string replace(string keyword)
+	void replace(keywordId id, const string& /*field*/, string& out)
 	{
-		char tmp[20];
-		string out;
-		if (keyword == "title")
-			if( current->title.size() > 0 )
-				out = current->title;
-			else
-				out = path::split(current->url).back();
-		else if (keyword == "album")
-			out = current->album;
-		else if (keyword == "artist")
-			out = current->artist;
-		else if (keyword == "url")
-			out = current->url;
-        else if (keyword == "length")
+		switch( id )
 		{
-			//int sec = current->length % 60;
-			//int min = current->length / 60;
-			//sprintf(tmp, "%i:%02i", min,sec);
-			sprintf(tmp, "%i", current->length);
-            out = tmp;
+			case KW_TITLE:
+				if( current->title.size() > 0 )
+					out.append( current->title );
+				else
+					out.append( path::split(current->url).back() );
+				break;
+			case KW_ALBUM:
+				out.append( current->album );
+				break;
+			case KW_ARTIST:
+				out.append( current->artist );
+				break;
+			case KW_URL:
+				out.append( current->url );
+				break;
+			case KW_LENGTH:
+				//int sec = current->length % 60;
+				//int min = current->length / 60;
+				//sprintf(tmp, "%i:%02i", min,sec);
+				pstring::appendInt( out, current->length );
+				break;
+			case KW_COVER:
+				//TODO: split of the absolute path of cover.jpg, replace it by the relative one...
+				break;
+			case KW_LISTIDX:
+				pstring::appendInt( out, playListIdx );
+				break;
+			default:
+				break;
 		}
-		else if (keyword == "cover")
-		{
-			string coverName = path::join( current->url, "cover.jpg" );
-			if( path::isfile( coverName ) )
-			{
-				//split of the absolute path, replace it by the relative one...
-			}
-		}
-		else if (keyword == "listidx")
-		{
-			char tmp[20];
-			sprintf(tmp, "%i", playListIdx);
-			out = tmp;
-		}
-		return out;
 	}
 };
 
@@ -115,8 +86,8 @@ public:
 class keywordMatcherIPC: public keywordMatcher
 {
 private:
-	const char	*templatePLitem;		// html template for single playlist item
-	const char	*templateDevice;
+	const compiledTemplate *templatePLitem;		// html template for single playlist item, may be NULL
+	const compiledTemplate *templateDevice;
 
 	const char *diskBasePath;			// base paths for data, to convert pathnames
 	const char *httpBasePath;
@@ -125,13 +96,11 @@ private:
 
 	string groupName;
 	string clientName;
-	//keywordMatcherSong *kwSong;
-	vector<string> kw;
 	musicFile currentSong;
 public:
 	keywordMatcherIPC(slimIPC *ipc, string clientName, 
 						const char *diskBasePath, const char *httpBasePath,
-						const char *templatePLitem, const char *templateDevice):
+						const compiledTemplate *templatePLitem, const compiledTemplate *templateDevice):
 		templatePLitem(templatePLitem),
 		templateDevice(templateDevice),
 		diskBasePath(diskBasePath),
@@ -139,127 +108,122 @@ public:
 	    ipc(ipc),
 		clientName(clientName)
 	{
-		//kwSong = new keywordMatcherSong(ipc, clientName);
 		groupName   = ipc->getGroup(clientName);
 		currentSong = ipc->getSong(groupName);
-
-		kw.push_back("title");		// current song info
-		kw.push_back("album");
-		kw.push_back("artist");
-		kw.push_back("url");
-		kw.push_back("playlist.list");	// is handled by a keywordMatcherSong()
-        kw.push_back("playlist.index");
-		kw.push_back("device.list");
-        kw.push_back("config.sections");
 	}
 
-	~keywordMatcherIPC()
+	void replace(keywordId id, const string& field, string& out)
 	{
-		//delete kwSong;
+		//TODO: for each of the sections, generate a hash of the current status, such
+		// that "/dynamic/notify?url=" can be used to determine what to update
+
+		switch( id )
+		{
+			case KW_PLAYLIST_INDEX:
+			case KW_PLAYLIST_SIZE:
+			case KW_PLAYLIST_REPEAT:
+			case KW_PLAYLIST_CHECKSUM:
+			case KW_PLAYLIST_LIST:
+				playlist( id, out );
+				break;
+			case KW_DEVICE_LIST:
+				if( templateDevice != NULL )
+				{
+				    vector<string> devList = ipc->listDevices();
+				    for( vector<string>::iterator it=devList.begin(); it != devList.end(); it++)
+				    {
+					    keywordMatcherDevice matchDevice( ipc, *it );
+					    templateDevice->render( matchDevice, out );
+	                }
+				}
+				break;
+			case KW_DEVICE_NAME:
+			case KW_DEVICE_GROUP:
+			case KW_DEVICE_FIELD:
+				out.append( ipc->getDevice( clientName, field) );
+				break;
+			case KW_CONFIG_SECTIONS:
+				{
+	                vector<string> sections = ipc->getConfigSections();
+	                for( size_t i=0; i < sections.size(); i++)
+	                {
+						if( i > 0 )
+							out.push_back( ',' );
+	                    out.append( sections[i] );
+	                }
+				}
+	            //TODO: have dynamic keywords:
+	            //this will require java-script-parsing to present a UI.
+	            //(and many connections to build up a single page with all options...)
+	            // config.section.xxx   // get list of items in section 'xxx'.
+	            // config.val.xxx.yyy   // get value for
+	            // or: have the caller extract parameters: #keyword:params#, such that
+	            // param can be loaded as template file..
+				break;
+			default:
+				{	//handle current song info
+					//TODO: also send path info, to search for cover.
+					keywordMatcherSong matchSong( currentSong );
+					matchSong.replace( id, field, out );
+				}
+		}
 	}
 
-	//Return vector of keywords handler by this class
-	vector<string> keyWords(void)
+	bool replacePart(keywordId id, const string& field, string& out, size_t& item, size_t maxBytes)
 	{
-		return kw;
+		if( id != KW_PLAYLIST_LIST )
+			return keywordMatcher::replacePart( id, field, out, item, maxBytes );
+		return playlist( id, out, &item, maxBytes );
 	}
 
-	string replace(string keyword)
+private:
+	/// Returns false if the list isn't complete, it continues at *item.
+	/// The list is looked up for every part, it can change in between.
+	bool playlist(keywordId id, string& out, size_t *item=NULL, size_t maxBytes=(size_t)-1)
 	{
-		string out;
-		string splaylist = "playlist.";
-		string sdevice   = "device.";
-		string sconfig   = "config.";
-
-		//TODO: for each of the sections, generate a hash of the current status, such
-		// that "/dynamic/notify?url=" can be used to determine what to update
-
-        if( pstring::startswith(keyword, splaylist ) )
-        {
-			int checksum;
-            const playList* currentList = ipc->getList(clientName, &checksum);
-			char tmp[20];
-
-			string field = keyword.substr( 9 );
+		int checksum;
+		const playList* currentList = ipc->getList(clientName, &checksum);
+		char tmp[20];
 
-			if( currentList == NULL)
-			{
-				//don't do anything
-			} 
-			else if (field == "index")
-            {
-                sprintf(tmp, "%llu", (LLU)currentList->currentItem);
-                out = tmp;
-            }
-			else if( field == "size" )
-			{
+		if( currentList == NULL)
+			return true;
+		switch( id )
+		{
+			case KW_PLAYLIST_INDEX:
+				sprintf(tmp, "%llu", (LLU)currentList->currentItem);
+				out.append( tmp );
+				break;
+			case KW_PLAYLIST_SIZE:
 				sprintf(tmp, "%llu", (LLU)currentList->items.size());
-                out = tmp;
-			}
-			else if( field == "repeat" )
-			{
+				out.append( tmp );
+				break;
+			case KW_PLAYLIST_REPEAT:
 				sprintf(tmp, "%i", currentList->repeat );
-                out = tmp;
-			}
-			else if( field == "checksum" )
-			{
+				out.append( tmp );
+				break;
+			case KW_PLAYLIST_CHECKSUM:
 				sprintf(tmp, "%x", checksum );
-				out = tmp;
-			}
-		    else if (field == "list")	//special case
-		    {
-			    if( currentList != NULL )
-			    {
-				    for(size_t i=0; i< currentList->items.size(); i++)
-				    {
-					    keywordMatcherSong matchSong( currentList->items[i], i );
-					    out.append( dHtmlTemplate::generateData( templatePLitem, matchSong ) );
-				    }
-			    }
-		    }
-        }
-        else if( pstring::startswith(keyword, sdevice ) )
-        {
-			string field = keyword.substr( 7 );
-		    if (field == "list")
-		    {
-			    vector<string> devList = ipc->listDevices();
-			    for( vector<string>::iterator it=devList.begin(); it != devList.end(); it++)
-			    {
-				    keywordMatcherDevice matchDevice( ipc, *it );
-				    out.append( dHtmlTemplate::generateData( templateDevice, matchDevice ) );
-                }
-			} else {
-				out = ipc->getDevice( clientName, field);
-			}
-        }
-        else if( pstring::startswith(keyword, sconfig ) )
-        {
-            if( keyword == "config.sections")
-            {
-                vector<string> sections = ipc->getConfigSections();
-                for( size_t i=0; i < sections.size(); i++)
-                {
-                    out.append( sections[i] );
-                    out.append( "," );
-                }
-                out.erase( out.size() - 1 );    //remove trailing comma
-            }
-            //TODO: have dynamic keywords:
-            //this will require java-script-parsing to present a UI.
-            //(and many connections to build up a single page with all options...)
-            // config.section.xxx   // get list of items in section 'xxx'.
-            // config.val.xxx.yyy   // get value for
-            // or: have the caller extract parameters: #keyword:params#, such that
-            // param can be loaded as template file..
-		}
-		else //if keyword=...
-		{	//handle current song info
-			//TODO: also send path info, to search for cover.
-			keywordMatcherSong matchSong( currentSong );
-			out = matchSong.replace( keyword );
+				out.append( tmp );
+				break;
+			case KW_PLAYLIST_LIST:	//special case
+				if( templatePLitem != NULL )
+				{
+					size_t start = out.size();
+					for(size_t i=(item != NULL) ? *item : 0; i< currentList->items.size(); i++)
+					{
+						if( out.size() - start >= maxBytes )
+						{
+							*item = i;
+							return false;
+						}
+						keywordMatcherSong matchSong( currentList->items[i], i );
+						templatePLitem->render( matchSong, out );
+					}
+				}
+				break;
+			default:
+				break;
 		}
-		return out;
+		return true;
 	}
 };
-
@@ -1,6 +1,8 @@
 /* Base classes for dynamic html generation.
  *
- * Parsing is a simple search-and-replace using template files
+ * Parsing is a simple search-and-replace using template files.
+ * Templates are compiled once into literal text and keyword ids,
+ * rendering then only appends strings.
  *
  */
 
@@ -11,17 +13,236 @@
 using namespace std;
 
 
+//----------------- Keywords ---------------------------------------------------
+
+/// All keywords known to the matchers, a template refers to them by id.
+/// Keywords are case insensitive, "#TITLE#" and "#title#" are the same.
+enum keywordId {
+	KW_NONE,			//literal text in a compiled template
+	// song:
+	KW_TITLE, KW_ALBUM, KW_ARTIST, KW_URL, KW_LENGTH, KW_COVER, KW_LISTIDX,
+	// file in a directory listing:
+	KW_RELURL, KW_NAME_ESCAPED, KW_NAME, KW_MIMETYPE,
+	// directory listing:
+	KW_BASE, KW_FILELIST,
+	// playlist of the current device:
+	KW_PLAYLIST_INDEX, KW_PLAYLIST_SIZE, KW_PLAYLIST_REPEAT, KW_PLAYLIST_CHECKSUM, KW_PLAYLIST_LIST,
+	// devices, any other "device.xxx" is a KW_DEVICE_FIELD:
+	KW_DEVICE_NAME, KW_DEVICE_GROUP, KW_DEVICE_LIST, KW_DEVICE_FIELD,
+	KW_CONFIG_SECTIONS,
+	nrKeywords
+};
+
+/// Names of the keywords, in the order of keywordId
+static const char *keywordNames[nrKeywords] = {
+	"",
+	"title", "album", "artist", "url", "length", "cover", "listidx",
+	"relurl", "name_escaped", "name", "mimetype",
+	"base", "filelist",
+	"playlist.index", "playlist.size", "playlist.repeat", "playlist.checksum", "playlist.list",
+	"device.name", "device.group", "device.list", "",
+	"config.sections",
+};
+
+
+/// Perfect hash of the keyword names, to resolve them while compiling a template.
+/// The seed is searched at startup, such that every name has a slot of its own.
+class keywordHash
+{
+private:
+	static const int bits = 7;
+	uint8_t slots[1<<bits];		//keywordId, KW_NONE for an empty slot
+	uint64_t seed;
+
+	size_t slot(const char *name, size_t len) const
+	{
+		uint64_t h = util::fnv1a( name, len, seed );
+		return (size_t)(h ^ (h >> 32)) & ((1<<bits) - 1);
+	}
+
+public:
+	keywordHash()
+	{
+		bool collision = true;
+		for(seed = 14695981039346656037ULL; collision; seed++)
+		{
+			memset( slots, KW_NONE, sizeof(slots) );
+			collision = false;
+			for(int id=1; (id < nrKeywords) && !collision; id++)
+			{
+				size_t s = slot( keywordNames[id], strlen(keywordNames[id]) );
+				collision = (slots[s] != KW_NONE);
+				slots[s] = id;
+			}
+		}
+		seed--;
+	}
+
+	/// Id of a lower-case name, KW_NONE if it's unknown
+	keywordId lookup(const string& name) const
+	{
+		uint8_t id = slots[ slot( name.data(), name.size() ) ];
+		if( (id != KW_NONE) && (name == keywordNames[id]) )
+			return (keywordId)id;
+		if( name.compare(0, 7, "device.") == 0 )
+			return KW_DEVICE_FIELD;
+		return KW_NONE;
+	}
+};
+
+static const keywordHash keywordTable;
+
+
 //----------------- Keyword replacement functions ----------------------
 
 /// Base class for all template-matchers
 class keywordMatcher
 {
 public:
-	/// Return a list of keywords processed by this class
-	virtual vector<string> keyWords(void)=0;
+	/// Append the content for a single keyword to out.
+	/// field is the part after "device." for the device keywords.
+	virtual void replace(keywordId id, const string& field, string& out)=0;
+
+	/// Like replace(), but stops once about maxBytes are appended, for the
+	/// keywords which generate a list. item is the progress, 0 at the start.
+	/// Returns false if there's more to come.
+	virtual bool replacePart(keywordId id, const string& field, string& out, size_t& /*item*/, size_t /*maxBytes*/)
+	{
+		replace( id, field, out );
+		return true;
+	}
+};
+
+
+/// A template, split once into literal text and keyword ids.
+/// "#keyword#" is replaced when rendering, "##" gives a single '#'.
+class compiledTemplate
+{
+private:
+	struct op {
+		keywordId id;			//KW_NONE for literal text
+		size_t start, len;		//of the literal text
+		string field;			//for device keywords
+	};
+	string text;		//all literal text
+	vector<op> ops;
+
+	void addText(const char *data, size_t len)
+	{
+		if( len == 0 )
+			return;
+		if( ops.empty() || (ops.back().id != KW_NONE) )
+		{
+			op o;
+			o.id = KW_NONE;
+			o.start = text.size();
+			o.len = 0;
+			ops.push_back( o );
+		}
+		text.append( data, len );
+		ops.back().len += len;
+	}
+
+public:
+	compiledTemplate(const char *templateData)
+	{
+		const char *s1 = templateData;	//start of current block
+		const char *p  = s1;			//current position.
+		const char *end= (s1 == NULL) ? NULL : s1 + strlen(s1);
+		string kw;
+
+		while( p < end )
+		{
+			p = strchr(p, '#' ); // Search for start of keyword
+			if( p == NULL )
+			{
+				//no keywords found, copy remaing data:
+				addText( s1, end-s1 );
+				break;
+			}
+			addText( s1, p-s1 ); // copy all [s1..p] into output
+
+			s1 = p;
+			p = strchr(p+1, '#' ); // Search for end of keyword
+			if( p == NULL )
+				break;
+			if( p == s1+1)		//a double ## is the escape
+				addText( p, 1 );
+			else
+			{
+				kw.assign( s1+1, p-s1-1);
+				pstring::tolower( kw );
+				keywordId id = keywordTable.lookup( kw );
+				if( id != KW_NONE )		//unknown keywords are replaced by nothing
+				{
+					op o;
+					o.id = id;
+					o.start = o.len = 0;
+					if( kw.compare(0, 7, "device.") == 0 )
+						o.field = kw.substr( 7 );
+					ops.push_back( o );
+				}
+			}
+
+			p++;	//skip end of delimiter
+			s1 = p;
+		}
+	}
+
+	/// Append the result to out
+	void render(keywordMatcher& matchFcn, string& out) const
+	{
+		for(size_t i=0; i < ops.size(); i++)
+		{
+			const op &o = ops[i];
+			if( o.id == KW_NONE )
+				out.append( text, o.start, o.len );
+			else
+				matchFcn.replace( o.id, o.field, out );
+		}
+	}
+
+	/// Progress of rendering in parts
+	struct cursor {
+		size_t op;		//next one to render
+		size_t item;	//of a list keyword, see keywordMatcher::replacePart()
+		cursor(): op(0), item(0) { }
+	};
+
+	/// Append the next part of the result to out, about maxBytes.
+	/// Returns false once the whole template is rendered.
+	bool render(keywordMatcher& matchFcn, string& out, cursor& c, size_t maxBytes) const
+	{
+		size_t start = out.size();
+		while( (c.op < ops.size()) && (out.size() - start < maxBytes) )
+		{
+			const op &o = ops[c.op];
+			if( o.id == KW_NONE )
+				out.append( text, o.start, o.len );
+			else if( !matchFcn.replacePart( o.id, o.field, out, c.item, maxBytes - (out.size() - start) ) )
+				break;
+			c.op++;
+			c.item = 0;
+		}
+		return c.op < ops.size();
+	}
 
-	/// Generate content for a single keyword:
-	virtual string replace(string keyword)=0;
+	static void destroy(void *t)
+	{
+		delete (compiledTemplate*)t;
+	}
+
+	/// The compiled template of a cached file, which is compiled by its first user.
+	/// It stays valid until the entry is released.
+	static const compiledTemplate *of(const file::cache::entry *e)
+	{
+		if( e == NULL )
+			return NULL;
+		void *t = file::cache::attached( e );
+		if( t == NULL )
+			t = file::cache::attach( e, new compiledTemplate(e->data), destroy );
+		return (const compiledTemplate*)t;
+	}
 };
 
 
@@ -32,15 +253,15 @@ class keywordMatcherMulti: public keywordMatcher
 {
 private:
 protected:
-	const char* itemTemplate; // Template for a single item
+	const compiledTemplate* itemTemplate; // Template for a single item, may be NULL
 public:
-	keywordMatcherMulti(const char* itemTemplate):
+	keywordMatcherMulti(const compiledTemplate* itemTemplate):
 		itemTemplate(itemTemplate)
 	{
 	}
 
 	/// Generate content for the whole list:
-	virtual string replace(string keyword)=0;
+	virtual void replace(keywordId id, const string& field, string& out)=0;
 };
 
 
@@ -57,11 +278,7 @@ public:
 	{
 	}
 
-	//TODO: pre-pend template names to the keyword:
-	vector<string> keyWords(void)
-	{
-	    return vector<string>();
-	}
+	//TODO: pre-pend template names to the keyword
 };
 
 
@@ -99,47 +316,12 @@ public:
 		return generateData(templateData, *matchFcn);
 	}
 
-	//Allow the function to be called without class instantiation:
+	//Allow the function to be called without class instantiation.
+	//This compiles the template every time, use compiledTemplate for repeated use.
 	static string generateData(const char* templateData, keywordMatcher& matchFcn)
 	{
-		string parsedData,kw;
-        //load template
-        //search for keywords,
-		const char *s1 = templateData;	//start of current block
-		const char *p  = s1;					//current position.
-        const char *end= s1==NULL? NULL: s1+strlen(s1); // + templateData.size();
-
-		while( p < end )
-		{
-			p = strchr(p, '#' ); // Search for start of keyword
-			if( p == NULL )
-			{
-				//no keywords found, copy remaing data:
-				parsedData.append( s1 );
-				break;
-			}
-			parsedData.append( s1, p-s1 ); // copy all [s1..p] into output
-
-			s1 = p;
-			p = strchr(p+1, '#' ); // Search for end of keyword
-			if( p == NULL )
-				break;
-			if( p == s1+1)		//a double ## is the escape
-			{
-				parsedData.push_back( *p );
-			}
-			else				//no escape, really insert the keyword
-			{
-				kw.assign( s1+1, p-s1-1);
-				pstring::tolower( kw );
-
-				// replace keyword by value:
-				parsedData.append( matchFcn.replace( kw ) );
-			}
-
-			p++;	//skip end of delimiter
-			s1 = p;
-		}
+		string parsedData;
+		compiledTemplate( templateData ).render( matchFcn, parsedData );
 		return parsedData;
 	}
 };
@@ -155,41 +337,38 @@ class keywordMatcherFile: public keywordMatcher
 {
 	//string *realName;
 	const string *vfsName;
-	vector<string> kw;
 public:
 	keywordMatcherFile(const string& vfsName):
 		vfsName(&vfsName)
 	  {
-		kw.push_back("relurl");
-		kw.push_back("name_escaped");
-		kw.push_back("name");
-		kw.push_back("mime");
 	  }
 
-	vector<string> keyWords(void)
+	void replace(keywordId id, const string& /*field*/, string& out)
 	{
-		return kw;
-	}
-
-	string replace(string keyword)
-	{
-		string out;
-		if( keyword == "relurl" )
-			out = *vfsName;
-		else if( keyword == "name_escaped" )
-			out = path::escape( *vfsName );
-		else if( keyword == "name" )
-		{
-			vector<string> items = pstring::split(*vfsName,'/');
-			out = items.back(); //[1];
-			//out = path::split(*vfsName)[1];
-		}
-		else if( keyword == "mimetype" )
+		switch( id )
 		{
-			const char *ext = strrchr(vfsName->c_str(), '.');
-			out = getMime(ext);
+			case KW_RELURL:
+				out.append( *vfsName );
+				break;
+			case KW_NAME_ESCAPED:
+				out.append( path::escape( *vfsName ) );
+				break;
+			case KW_NAME:
+				{
+					size_t slash = vfsName->rfind('/');
+					out.append( *vfsName, (slash == string::npos) ? 0 : slash+1, string::npos );
+					//out = path::split(*vfsName)[1];
+				}
+				break;
+			case KW_MIMETYPE:
+				{
+					const char *ext = strrchr(vfsName->c_str(), '.');
+					out.append( getMime(ext) );
+				}
+				break;
+			default:
+				break;
 		}
-		return out;
 	}
 
 };
@@ -200,46 +379,50 @@ public:
 class keywordMatcherDirlist: public keywordMatcherMulti
 {
 	const char *vfsPath, *realPath;
-	vector<string> kw;
+	std::vector<std::string> files;		//sorted file-list, kept while it's rendered in parts
 public:
-	keywordMatcherDirlist(const char* itemTemplate,
+	keywordMatcherDirlist(const compiledTemplate* itemTemplate,
 						  const char *vfsPath,
 						  const char *realPath):
 		keywordMatcherMulti(itemTemplate),
 		vfsPath(vfsPath),
 		realPath(realPath)
 	{
-		kw.push_back("base");
-		kw.push_back("filelist");
 	}
 
-	vector<string> keyWords(void)
+	void replace(keywordId id, const string& field, string& out)
 	{
-		return kw;
+		size_t item = 0;
+		replacePart( id, field, out, item, (size_t)-1 );
 	}
 
-	string replace(string keyword)
+	bool replacePart(keywordId id, const string& /*field*/, string& out, size_t& item, size_t maxBytes)
 	{
-		string out;
-		if( keyword == "base" )
-			out = path::unescape(vfsPath);
-		else if(keyword == "filelist" )
+		if( id == KW_BASE )
+			out.append( path::unescape(vfsPath) );
+		else if( (id == KW_FILELIST) && (itemTemplate != NULL) )
 		{
-			std::vector<std::string> files = path::listdir( realPath , true );	//generate sorted file-list
-			for(size_t i=0; i<files.size(); i++)
+			if( item == 0 )
+				files = path::listdir( realPath , true );	//generate sorted file-list
+			string vfsName  = vfsPath;
+			if( (vfsName.size() == 0) || (vfsName[vfsName.size()-1] != '/') )
+				vfsName.push_back('/');	//always use forward slashes
+			size_t baseLen = vfsName.size();
+			size_t start = out.size();
+			for(; item < files.size(); item++)
 			{
+				if( out.size() - start >= maxBytes )
+					return false;
 				//string fullName = path::join( realPath, files[i]);
-				string vfsName  = vfsPath;
-				if( vfsName[vfsName.size()-1] != '/')
-					vfsName.push_back('/');	//always use forward slashes
-				vfsName.append( files[i] );
+				vfsName.resize( baseLen );
+				vfsName.append( files[item] );
 
 				keywordMatcherFile tmp( vfsName );	//key-word replace function
-				dHtmlTemplate      gen( &tmp );			//calls key-word replace
-				out.append( gen.generateData(itemTemplate) );
+				itemTemplate->render( tmp, out );
 			}
+			files.clear();
 		} //if keyword
-		return out;
+		return true;
 	}
 
 }; //class htmlTemplateDirlist
@@ -249,66 +432,62 @@ public:
 
 
 /// Server content of a virtual-file system.
-/// html-files are parsed through dHtmlTemplate()
-/// directories are parsed through another dHtmlTemplate()
-/// other files are served directly
+/// html-files are parsed as template, directories are parsed through the
+/// directory templates. Files which aren't templates are served directly,
+/// by the caller. The page is rendered in parts, so a large playlist or
+/// directory doesn't have to be in memory at once.
 class dHtmlVFS: public dHtmlTemplate
 {
-	string basePath;	//path to html-data
 	string vfsPath;
-	//string *dirTemplate, *dirItemTemplate;
-	const char *dirTemplate, *dirItemTemplate;
+	string fname;
+	const file::cache::entry *cached;	//the requested file, NULL if it's not cached
+	compiledTemplate *uncached;			//a file too large to cache
+	const compiledTemplate *page;		//template of the whole page, may be NULL
+	keywordMatcherDirlist dirMatchFcn;
+	keywordMatcher *pageMatchFcn;
+	compiledTemplate::cursor cursor;
 public:
 	dHtmlVFS(keywordMatcher* matchFcn, //keyword matcher to apply on the requested file
 			 string vfsPath,	//relative path in the HTML request
-			 string basePath,	//absolute path on the disk
-			 const char *dirTemplate,		//template file for directoy listing
-			 const char *dirItemTemplate	//template file for item in directoy listing
+			 string fname,		//absolute path on the disk
+			 const compiledTemplate *dirTemplate,		//template file for directoy listing
+			 const compiledTemplate *dirItemTemplate	//template file for item in directoy listing
 			 ):
 		dHtmlTemplate(matchFcn),
-		basePath(basePath),
 		vfsPath(vfsPath),
-		dirTemplate(dirTemplate),
-		dirItemTemplate(dirItemTemplate)
-	{
-	}
-
-
-	nbuffer::buffer* generateData(string fname)
+		fname(fname),
+		cached( file::cache::get( fname ) ),	//NULL for directories
+		uncached(NULL),
+		page(NULL),
+		dirMatchFcn( dirItemTemplate, this->vfsPath.c_str(), this->fname.c_str() ),
+		pageMatchFcn(matchFcn)
 	{
-		nbuffer::buffer *outBuf = NULL;
-		if( path::isfile(fname) )
-		{
-			// get mime type, now only based on extension:
-			const char *ext = strrchr(fname.c_str(), '.');
-			string mime = getMime(ext);
-			string mimeStart = "text";
-			if( pstring::startswith(mime, mimeStart) )
-			{	// Parse the data, then send it
-				// Load into memory:
-				ifstream filestr;
-				filestr.open( fname.c_str(), ios_base::in );
-				std::stringstream ss;
-				ss << filestr.rdbuf();
-
-				// Search keywords, replace them using:
-				dHtmlTemplate parser( matchFcn );
-				string parsedData = parser.generateData( ss.str().c_str() );
-				outBuf = new nbuffer::bufferString( parsedData );
-			}
-			else
-			{	// Send data without touching it:
-				outBuf = new nbuffer::bufferFile( fname.c_str() );
-			}
+		if( cached != NULL )
+			page = compiledTemplate::of( cached );
+		else if( path::isfile(fname) )
+		{	//too large to cache
+			size_t size;
+			char *fileData = file::readfile( fname.c_str(), &size );
+			page = uncached = new compiledTemplate( fileData );
+			free( fileData );
 		}
 		else	//not a file, generate directory listing
 		{
-			keywordMatcherDirlist dirMatchFcn( dirItemTemplate, vfsPath.c_str(), fname.c_str() );
-			dHtmlTemplate parser( &dirMatchFcn );
-			string parsedData =  parser.generateData( dirTemplate );
-			outBuf = new nbuffer::bufferString( parsedData );
+			page = dirTemplate;
+			pageMatchFcn = &dirMatchFcn;
 		}
-		return outBuf;
-	} //generateData
-}; // class dHtmlVFS
+	}
+
+	~dHtmlVFS()
+	{
+		delete uncached;
+		file::cache::release( cached );
+	}
 
+	/// Append the next part of the page to out, about maxBytes.
+	/// Returns false once the page is complete.
+	bool render(string& out, size_t maxBytes)
+	{
+		return (page != NULL) && page->render( *pageMatchFcn, out, cursor, maxBytes );
+	}
+}; // class dHtmlVFS
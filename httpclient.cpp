@@ -6,6 +6,8 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>	//for strtoull
+#include <time.h>
 
 #include "httpclient.hpp"	//includes winsock.h, so do that before any windows.h stuff
 #include "util.hpp"
@@ -87,6 +89,71 @@ namespace http
 	}
 
 
+	rangeResult parseRange(const std::string& range, uint64_t size, uint64_t *first, uint64_t *last)
+	{
+		const char *str = range.c_str();
+		while( *str == ' ' )
+			str++;
+		if( (strncmp(str, "bytes=", 6) != 0) || (strchr(str, ',') != NULL) )
+			return RANGE_NONE;
+		str += 6;
+		const char *dash = strchr(str, '-');
+		if( dash == NULL )
+			return RANGE_NONE;
+
+		char *end;
+		if( dash == str )
+		{	// "bytes=-n": the last n bytes
+			uint64_t n = strtoull( dash+1, &end, 10 );
+			if( end == dash+1 )
+				return RANGE_NONE;
+			if( (n == 0) || (size == 0) )
+				return RANGE_INVALID;
+			*first = size - util::min(n, size);
+			*last  = size - 1;
+			return RANGE_OK;
+		}
+
+		// "bytes=first-" or "bytes=first-last":
+		*first = strtoull( str, &end, 10 );
+		if( end != dash )
+			return RANGE_NONE;
+		*last = size - 1;
+		if( (dash[1] >= '0') && (dash[1] <= '9') )
+		{
+			uint64_t l = strtoull( dash+1, &end, 10 );
+			if( l < *first )
+				return RANGE_NONE;
+			*last = util::min( l, size - 1 );
+		}
+		if( *first >= size )
+			return RANGE_INVALID;
+		return RANGE_OK;
+	}
+
+
+	std::string formatDate(time_t t)
+	{
+		struct tm tmUtc;
+#if defined(WIN32) && !defined(__CYGWIN__)
+		tmUtc = *gmtime( &t );		//thread local on windows
+#else
+		gmtime_r( &t, &tmUtc );
+#endif
+		char str[40];
+		strftime( str, sizeof(str), "%a, %d %b %Y %H:%M:%S GMT", &tmUtc );
+		return str;
+	}
+
+
+	bool etagMatches(const std::string& ifNoneMatch, const std::string& etag)
+	{
+		if( pstring::strip(ifNoneMatch) == "*" )
+			return true;
+		return (etag.size() > 0) && (ifNoneMatch.find( etag ) != std::string::npos);
+	}
+
+
 	parseRequestHeader::parseRequestHeader(const char *data)
 	{
 		const char *m,*p,*v,*e; //method,path,version of first line
@@ -6,6 +6,7 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <time.h>
 using namespace std;
 
 #include "socket.hpp"
@@ -30,6 +31,20 @@ namespace http
 	/// Parse url parameters in the form http://127.0.0.1/stream?player=str?something=else
 	std::map<std::string,std::string> parseUrlParams(std::string paramStr, std::string *fname=NULL);
 
+	/// Result of parseRange()
+	enum rangeResult { RANGE_NONE, RANGE_OK, RANGE_INVALID };
+
+	/// Parse the Range header for a resource of 'size' bytes, into the bytes [first,last].
+	/// Only a single range is supported, others give RANGE_NONE, so the whole resource is sent.
+	/// RANGE_INVALID means it starts beyond the end, which is answered with a 416.
+	rangeResult parseRange(const std::string& range, uint64_t size, uint64_t *first, uint64_t *last);
+
+	/// Format a time for Last-Modified and Date headers, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+	std::string formatDate(time_t t);
+
+	/// Does an If-None-Match header (a list of tags, or "*") match etag?
+	bool etagMatches(const std::string& ifNoneMatch, const std::string& etag);
+
 	/// Parse the header of an http-request
 	class parseRequestHeader
 	{
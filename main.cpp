@@ -8,6 +8,7 @@
 #include <pthread.h>
 
 
+
 //#if defined(WIN32)
 const char configFile[] = "squeezed.ini";
 //#else
@@ -15,12 +16,12 @@ const char configFile[] = "squeezed.ini";
 //#endif
 
 
-//the thread function for the shout-server:
-void *shoutThread( void *ptr )
+//the thread function for the extra shout-server loops:
+void *loopThread( void *ptr )
 {
-	TCPserverShout *shoutServer = (TCPserverShout *)ptr;
-	int i = shoutServer->runNonBlock();
-	printf("shoutServer returned : %i\n", i);
+	eventLoop *loop = (eventLoop *)ptr;
+	int i = loop->run();
+	db_printf(1,"worker eventLoop returned : %i\n", i);
 	return 0;
 }
 
@@ -121,7 +122,7 @@ void testFlac(void)
 }
 
 
-//one thread per port:
+//start the servers:
 void startThreads()
 {
 	// Default settings:
@@ -130,14 +131,27 @@ void startThreads()
 	defaults["musicDB"]["path"]	= configValue("." );	//path to music files
 	defaults["musicDB"]["dbFile"] = configValue("SqueezeD.db");
 	defaults["musicDB"]["dbIdx"]  = configValue("SqueezeD.idx");
+	defaults["musicDB"]["scanBytesPerSec"]       = configValue(0);	//0: unlimited
+	defaults["musicDB"]["scanFilesPerSec"]       = configValue(0);
+	defaults["musicDB"]["scanIdlePriority"]      = configValue(1);
 
 	// Load configuration data
 	db_printf(6,"Loading confugaration data from %s\n", configFile);
 	configParser config(configFile, defaults);
 
 	int shoutPort	= config.getset("shout", "port", 9000 );
-	int shoutConn	= config.getset("shout", "maxConnections", 10 );
+	int shoutConn	= config.getset("shout", "maxConnections", 10 );	//per thread
+	int shoutThreads= config.getset("shout", "threads", 1 );
+	int shoutIdle	= config.getset("shout", "idleTimeout", 60000 );	//ms, 0 to disable
+	int ioThreads	= config.getset("shout", "ioThreads", 2 );		//for disk access, shared by all loops
+	int fileCacheKB	= config.getset("shout", "fileCacheKB", 8192 );	//web interface files kept in memory
 	int slimPort	= config.getset("slim",	 "port", 3483);
+
+	//write scheduler weights, relative share of the bandwidth per connection:
+	uint32_t weights[connectionHandler::nrWriteClasses];
+	weights[connectionHandler::WRITE_CONTROL] = (int)config.getset("slim",  "writeWeight", 4 );
+	weights[connectionHandler::WRITE_STREAM]  = (int)config.getset("shout", "streamWeight", 4 );
+	weights[connectionHandler::WRITE_WEB]     = (int)config.getset("shout", "webWeight", 1 );
 	string cfgPath= config.get("config", "path");
 	string dbPath = config.get("musicDB", "path");
 	string dbFile = config.get("musicDB", "dbFile");
@@ -146,12 +160,18 @@ void startThreads()
 	// Write back the default values, in case some are missing:
 	config.write(configFile);
 
+	// Files up to 1/8 of the budget are cached, so a few large ones can't evict the rest:
+	file::cache::setLimits( (size_t)fileCacheKB << 10, (size_t)fileCacheKB << 7 );
+
 	// Initialize the database
 	db_printf(6,"checking path '%s'\n", dbPath.c_str() );
 	dbPath = path::normalize(dbPath);		// Resolve home directory ('~'), if required.
 
 	db_printf(6,"opening musicDB '%s'\n", dbPath.c_str() );
 	musicDB db( dbPath.c_str() );
+	db.throttle.bytesPerSec       = (int)config.get("musicDB", "scanBytesPerSec");
+	db.throttle.filesPerSec       = (int)config.get("musicDB", "scanFilesPerSec");
+	db.throttle.idlePriority      = (int)config.get("musicDB", "scanIdlePriority") != 0;
 
 	//Load database, or scan if it's missing:
 	db.init( dbFile.c_str() , dbIdx.c_str() );
@@ -169,19 +189,59 @@ void startThreads()
 	TCPserverShout	shoutServer( &ipc, shoutPort, shoutConn);
 	TCPserverSlim	slimServer( &ipc, slimPort);
 
-	//shoutcast server in one thread:
-	pthread_t thread;
-	pthread_create( &thread, NULL, shoutThread, &shoutServer);
+	//extra shout servers on the same port, each in its own thread, so a slow
+	// page doesn't stall the streams:
+	std::vector<TCPserverShout*> shoutWorkers;
+	for(int t=1; t < shoutThreads; t++)
+	{
+		shoutWorkers.push_back( new TCPserverShout( &ipc, shoutPort, shoutConn) );
+		shoutServer.share( shoutWorkers.back() );
+		shoutWorkers.back()->idleTimeout = shoutIdle;
+	}
+	shoutServer.idleTimeout = shoutIdle;
+
+	//both servers share a single event loop in the main thread:
+	eventLoop loop;
+	if( !loop.add(&slimServer) || !loop.add(&shoutServer) )
+		return;
+	memcpy( loop.weight, weights, sizeof(weights) );
 
-	//slim server in the main trhead:
-	int i = slimServer.runNonBlock();
-	printf("slimServer returned : %i\n", i);
+	//blocking work of all loops, destroyed before the loops:
+	util::threadPool *ioPool = new util::threadPool( ioThreads );
+	loop.pool = ioPool;
 
-	//stop the shoutcast server, when slim-server stops:
-	shoutServer.stop = true;
+	std::vector<eventLoop*> workerLoops;
+	std::vector<pthread_t>  threads;
+	for(size_t t=0; t < shoutWorkers.size(); t++)
+	{
+		eventLoop *wl = new eventLoop();
+		if( !wl->add( shoutWorkers[t] ) )
+		{
+			delete wl;
+			continue;
+		}
+		memcpy( wl->weight, weights, sizeof(weights) );
+		wl->pool = ioPool;
+		workerLoops.push_back( wl );
+		threads.push_back( pthread_t() );
+		pthread_create( &threads.back(), NULL, loopThread, wl );
+	}
 
-	//wait for the thread to finish:
-	pthread_join(thread, NULL);
+	int i = loop.run();
+	printf("eventLoop returned : %i\n", i);
+
+	//stop the worker threads with the main loop:
+	for(size_t t=0; t < workerLoops.size(); t++)
+	{
+		workerLoops[t]->stop = true;
+		workerLoops[t]->wake();
+		pthread_join( threads[t], NULL );
+	}
+	delete ioPool;
+	for(size_t t=0; t < workerLoops.size(); t++)
+		delete workerLoops[t];
+	for(size_t t=0; t < shoutWorkers.size(); t++)
+		delete shoutWorkers[t];
 }
 
 
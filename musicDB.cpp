@@ -6,6 +6,15 @@
 #include <stdint.h>
 #include <algorithm>
 
+#ifndef WIN32
+	#include <fcntl.h>		//for posix_fadvise
+	#include <unistd.h>
+	#include <sys/stat.h>
+#endif
+#ifdef __linux__
+	#include <sys/syscall.h>	//for ioprio_set
+#endif
+
 #include "util.hpp"
 #include "fileInfo.hpp"
 
@@ -125,6 +134,129 @@ int dbEntry::pickle(FILE *f)
 
 
 
+//--------------------------- Scan throttling ----------------------------------------------
+
+
+// Not in glibc, see linux/ioprio.h:
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	#define IOPRIO_WHO_PROCESS		1
+	#define IOPRIO_CLASS_IDLE		3
+	#define IOPRIO_CLASS_SHIFT		13
+	#define HAVE_IOPRIO
+#endif
+
+
+void scanThrottle::begin(void)
+{
+	lastMs = util::msTime();
+	debtMs = 0;
+	oldPriority = -1;
+#ifdef HAVE_IOPRIO
+	if( idlePriority )
+	{
+		// 'process' 0 is the calling thread:
+		oldPriority = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+		if( syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0 )
+			db_printf(2,"scanThrottle: can't set idle I/O priority\n");
+	}
+#endif
+}
+
+
+void scanThrottle::end(void)
+{
+#ifdef HAVE_IOPRIO
+	if( oldPriority >= 0 )
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, oldPriority);
+#endif
+	oldPriority = -1;
+
+	for(size_t i=0; i < advised.size(); i++)
+		close( advised[i].fd );
+	advised.clear();
+}
+
+
+uint32_t scanThrottle::adviseHeaders(const advised_s &file, int advice)
+{
+	uint32_t bytes = headBytes;
+#ifdef POSIX_FADV_WILLNEED
+	int64_t head = util::min( file.size, (int64_t)headBytes );
+	int64_t tail = util::min( file.size - head, (int64_t)tailBytes );	//ID3v1, ogg length
+	posix_fadvise(file.fd, 0, head, advice);
+	if( tail > 0 )
+		posix_fadvise(file.fd, file.size - tail, tail, advice);
+	bytes = (uint32_t)(head + tail);
+#endif
+	return bytes;
+}
+
+
+void scanThrottle::willNeed(const std::string &fname)
+{
+#ifdef POSIX_FADV_WILLNEED
+	advised_s file;
+	file.fname = fname;
+	file.fd = open(fname.c_str(), O_RDONLY);
+	if( file.fd < 0 )
+		return;
+	struct stat st;
+	if( fstat(file.fd, &st) != 0 )
+	{
+		close(file.fd);
+		return;
+	}
+	file.size = st.st_size;
+	adviseHeaders(file, POSIX_FADV_WILLNEED);
+	advised.push_back( file );
+#endif
+}
+
+
+void scanThrottle::done(const std::string &fname)
+{
+	// The scan reads each file once, don't let it push music out of the cache:
+	uint32_t bytes = headBytes;
+	for(size_t i=0; i < advised.size(); i++)
+	{
+		if( advised[i].fname != fname )
+			continue;
+#ifdef POSIX_FADV_DONTNEED
+		bytes = adviseHeaders(advised[i], POSIX_FADV_DONTNEED);
+#endif
+		close( advised[i].fd );
+		advised.erase( advised.begin() + i );
+		break;
+	}
+
+	uint32_t bps = bytesPerSec;
+	uint32_t fps = filesPerSec;
+
+	// Time this file should take to stay within the budget,
+	// minus the time it did take:
+	uint32_t budgetMs = 0;
+	if( bps > 0 )
+		budgetMs = (uint32_t)( (uint64_t)bytes * 1000 / bps );
+	if( fps > 0 )
+		budgetMs = util::max( budgetMs, 1000 / fps );
+
+	uint32_t now = util::msTime();
+	uint32_t elapsed = now - lastMs;
+	debtMs += budgetMs;
+	debtMs = (debtMs > elapsed) ? debtMs - elapsed : 0;
+	lastMs = now;
+
+	if( debtMs >= 10 )	//avoid sleeping for each small file
+	{
+		util::msSleep( debtMs );
+		lastMs = util::msTime();
+		debtMs = 0;
+	}
+}
+
+
+
+
 //--------------------------- External functions -------------------------------------------
 
 
@@ -133,7 +265,8 @@ int dbEntry::pickle(FILE *f)
 /// list directory recursively, files only.
 void listdirRecursive( const std::string& basePath,
 					   const std::string& relPath,
-					   std::list<dbEntry>& lstFound)
+					   std::list<dbEntry>& lstFound,
+					   scanThrottle& throttle)
 {
 	//std::auto_ptr<fileInfo> fInfo;
 
@@ -144,6 +277,10 @@ void listdirRecursive( const std::string& basePath,
 
 	db_printf(6,"listdirRecursive(): %s\n",sStartDir.c_str () );
 
+	// Files are probed after listing the directory, so the next file can be
+	// read ahead while the current one is parsed.
+	std::vector< std::pair<uint64_t, std::string> > files;	//inode number, name
+
 	dirent* pEntry;
 	while ( (pEntry = readdir(pDir)) )
 	{
@@ -156,24 +293,38 @@ void listdirRecursive( const std::string& basePath,
 		if ( (isDir) && strcmp( pEntry->d_name, "..") && strcmp( pEntry->d_name, ".") )
 		{
 			std::string newRelPath = path::join(relPath, pEntry->d_name);
-			listdirRecursive( basePath, newRelPath, lstFound);
+			listdirRecursive( basePath, newRelPath, lstFound, throttle);
 		}
 		if( !(isDir) )
-		{
-			fileInfo fInfo( fullEntry.c_str() );
+			files.push_back( std::pair<uint64_t, std::string>( pEntry->d_ino, pEntry->d_name ) );
+	}
+	closedir( pDir );
 
-			if( fInfo.isAudioFile) {
-				dbEntry entry(relPath, string(pEntry->d_name), &fInfo );
-				lstFound.push_back( entry );
-				//db_printf(50,"%-30s: %s - %s, year %s\n", fInfo.url.c_str(), fInfo.tags["artist"].c_str(), fInfo.tags["title"].c_str(), fInfo.tags["year"].c_str() );
-			}
-			else
-			{
-				db_printf(5,"%-30s: invalid\n", pEntry->d_name);
-			}
+	// The inode order is a cheap approximation of the order on disk:
+	std::sort( files.begin(), files.end() );
+
+	if( files.size() > 0 )
+		throttle.willNeed( path::join(sStartDir, files[0].second) );
+	for(size_t i=0; i < files.size(); i++)
+	{
+		const std::string &name = files[i].second;
+		string fullEntry = path::join(sStartDir, name );
+		if( i+1 < files.size() )
+			throttle.willNeed( path::join(sStartDir, files[i+1].second) );
+
+		fileInfo fInfo( fullEntry.c_str() );
+
+		if( fInfo.isAudioFile) {
+			dbEntry entry(relPath, name, &fInfo );
+			lstFound.push_back( entry );
+			//db_printf(50,"%-30s: %s - %s, year %s\n", fInfo.url.c_str(), fInfo.tags["artist"].c_str(), fInfo.tags["title"].c_str(), fInfo.tags["year"].c_str() );
+		}
+		else
+		{
+			db_printf(5,"%-30s: invalid\n", name.c_str());
 		}
+		throttle.done( fullEntry );
 	}
-	closedir( pDir );
 }
 
 
@@ -259,7 +410,9 @@ void musicDB::scan(const char *dbName)
 	std::string relpath = "";	//need a reference, so can't pass a "" to listdirRecursive()
 
 	db_printf(3,"List recursive: '%s','%s'\n", basePath.c_str(), relpath.c_str() );
-	listdirRecursive( basePath, relpath, entries );
+	throttle.begin();
+	listdirRecursive( basePath, relpath, entries, throttle );
+	throttle.end();
 
 	// Generate data file
 	f_db = fopen(dbName, "wb");			//file with all data
@@ -30,6 +30,13 @@
 #include "debug.h"
 #include "fileInfo.hpp"
 
+// The shout server threads share the database file, a seek and the following
+// read must not be interrupted:
+#if defined(WIN32)
+	#define flockfile	_lock_file
+	#define funlockfile	_unlock_file
+#endif
+
 
 /// enum of fields which can be indexed
 enum dbField {
@@ -90,6 +97,60 @@ struct dbEntry {
 
 
 
+/// Limits the disk access of a scan, so it doesn't starve other users of the disk.
+/// The scanning thread runs at idle I/O priority, announces the header
+/// regions it's going to read to the kernel, and sleeps when it exceeds its
+/// budget.
+class scanThrottle
+{
+private:
+	/// A file of which the header regions are announced, kept open until done()
+	struct advised_s {
+		std::string fname;
+		int fd;
+		int64_t size;
+	};
+	std::vector<advised_s> advised;
+
+	uint32_t lastMs;		///< time of the previous account()
+	uint32_t debtMs;		///< budgeted time not yet spent
+	int		 oldPriority;	///< I/O priority before begin(), -1 if unknown
+
+	/// Apply posix_fadvise() to the header regions of a file, return the size of those regions
+	static uint32_t adviseHeaders(const advised_s &file, int advice);
+
+public:
+	uint32_t bytesPerSec;		///< budget, 0 for unlimited
+	uint32_t filesPerSec;		///< idem, in number of files
+	bool	 idlePriority;		///< use the idle I/O scheduling class while scanning
+
+	/// Size of the regions at the start and the end of a file which are
+	/// read for the tags and the audio properties
+	static const uint32_t headBytes = 128*1024;
+	static const uint32_t tailBytes =  64*1024;
+
+	scanThrottle():
+		lastMs(0), debtMs(0), oldPriority(-1),
+		bytesPerSec(0), filesPerSec(0),
+		idlePriority(true)
+	{ }
+
+	/// Start a scan in the calling thread: lower its I/O priority
+	void begin(void);
+
+	/// Restore the I/O priority, close the files still open for advice
+	void end(void);
+
+	/// Ask the kernel to read the header regions of a file in the background
+	void willNeed(const std::string &fname);
+
+	/// Drop the header regions from the page cache, and sleep if the
+	/// budget is exceeded
+	void done(const std::string &fname);
+};
+
+
+
 /// Music database. simple version just browses paths..
 class musicDB {
 	 friend class dbQuery;
@@ -102,6 +163,9 @@ private:
 	FILE					*f_db;			///< file handle to the database file.
 	std::vector<uint32_t>	offset;			///< offset into *.db file, one per entries
 	std::vector<uint32_t>	idx[IDX_END];	///< per string in dbEntry, a array of sorted indices into *offset.
+public:
+	scanThrottle			throttle;		///< disk access limits for scan()
+private:
 
 	/// Comparison functions for sorting and searching:
 	class compare
@@ -114,8 +178,11 @@ private:
 		size_t		maxStrLen;
 		const dbEntry operator[](const int idx)
 		{
+			flockfile(f_db);
 			fseek(f_db, (*offset)[idx], SEEK_SET);
-			return dbEntry(f_db);
+			dbEntry ret(f_db);
+			funlockfile(f_db);
+			return ret;
 		}
 	public:
 		compare(FILE *f_db, vec32_t *offset, const char* s): f_db(f_db), offset(offset), invalidStr(s)
@@ -200,8 +267,10 @@ public:
 	{
 		dbEntry ret;
 		if( idx < offset.size() ) {
+			flockfile(f_db);
 			fseek(f_db, offset[idx], SEEK_SET);
 			ret = dbEntry(f_db);
+			funlockfile(f_db);
 		}
 		return ret;
 	}
@@ -165,7 +165,7 @@ class nbuffer::buffer *shoutConnectionHandler::handleVFS(const char* request, co
 		//ordinary file, send the contents
 		//TODO: determine file type
 		sendHeader( getMime(strrchr(relStr.c_str(),'.'))  );
-		outBuf = new nbuffer::bufferFile( fullPath.c_str() );
+		outBuf = nbuffer::fileBuffer( fullPath.c_str() );
 	}
 	else if ( path::isdir(fullPath)   )
 	{
@@ -210,32 +210,331 @@ class nbuffer::buffer *shoutConnectionHandler::handleVFS(const char* request, co
 */
 
 
+/// Playlist and player commands from the web interface.
+/// These are posted to the slim server, which owns the players.
+class playerCommand: public eventTask
+{
+private:
+	slimIPC *ipc;
+	string cmd, groupName, deviceName;
+	string diskUrl;			//file or directory to make the entries from
+	std::vector<musicFile> entries;
+	string param, value;	//playlist index for 'play', action and value for 'control'
+
+public:
+	playerCommand(slimIPC *ipc, const string &cmd, const string &groupName, const string &deviceName,
+				  const string &diskUrl, const string &param="", const string &value=""):
+		ipc(ipc), cmd(cmd), groupName(groupName), deviceName(deviceName),
+		diskUrl(diskUrl), param(param), value(value)
+	{}
+
+	/// Reads the entries from disk, so it's done before run(), in the threadPool.
+	void load(void)
+	{
+		if( diskUrl.size() > 0 )
+			entries = makeEntries(diskUrl);
+	}
+
+	void run(void)
+	{
+		if( cmd == "add" )
+			ipc->addToGroup( groupName, entries);
+		else if( cmd == "play" )
+		{
+			if( param.size() > 0 )
+			{	//seek in current playlist
+				ipc->seekList( groupName, atoi(param.c_str()), SEEK_SET);
+			}
+			else if( entries.size() > 0 )
+			{
+				ipc->setGroup( groupName, entries);
+				ipc->seekList( groupName, 0, SEEK_SET);
+			}
+		}
+		else if( cmd == "control" )
+			ipc->setDevice( deviceName, param, value );
+	}
+};
+
+
+/// Loads a playerCommand in the threadPool, then posts it and answers the
+/// request. The answer waits for the post, so a client can close after it.
+class loadCommand: public blockingTask
+{
+private:
+	nbuffer::bufferDeferred *answer;	//queued response, only used in done()
+	shoutConnectionHandler::request_s req;
+	slimIPC *ipc;
+	playerCommand *command;
+
+public:
+	loadCommand(nbuffer::bufferDeferred *answer, const shoutConnectionHandler::request_s& req,
+				slimIPC *ipc, playerCommand *command):
+			answer(answer), req(req), ipc(ipc), command(command)
+	{ }
+
+	~loadCommand()
+	{
+		delete command;
+	}
+
+	void work(void)
+	{
+		command->load();
+	}
+
+	void done(connectionHandler *owner)
+	{
+		ipc->post( command );
+		command = NULL;
+		answer->set( shoutConnectionHandler::makeHeader(req, "text/plain", "200 OK", 0) );
+		owner->wakeWrite();
+	}
+};
+
+
+
+/// Rate limit of all streams together, in all threads
+static pthread_mutex_t totalRateMutex = PTHREAD_MUTEX_INITIALIZER;
+static util::tokenBucket totalRate(0, 1<<17);
+
+
+/// Sends a stream to a player in two phases: at full speed until the
+/// player's buffer reaches [shout] streamBurstFill percent, then slightly
+/// faster than the bitrate of the track. Both are limited by [shout]
+/// playerMaxRate and totalMaxRate. While it has to wait for its rate, the
+/// buffer blocks, and a timer wakes the connection up again.
+class bufferShaped: public nbuffer::buffer
+{
+private:
+	class resume: public util::timer
+	{
+	public:
+		connectionHandler *owner;
+		void expire(void)	{ owner->wakeWrite(); }
+	};
+
+	static const size_t minChunk = 4096;	//don't wake up for less
+
+	nbuffer::buffer *data;
+	slimIPC *ipc;
+	string player;
+	util::timerWheel *timers;
+	resume wakeUp;
+
+	uint32_t paceRate;			//bytes per second once the player buffer is filled, 0 if unknown
+	uint32_t burstFill;			//percentage
+	uint32_t playerMaxRate;		//bytes per second, 0 is unlimited
+	util::tokenBucket playerRate;
+	size_t charged;				//position up to which the rates are charged
+
+	/// Move the inner buffer to our position
+	void sync(void)
+	{
+		data->seek( (int)(_pos - data->pos()) );
+	}
+
+	/// Number of bytes which can be sent now
+	size_t allowance(void)
+	{
+		size_t n = _pos - charged;
+		charged = _pos;
+
+		slimIPC::playerBuffer_s buf;
+		bool burst = (paceRate == 0) || !ipc->getPlayerBuffer(player, &buf) ||
+			((uint64_t)buf.fill * 100 < (uint64_t)buf.size * burstFill);
+		playerRate.rate = playerMaxRate;
+		if( !burst )
+			playerRate.rate = (playerMaxRate > 0) ? util::min(paceRate, playerMaxRate) : paceRate;
+		playerRate.take(n);
+		size_t allow = playerRate.available();
+
+		pthread_mutex_lock( &totalRateMutex );
+		totalRate.take(n);
+		allow = util::min(allow, totalRate.available());
+		pthread_mutex_unlock( &totalRateMutex );
+		return allow;
+	}
+
+public:
+	bufferShaped(nbuffer::buffer *data, connectionHandler *owner, slimIPC *ipc, const string& player, uint32_t byteRate):
+			data(data),
+			ipc(ipc),
+			player(player),
+			timers(owner->timers()),
+			playerRate(0, 1<<15),
+			charged(0)
+	{
+		_size = data->size();
+		_pos  = data->pos();
+		charged = _pos;
+		wakeUp.owner = owner;
+
+		paceRate      = (uint64_t)byteRate * (int)ipc->getConfig("shout", "streamPace", 120) / 100;
+		burstFill     = (int)ipc->getConfig("shout", "streamBurstFill", 80);
+		playerMaxRate = (int)ipc->getConfig("shout", "playerMaxRate", 0);
+
+		pthread_mutex_lock( &totalRateMutex );
+		totalRate.rate = (int)ipc->getConfig("shout", "totalMaxRate", 0);
+		pthread_mutex_unlock( &totalRateMutex );
+	}
+
+	~bufferShaped()
+	{
+		delete data;
+	}
+
+	size_t size(void)
+	{
+		size_t left = data->size() - _pos;
+		return _pos + util::min(left, allowance());
+	}
+
+	bool canRead(void)
+	{
+		if( !data->canRead() )
+			return false;
+		size_t need = util::min(minChunk, data->size() - _pos);
+		if( (need == 0) || (allowance() >= need) || (timers == NULL) )
+			return true;
+
+		if( !wakeUp.armed() )
+		{
+			uint32_t wait = playerRate.waitMs(need);
+			pthread_mutex_lock( &totalRateMutex );
+			wait = util::max(wait, totalRate.waitMs(need));
+			pthread_mutex_unlock( &totalRateMutex );
+			timers->arm( &wakeUp, wait );
+		}
+		return false;
+	}
+
+	char eof(void)			{ sync(); return data->eof(); }
+	const char* ptr(void)	{ return data->ptr(); }
+	int fd(void)			{ return data->fd(); }
+	uint64_t fdOffset(void)	{ sync(); return data->fdOffset(); }
+	int close(void)			{ return data->close(); }
+
+	int read(void *dst, size_t len)
+	{
+		sync();
+		int n = data->read(dst, len);
+		_pos = data->pos();
+		return n;
+	}
+};
+
+
+
+/// Rendering from a template reads files, which mustn't block the thread
+/// which reports an update. It runs in the I/O pool, or without one in the
+/// loop of the connection, where a blockingTask would run too.
+class renderTask: public util::job, public eventTask
+{
+public:
+	void run(void)	{ work(); }
+
+	/// Takes ownership of the task
+	static void start(renderTask *task, util::threadPool *pool, TCPserver *server)
+	{
+		if( pool != NULL )
+			pool->queue( task );
+		else if( server != NULL )
+			server->post( task );
+		else
+		{
+			task->work();
+			delete task;
+		}
+	}
+};
+
+
+
 /* Class to keep an network connection open until an event has passed */
 class bufferNotify: public nbuffer::buffer
 {
-public:
+private:
+	// The answer is set once, by the renderJob, or by the deadline in the
+	// loop. It doesn't change anymore after canClose is set.
 	bool canClose;
 	string data;
+	pthread_mutex_t mutex;	//of canClose and data
 
-private:
+	/// Set the answer, unless there is one already
+	void setData(string& answer)
+	{
+		pthread_mutex_lock( &mutex );
+		if( !canClose )
+		{
+			data.swap( answer );
+			canClose = true;
+		}
+		pthread_mutex_unlock( &mutex );
+	}
+
+	bool isReady(void)
+	{
+		pthread_mutex_lock( &mutex );
+		bool ready = canClose;
+		pthread_mutex_unlock( &mutex );
+		return ready;
+	}
 
+	/// Called by slimIPC in the slim thread, which only queues the rendering.
+	/// It's shared with the renderJob, so it lives until both are done.
 	class callback: public slimIPC::callbackFcn
 	{
 	private:
 		slimIPC *ipc;
 		string clientName;
-		bufferNotify *parent;
         string templateFname;
-    public:
-		callback(slimIPC *ipc, string clientName, bufferNotify *parent, string templateFname):
+		connectionHandler *owner;	//connection to wake up once the data is ready
+		util::threadPool *pool;
+		TCPserver *server;
+
+		//protected by the mutex:
+		bufferNotify *parent;		//NULL once the buffer is gone
+		bool rendering;				//one answer is enough
+		int refs;					//of the buffer and the renderJob
+		pthread_mutex_t mutex;
+
+		class renderJob: public renderTask
+		{
+		public:
+			callback *fcn;
+			void work(void)	{ fcn->render(); }
+		};
+
+	public:
+		callback(slimIPC *ipc, string clientName, bufferNotify *parent, string templateFname, connectionHandler *owner):
 				ipc(ipc),
 				clientName(clientName),
+                templateFname(templateFname),
+				owner(owner),
+				pool( (owner != NULL) ? owner->ioPool() : NULL ),
+				server( (owner != NULL) ? owner->getServer() : NULL ),
 				parent(parent),
-                templateFname(templateFname)
-		{ }
+				rendering(false),
+				refs(1)
+		{
+			pthread_mutex_init( &mutex, NULL );
+		}
 
 		~callback()
 		{
+			pthread_mutex_destroy( &mutex );
+		}
+
+		/// The buffer is gone, delete it once the renderJob is done too
+		void detach(void)
+		{
+			pthread_mutex_lock( &mutex );
+			parent = NULL;
+			bool unused = (--refs == 0);
+			pthread_mutex_unlock( &mutex );
+			if( unused )
+				delete this;
 		}
 
         void writeHeader(string &data, const char *httpCode, string *mimeType=NULL)
@@ -248,67 +547,109 @@ private:
             data = html.str();
         }
 
-
 		bool call(void)
 		{
-			// One call is enough:
-			//ipc->unregisterCallback(this);
+			pthread_mutex_lock( &mutex );
+			bool idle = !rendering && (parent != NULL);
+			if( idle )
+			{
+				rendering = true;
+				refs++;
+			}
+			pthread_mutex_unlock( &mutex );
 
-			//const char *fields[] = {"volume","elapsed","playstate"};
-			string groupName = ipc->getGroup(clientName);
-			musicFile song = ipc->getSong(groupName);
-			//const playList* list = ipc->getList(clientName);
+			if( idle )
+			{
+				renderJob *job = new renderJob();
+				job->fcn = this;
+				renderTask::start( job, pool, server );
+			}
+			return false;       //don't want another callback
+		}
 
+		/// Render the answer, in the renderJob
+		void render(void)
+		{
+			// Render into a string of our own, the connection reads parent->data in its loop:
+			string data;
             //Check if we can get device info:
             if( ipc->getDevice( clientName, "volume" ).size() > 0)
             {
-                size_t fsize;
-                char *templateData = file::readfile( templateFname.c_str(), &fsize);
+                const file::cache::entry *templateData = file::cache::get( templateFname );
 
                 if( templateData != NULL )
                 {
                     //TODO: adjust mimetype base on file to serve.
-                    writeHeader(parent->data, "200 OK" );
+                    writeHeader(data, "200 OK" );
 
                     // Fill string with status update
 		            keywordMatcherIPC keywordMatcher(ipc, clientName,  NULL, NULL, NULL, NULL);
-                    dHtmlTemplate parser( &keywordMatcher );
-				    string parsedData = parser.generateData( templateData );
-                    free( templateData );
-                    parent->data.append( parsedData);
+                    compiledTemplate::of( templateData )->render( keywordMatcher, data );
+                    file::cache::release( templateData );
                 } else {
-                    writeHeader(parent->data, "404 NOT FOUND" );
-                    parent->data.append("URL '" + templateFname + "' could not be found\r\n");
+                    writeHeader(data, "404 NOT FOUND" );
+                    data.append("URL '" + templateFname + "' could not be found\r\n");
                 }
 
             } else {
-                writeHeader(parent->data, "404 NOT FOUND" );
-                parent->data.append("Device '" + clientName + "' is not known\r\n");
+                writeHeader(data, "404 NOT FOUND" );
+                data.append("Device '" + clientName + "' is not known\r\n");
             }
 
-            // Mark that it's ready to sent and close the connection:
-			parent->canClose = true;
-			return false;       //don't want another callback
+            // Mark that it's ready to sent and close the connection,
+			// unless the connection closed in the meantime:
+			pthread_mutex_lock( &mutex );
+			if( parent != NULL )
+			{
+				parent->setData( data );
+				if( owner != NULL )
+					owner->wakeWrite();
+			}
+			bool unused = (--refs == 0);
+			pthread_mutex_unlock( &mutex );
+			if( unused )
+				delete this;
+		}
+	};
+
+	/// Answers a long-poll with the current state when nothing changed in time
+	class deadline: public util::timer
+	{
+	public:
+		bufferNotify *parent;
+		void expire(void)
+		{
+			parent->ipc->unregisterCallback(parent->callbackFcn);
+			if( !parent->isReady() )
+				parent->callbackFcn->call();
 		}
 	};
 
 	callback *callbackFcn;
 	slimIPC *ipc;
+	deadline timeout;
+
 public:
+	static const uint32_t maxWait = 25000;	///< ms, below most proxy time-outs
 
-	bufferNotify(slimIPC *ipc, string clientName, string templateFname, bool doWait=true):
+	bufferNotify(slimIPC *ipc, string clientName, string templateFname, connectionHandler *owner, bool doWait=true):
 			ipc(ipc)
 	{
 		_size = 0;
 		_pos  = 0;
 		canClose = false;
-		callbackFcn = new callback(ipc, clientName, this, templateFname);
+		pthread_mutex_init( &mutex, NULL );
+		callbackFcn = new callback(ipc, clientName, this, templateFname, owner);
+		timeout.parent = this;
 
 		if( doWait )
 		{
 			// Register callback with ipc, to set
 			// data on update.
 			ipc->registerCallback(callbackFcn,clientName);
+			util::timerWheel *timers = (owner != NULL) ? owner->timers() : NULL;
+			if( timers != NULL )
+				timers->arm( &timeout, maxWait );
 		} else {
 			// Set data immediately
 			callbackFcn->call();
@@ -318,30 +659,31 @@ public:
 	~bufferNotify()
 	{
 		ipc->unregisterCallback(callbackFcn);
-		delete callbackFcn;
+		callbackFcn->detach();
+		pthread_mutex_destroy( &mutex );
 	}
 
 
 	//nbuffer interface:
 	char eof(void)
 	{
-		return canClose && (_pos >= _size);
+		return isReady() && (_pos >= data.size());
 	}
 
 	size_t size(void)
 	{
-		return canClose ? data.size() : 0;
+		return isReady() ? data.size() : 0;
 	}
 
 	//don't return any pointer until we are ready to send:
 	const char* ptr(void)
 	{
-		return canClose ? data.c_str(): NULL;
+		return isReady() ? data.c_str(): NULL;
 	}
 
 	int read(void *dst, size_t len)
 	{
-        if( !canClose) return 0;
+        if( !isReady()) return 0;
 		size_t nrCopy = util::min<int32_t>(len, _size - _pos );
 		memcpy(dst, data.c_str() + _pos, nrCopy);
 		_pos += nrCopy;
@@ -352,7 +694,7 @@ public:
     /// Return true of read() will not be blocking.
     bool canRead(void)
     {
-        return canClose;
+        return isReady();
     }
 
 	int close(void)
@@ -366,6 +708,783 @@ public:
 
 
 
+class eventChannel;
+
+/// Server-sent events, the body of a response which doesn't end.
+/// Events are queued by the eventChannel in any thread, and a comment is
+/// sent when it's quiet, to keep proxies from closing the connection.
+class bufferEvents: public nbuffer::buffer
+{
+private:
+	string pending;			//not sent yet
+	pthread_mutex_t mutex;	//of pending
+	connectionHandler *owner;	//connection to wake up for new events
+
+	class keepAlive: public util::timer
+	{
+	public:
+		bufferEvents *parent;
+		void expire(void)
+		{
+			parent->push( ":\n\n" );
+			parent->owner->timers()->arm( this, interval );
+		}
+	};
+	keepAlive idle;
+
+public:
+	eventChannel *channel;		//set while it's subscribed
+	static const uint32_t interval = 25000;		///< ms between comments, see bufferNotify::maxWait
+	static const size_t maxPending = 64<<10;	///< further events are dropped by a slow client
+
+	bufferEvents(connectionHandler *owner):
+			owner(owner),
+			channel(NULL)
+	{
+		_size = 0;
+		_pos  = 0;
+		pthread_mutex_init( &mutex, NULL );
+		idle.parent = this;
+		if( owner->timers() != NULL )
+			owner->timers()->arm( &idle, interval );
+	}
+
+	~bufferEvents();
+
+	/// Queue an event, false if it's dropped
+	bool push(const string& event)
+	{
+		pthread_mutex_lock( &mutex );
+		bool fits = (pending.size() + event.size() <= maxPending);
+		if( fits )
+			pending.append( event );
+		pthread_mutex_unlock( &mutex );
+		if( fits )
+			owner->wakeWrite();
+		return fits;
+	}
+
+	//nbuffer interface:
+	char eof(void)
+	{
+		return false;
+	}
+
+	size_t size(void)
+	{
+		pthread_mutex_lock( &mutex );
+		size_t n = _pos + pending.size();
+		pthread_mutex_unlock( &mutex );
+		return n;
+	}
+
+	bool canRead(void)
+	{
+		return size() > _pos;
+	}
+
+	int read(void *dst, size_t len)
+	{
+		pthread_mutex_lock( &mutex );
+		size_t nrCopy = util::min( len, pending.size() );
+		memcpy( dst, pending.data(), nrCopy );
+		pending.erase( 0, nrCopy );
+		_pos += nrCopy;
+		pthread_mutex_unlock( &mutex );
+		return nrCopy;
+	}
+
+	int close(void)
+	{
+		return 0;
+	}
+};
+
+
+/// The state of a device for server-sent events. It's rendered from a
+/// template once for all subscribers, when the state versions changed, and
+/// only sent when the result is different. Rendering reads files, so it
+/// runs in a renderTask, never in the thread which reports the update.
+class eventChannel: public slimIPC::callbackFcn
+{
+private:
+	slimIPC *ipc;
+	string device;
+	string templateFname;
+	util::threadPool *pool;		//renders, NULL to render in the loop of the server
+	TCPserver *server;
+
+	//only used by the renderJob, of which there is one at a time:
+	slimIPC::stateVersion_s version;	//of the last rendering
+	bool rendered;
+	string state;			//last rendering
+	uint64_t id;			//of the last event
+
+	//protected by the mutex:
+	bool dirty;				//the state may have changed since it was rendered
+	bool rendering;			//a renderJob is queued or running
+	bool closed;			//no subscribers are left, the renderJob deletes the channel
+	string lastEvent;		//for new subscribers
+	vector<bufferEvents*> subscribers;
+
+	static map<string,eventChannel*> channels;	//by template and device
+	static pthread_mutex_t mutex;				//of all channels
+
+	class renderJob: public renderTask
+	{
+	public:
+		eventChannel *channel;
+		void work(void)	{ channel->renderAll(); }
+	};
+
+	eventChannel(slimIPC *ipc, const string& device, const string& templateFname,
+				 util::threadPool *pool, TCPserver *server):
+			ipc(ipc), device(device), templateFname(templateFname), pool(pool), server(server),
+			rendered(false), id(0), dirty(false), rendering(false), closed(false)
+	{ }
+
+	/// Mark the state as changed. Called with the mutex locked,
+	/// returns true if the caller has to start() a renderJob.
+	bool invalidate(void)
+	{
+		dirty = true;
+		if( rendering )
+			return false;	//the running job renders it again
+		rendering = true;
+		return true;
+	}
+
+	/// Render in a renderTask, call it without the mutex locked
+	void start(void)
+	{
+		renderJob *job = new renderJob();
+		job->channel = this;
+		renderTask::start( job, pool, server );
+	}
+
+	/// Render until the state is up to date, and send the changes to all subscribers
+	void renderAll(void)
+	{
+		pthread_mutex_lock( &mutex );
+		while( dirty && !closed )
+		{
+			dirty = false;
+			pthread_mutex_unlock( &mutex );
+			string event = render();
+			pthread_mutex_lock( &mutex );
+
+			if( event.size() == 0 )
+				continue;
+			lastEvent = event;
+			for(size_t i=0; i < subscribers.size(); i++)
+				subscribers[i]->push( lastEvent );
+		}
+		rendering = false;
+		bool unused = closed;
+		pthread_mutex_unlock( &mutex );
+
+		if( unused )
+			delete this;
+	}
+
+	/// Render the state if it changed, returns the event to send, or an
+	/// empty string if there's nothing new
+	string render(void)
+	{
+		slimIPC::stateVersion_s v = ipc->getVersion( device );
+		if( (rendered && (v == version)) || (ipc->getDevice( device, "volume" ).size() == 0) )
+			return string();	//same state, or the device isn't there
+		version  = v;
+		rendered = true;
+
+		const file::cache::entry *templateData = file::cache::get( templateFname );
+		string data;
+		keywordMatcherIPC keywordMatcher(ipc, device, NULL, NULL, NULL, NULL);
+		if( templateData != NULL )
+			compiledTemplate::of( templateData )->render( keywordMatcher, data );
+		file::cache::release( templateData );
+		if( data == state )
+			return string();
+		state = data;
+
+		// Every line is a data field, the client joins them again:
+		char idLine[32];
+		sprintf( idLine, "id: %llu\n", (LLU)++id );
+		string event = idLine;
+		vector<string> lines = pstring::split( state, '\n' );
+		for(size_t i=0; i < lines.size(); i++)
+		{
+			string &line = lines[i];
+			if( (line.size() > 0) && (line[line.size()-1] == '\r') )
+				line.erase( line.size()-1 );
+			event.append( "data: " );
+			event.append( line );
+			event.push_back( '\n' );
+		}
+		event.push_back( '\n' );
+		return event;
+	}
+
+public:
+	/// From slimIPC::notifyClientUpdate(), for an update of any device
+	bool call(void)
+	{
+		pthread_mutex_lock( &mutex );
+		bool idle = invalidate();
+		pthread_mutex_unlock( &mutex );
+		if( idle )
+			start();
+		return true;
+	}
+
+	/// Send the events of a device to sub, starting with the current state
+	static void subscribe(bufferEvents *sub, slimIPC *ipc, const string& device, const string& templateFname,
+						  util::threadPool *pool, TCPserver *server)
+	{
+		string key = templateFname + "\n" + device;
+		pthread_mutex_lock( &mutex );
+		eventChannel *c = channels[key];
+		bool created = (c == NULL);
+		if( created )
+			c = channels[key] = new eventChannel( ipc, device, templateFname, pool, server );
+		c->subscribers.push_back( sub );
+		sub->channel = c;
+		sub->push( "retry: 2000\n\n" );
+		if( c->lastEvent.size() > 0 )
+			sub->push( c->lastEvent );
+		bool idle = c->invalidate();
+		pthread_mutex_unlock( &mutex );
+
+		if( idle )
+			c->start();
+		// Outside the mutex, since slimIPC calls the channels with its own mutex locked:
+		if( created )
+			ipc->registerCallback( c, device );
+	}
+
+	/// Stop sending events to sub
+	static void unsubscribe(bufferEvents *sub)
+	{
+		eventChannel *c = sub->channel;
+		if( c == NULL )
+			return;
+		pthread_mutex_lock( &mutex );
+		c->subscribers.erase( std::find( c->subscribers.begin(), c->subscribers.end(), sub ) );
+		bool unused = c->subscribers.empty();
+		if( unused )
+			channels.erase( c->templateFname + "\n" + c->device );
+		pthread_mutex_unlock( &mutex );
+		sub->channel = NULL;
+
+		if( unused )
+		{	//no call() can be running anymore once it's unregistered:
+			c->ipc->unregisterCallback( c );
+			pthread_mutex_lock( &mutex );
+			c->closed = true;
+			bool busy = c->rendering;
+			pthread_mutex_unlock( &mutex );
+			if( !busy )
+				delete c;
+		}
+	}
+};
+
+map<string,eventChannel*> eventChannel::channels;
+pthread_mutex_t eventChannel::mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+bufferEvents::~bufferEvents()
+{
+	eventChannel::unsubscribe( this );
+	pthread_mutex_destroy( &mutex );
+}
+
+
+
+/// A byte range of a file, as requested by the Range header.
+/// Without a (valid) range, it's the whole file.
+struct fileRange
+{
+	http::rangeResult status;
+	uint64_t first, last;	//inclusive
+	uint64_t size;			//of the whole file
+
+	fileRange(): status(http::RANGE_NONE), first(0), last(0), size(0)
+	{ }
+
+	void parse(const string& header, uint64_t fileSize)
+	{
+		size   = fileSize;
+		status = (header.size() > 0) ? http::parseRange(header, size, &first, &last) : http::RANGE_NONE;
+	}
+
+	const char *code(void)
+	{
+		if( status == http::RANGE_OK )
+			return "206 Partial Content";
+		if( status == http::RANGE_INVALID )
+			return "416 Requested Range Not Satisfiable";
+		return "200 OK";
+	}
+
+	/// Header lines for makeHeader()
+	string headers(void)
+	{
+		char str[96];
+		if( status == http::RANGE_OK )
+			sprintf(str, "Accept-Ranges: bytes\r\nContent-Range: bytes %llu-%llu/%llu", (LLU)first, (LLU)last, (LLU)size);
+		else if( status == http::RANGE_INVALID )
+			sprintf(str, "Content-Range: bytes */%llu", (LLU)size);
+		else
+			strcpy(str, "Accept-Ranges: bytes");
+		return str;
+	}
+
+	/// The requested part of the file, NULL if there's nothing to send.
+	/// Takes over the reference to cached, if it's in the file cache.
+	nbuffer::buffer *open(const char *fname, const file::cache::entry *cached=NULL)
+	{
+		size_t start = 0, end = (size_t)-1;
+		if( status == http::RANGE_OK )
+		{
+			start = (size_t)first;
+			end   = (size_t)last + 1;
+		}
+		if( status == http::RANGE_INVALID )
+		{
+			file::cache::release( cached );
+			return NULL;
+		}
+		if( cached != NULL )
+			return new nbuffer::bufferCached(cached, start, end);
+		return nbuffer::fileBuffer(fname, start, end);
+	}
+};
+
+
+/// A page of the web interface or a directory listing, with the templates
+/// and the matcher it needs until it's completely rendered.
+class pageRenderer
+{
+private:
+	const file::cache::entry *tplDir, *tplDirItem, *tplPLitem, *tplDevice;
+	keywordMatcherIPC keywordMatcher;
+	dHtmlVFS vfs;
+
+public:
+	pageRenderer(slimIPC *ipc, const string& deviceName, const string& vfsPath, const string& absPath,
+				 const string& dataPath, const string& htmlPath, bool withLists):
+			tplDir( file::cache::get( path::join( htmlPath, "dirlist.html" ) ) ),
+			tplDirItem( file::cache::get( path::join( htmlPath, "dirlistItem.html" ) ) ),
+			tplPLitem( withLists ? file::cache::get( path::join( htmlPath, "playlistItem.html" ) ) : NULL ),
+			tplDevice( withLists ? file::cache::get( path::join( htmlPath, "deviceListItem.html" ) ) : NULL ),
+			keywordMatcher(ipc, deviceName,
+						   dataPath.c_str(), "/data/",	//disk and http path
+						   compiledTemplate::of( tplPLitem ),
+						   compiledTemplate::of( tplDevice )),
+			vfs( &keywordMatcher,
+				 vfsPath, absPath,		//The VFS-path and disk-path
+				 compiledTemplate::of( tplDir ), compiledTemplate::of( tplDirItem ))	//the template files
+	{ }
+
+	~pageRenderer()
+	{
+		file::cache::release( tplDir );
+		file::cache::release( tplDirItem );
+		file::cache::release( tplPLitem );
+		file::cache::release( tplDevice );
+	}
+
+	/// Append about maxBytes of the page, returns false once it's complete
+	bool render(string& out, size_t maxBytes)
+	{
+		return vfs.render( out, maxBytes );
+	}
+};
+
+
+/// Sends the rest of a large page, which is rendered whenever the socket
+/// has taken the previous part.
+class bufferPage: public nbuffer::bufferGenerator
+{
+private:
+	pageRenderer *page;
+	static const size_t partSize = 16<<10;
+
+	bool generate(string& out)
+	{
+		return page->render( out, partSize );
+	}
+
+public:
+	bufferPage(pageRenderer *page, bool chunked, const string& first):
+			bufferGenerator(chunked, first),
+			page(page)
+	{ }
+
+	~bufferPage()
+	{
+		delete page;
+	}
+};
+
+
+/// Rendered pages of the web interface, per device. A page is only rendered
+/// again once the state of its device or one of its templates changed.
+class pageCache
+{
+private:
+	struct page_s {
+		slimIPC::stateVersion_s version;	//of the state it's rendered from
+		uint64_t templates;		//identifies the template files
+		string data, etag;
+		uint64_t used;			//for the LRU
+	};
+	map<string,page_s> pages;	//by file name and device
+	uint64_t clock;
+	pthread_mutex_t mutex;
+	static const size_t maxPages = 64;
+
+public:
+	pageCache(): clock(0)
+	{
+		pthread_mutex_init( &mutex, NULL );
+	}
+
+	/// Copy a page to *data and *etag, false if it's not there or out of date
+	bool get(const string& key, const slimIPC::stateVersion_s& version, uint64_t templates,
+			 string *data, string *etag)
+	{
+		pthread_mutex_lock( &mutex );
+		map<string,page_s>::iterator it = pages.find( key );
+		bool found = (it != pages.end()) && (it->second.version == version)
+						&& (it->second.templates == templates);
+		if( found )
+		{
+			it->second.used = ++clock;
+			*data = it->second.data;
+			*etag = it->second.etag;
+		}
+		pthread_mutex_unlock( &mutex );
+		return found;
+	}
+
+	/// Store a page, rendered from the state at version
+	void put(const string& key, const slimIPC::stateVersion_s& version, uint64_t templates,
+			 const string& data, const string& etag)
+	{
+		pthread_mutex_lock( &mutex );
+		if( (pages.size() >= maxPages) && (pages.find( key ) == pages.end()) )
+		{	//make room, by removing the least recently used:
+			map<string,page_s>::iterator oldest = pages.begin();
+			for(map<string,page_s>::iterator it = pages.begin(); it != pages.end(); it++)
+				if( it->second.used < oldest->second.used )
+					oldest = it;
+			pages.erase( oldest );
+		}
+		page_s &p = pages[key];
+		p.version   = version;
+		p.templates = templates;
+		p.data      = data;
+		p.etag      = etag;
+		p.used      = ++clock;
+		pthread_mutex_unlock( &mutex );
+	}
+};
+
+static pageCache renderedPages;
+
+
+/// Renders a /data/ or /html/ page in the threadPool, since the templates,
+/// the directory listing and the file itself all come from disk.
+class renderVFS: public blockingTask
+{
+private:
+	nbuffer::bufferDeferred *head, *page;	//queued response, only used in done()
+	nbuffer::buffer *result;
+	string mime;
+	shoutConnectionHandler::request_s req;	//framing of the response
+	map<string,string> headers;		//of the request, for Range and the validators
+	fileRange range;
+	bool rawFile;			//sent as is, so it can be sent in parts
+	string etag, lastModified;
+	string encoding;		//of a precompressed variant
+	bool vary;				//there are precompressed variants
+	string cacheControl;	//for raw files, rendered pages are always revalidated
+	bool notModified;		//the client's copy is still valid
+	slimIPC *ipc;
+	string deviceName;
+	string vfsPath;			//request path
+	string vfsBase;			//part of vfsPath which is replaced by diskPath
+	string diskPath;
+	string dataPath;		//music files, for links in the page
+	string htmlPath;		//templates
+	bool withLists;			//expand playlist and device templates
+	bool streamed;			//too large to render at once, sent while it's rendered
+
+	/// Larger pages aren't rendered completely before they're sent
+	static const size_t maxRendered = 64<<10;
+
+public:
+	renderVFS(nbuffer::bufferDeferred *head, nbuffer::bufferDeferred *page,
+			  const shoutConnectionHandler::request_s& req, const map<string,string>& headers,
+			  const string& cacheControl, slimIPC *ipc, const string& deviceName,
+			  const string& vfsPath, const char *vfsBase, const string& diskPath,
+			  const string& dataPath, const string& htmlPath, bool withLists):
+			head(head), page(page), result(NULL), req(req), headers(headers), rawFile(false), vary(false),
+			cacheControl(cacheControl), notModified(false), ipc(ipc), deviceName(deviceName),
+			vfsPath(vfsPath), vfsBase(vfsBase), diskPath(diskPath),
+			dataPath(dataPath), htmlPath(htmlPath), withLists(withLists), streamed(false)
+	{ }
+
+	~renderVFS()
+	{
+		delete result;
+	}
+
+	/// Compare the validators with the conditional headers of the request
+	bool isNotModified(void)
+	{
+		string ifNoneMatch = headers["If-None-Match"];
+		if( ifNoneMatch.size() > 0 )		//takes precedence over the date
+			return http::etagMatches( ifNoneMatch, etag );
+		// Clients send back the date they got, so there's no need to parse it:
+		return (lastModified.size() > 0) && (pstring::strip( headers["If-Modified-Since"] ) == lastModified);
+	}
+
+	/// Use a precompressed name.br or name.gz instead, if it's cached and the client accepts it
+	void selectEncoding(const string& absPath, const file::cache::entry **cached, path::fileProps_s *props)
+	{
+		static const char *encodings[][2] = { {"br", ".br"}, {"gzip", ".gz"} };
+		string accept = headers["Accept-Encoding"];
+		for(size_t i=0; i < array_size(encodings); i++)
+		{
+			const file::cache::entry *variant = file::cache::get( absPath + encodings[i][1] );
+			if( variant == NULL )
+				continue;
+			vary = true;
+			if( (encoding.size() == 0) && (accept.find( encodings[i][0] ) != string::npos) )
+			{
+				file::cache::release( *cached );
+				*cached  = variant;
+				*props   = variant->props;
+				encoding = encodings[i][0];
+			} else
+				file::cache::release( variant );
+		}
+	}
+
+	/// Identifies the templates a page of the web interface is rendered with
+	uint64_t templateStamp(const file::cache::entry *page)
+	{
+		static const char *items[] = { "playlistItem.html", "deviceListItem.html" };
+		uint64_t h = util::fnv1a( &page->props, sizeof(page->props) );
+		for(size_t i=0; i < array_size(items); i++)
+		{
+			const file::cache::entry *item = file::cache::get( path::join( htmlPath, items[i] ) );
+			if( item != NULL )
+				h = util::fnv1a( &item->props, sizeof(item->props), h );
+			file::cache::release( item );
+		}
+		return h;
+	}
+
+	void work(void)
+	{
+		string absPath = htmlRequestExtractPath( vfsPath.c_str(), vfsBase.c_str(), diskPath.c_str() );
+		path::fileProps_s props;
+		// Only the web interface is cached, not the music:
+		const file::cache::entry *cached = withLists ? file::cache::get( absPath ) : NULL;
+		bool isFile = (cached != NULL) || path::fileProps( absPath, &props );
+		if( cached != NULL )
+			props = cached->props;
+		mime = isFile ? getMime( strrchr(absPath.c_str(),'.') ) : "text/html";
+
+		// Files which aren't parsed as template can be requested in parts,
+		// and are validated by their file properties. That includes text
+		// without any keywords, which would be rendered as is:
+		bool isTemplate = (mime.compare(0, 4, "text") == 0)
+						&& ((cached == NULL) || (memchr(cached->data, '#', cached->size) != NULL));
+		rawFile = isFile && !isTemplate;
+		char tag[64];
+		if( rawFile )
+		{
+			if( headers["Range"].size() == 0 )		//ranges are of the file as is
+				selectEncoding( absPath, &cached, &props );
+			sprintf(tag, "\"%llx-%llx-%llx\"", (LLU)props.inode, (LLU)props.size, (LLU)props.mtime);
+			etag = tag;
+			lastModified = http::formatDate( props.mtime );
+			notModified = isNotModified();
+			if( !notModified )
+			{
+				range.parse( headers["Range"], props.size );
+				result = range.open( absPath.c_str(), cached );
+				cached = NULL;
+			}
+		} else {
+			// Templates of the web interface only depend on the state of the
+			// device, so they're rendered once for every version of it:
+			bool cacheable = withLists && (cached != NULL);
+			string key = absPath + "\n" + deviceName;
+			slimIPC::stateVersion_s version = ipc->getVersion( deviceName );	//before it's rendered
+			uint64_t templates = cacheable ? templateStamp( cached ) : 0;
+			string data;
+			if( !cacheable || !renderedPages.get( key, version, templates, &data, &etag ) )
+			{
+				pageRenderer *renderer = new pageRenderer( ipc, deviceName, vfsPath, absPath,
+														   dataPath, htmlPath, withLists );
+				bool more = renderer->render( data, maxRendered );
+				// The rest of a large page is rendered while it's sent. Without
+				// chunks that's only possible if the connection closes after it:
+				streamed = more && !req.headOnly && (req.http11 || !req.keepAlive);
+				if( streamed )
+					result = new bufferPage( renderer, req.http11, data );
+				else
+				{
+					while( more )
+						more = renderer->render( data, maxRendered );
+					delete renderer;
+
+					// Rendered pages depend on the player state as well, so tag the result:
+					sprintf(tag, "\"t%llx\"", (LLU)util::fnv1a( data.data(), data.size() ));
+					etag = tag;
+					if( cacheable )
+						renderedPages.put( key, version, templates, data, etag );
+				}
+			}
+			if( !streamed )
+			{
+				notModified = isNotModified();
+				if( !notModified )
+					result = new nbuffer::bufferString( data );
+			}
+		}
+
+		file::cache::release( cached );
+	}
+
+	void done(connectionHandler *owner)
+	{
+		string extra;
+		if( etag.size() > 0 )
+			extra = "ETag: " + etag + "\r\nCache-Control: " + (rawFile ? cacheControl : string("no-cache"));
+		else if( streamed )
+			extra = "Cache-Control: no-cache";
+		if( lastModified.size() > 0 )
+			extra += "\r\nLast-Modified: " + lastModified;
+		if( encoding.size() > 0 )
+			extra += "\r\nContent-Encoding: " + encoding;
+		if( vary )
+			extra += "\r\nVary: Accept-Encoding";
+
+		if( notModified )
+			head->set( shoutConnectionHandler::makeHeader(req, mime.c_str(), "304 Not Modified", 0, extra.c_str()) );
+		else if( rawFile )
+			head->set( shoutConnectionHandler::makeHeader(req, mime.c_str(), range.code(),
+							(result != NULL) ? result->size() : 0, (extra + "\r\n" + range.headers()).c_str()) );
+		else if( streamed )
+			head->set( shoutConnectionHandler::makeHeader(req, mime.c_str(), "200 OK",
+							shoutConnectionHandler::chunkedLength, extra.c_str()) );
+		else if( result != NULL )
+			head->set( shoutConnectionHandler::makeHeader(req, mime.c_str(), "200 OK", result->size(), extra.c_str()) );
+		else
+			head->set( shoutConnectionHandler::makeHeader(req, "text/html", "404 Not Found", 0) );
+		if( req.headOnly )
+		{
+			delete result;
+			result = NULL;
+		}
+		page->set( result );
+		result = NULL;
+		owner->wakeWrite();
+	}
+};
+
+
+/// Opens a stream in the threadPool, since building the seek index reads
+/// through the file.
+class openStream: public blockingTask
+{
+private:
+	nbuffer::bufferDeferred *status, *head, *body;	//queued responses, only used in done()
+	nbuffer::buffer *headData, *bodyData;
+	shoutConnectionHandler::request_s req;	//framing of the response
+	string mime;
+	string rangeHeader;
+	fileRange range;
+	slimIPC *ipc;
+	string fname;
+	string player;
+	uint32_t startMs;	//requested play time
+	uint32_t realMs;	//play time at which the data really starts
+	int length;			//seconds
+	bool useIndex;
+
+public:
+	openStream(nbuffer::bufferDeferred *status, nbuffer::bufferDeferred *head, nbuffer::bufferDeferred *body,
+			   const shoutConnectionHandler::request_s& req, const string& mime, const string& rangeHeader,
+			   slimIPC *ipc, const string& fname, const string& player, uint32_t startMs, int length, bool useIndex):
+			status(status), head(head), body(body), headData(NULL), bodyData(NULL),
+			req(req), mime(mime), rangeHeader(rangeHeader), ipc(ipc),
+			fname(fname), player(player), startMs(startMs), realMs(0), length(length), useIndex(useIndex)
+	{ }
+
+	~openStream()
+	{
+		delete headData;
+		delete bodyData;
+	}
+
+	void work(void)
+	{
+		seekIndex idx;
+		if( useIndex && idx.build(fname.c_str()) )
+		{
+			// Decoder setup data first, then the frames from the seek point on:
+			if( idx.headerSize > 0 )
+				headData = nbuffer::fileBuffer(fname.c_str(), idx.headerStart, idx.headerStart + idx.headerSize);
+			bodyData = nbuffer::fileBuffer(fname.c_str(), idx.lookup(startMs, &realMs), idx.dataEnd);
+			db_printf(2,">SHOUT: starting stream at %u ms\n", realMs);
+		} else {
+			// Byte offsets only apply to the file as is, resuming costs nothing then:
+			range.parse( rangeHeader, util::max<int64_t>(path::filesize(fname), 0) );
+			bodyData = range.open( fname.c_str() );
+			if( range.status == http::RANGE_OK )
+				db_printf(2,">SHOUT: resuming stream at byte %llu\n", (LLU)range.first);
+		}
+	}
+
+	void done(connectionHandler *owner)
+	{
+		// The player counts from the start of the data, which is only at
+		// the requested time if the index had a point there:
+		ipc->setStreamStart(player, startMs, realMs);
+
+		// Only the file as is has a known length, the index adds its header:
+		int64_t contentLength = -1;
+		if( (headData == NULL) && (bodyData != NULL) )
+			contentLength = bodyData->size();
+		else if( range.status == http::RANGE_INVALID )
+			contentLength = 0;
+		status->set( shoutConnectionHandler::makeHeader(req, mime.c_str(), range.code(),
+													contentLength, range.headers().c_str()) );
+
+		// Don't flood the network once the player has enough data:
+		if( (owner->timers() != NULL) && (bodyData != NULL) )
+		{
+			int secsLeft = length - (int)(realMs / 1000);
+			uint32_t byteRate = (secsLeft > 0) ? (uint32_t)(bodyData->size() / secsLeft) : 0;
+			bodyData = new bufferShaped(bodyData, owner, ipc, player, byteRate);
+		}
+		head->set( headData );
+		body->set( bodyData );
+		headData = bodyData = NULL;
+		owner->wakeWrite();
+	}
+};
+
+
+
 /// Parse request, returns a buffer with the response, or NULL if there is no response
 nbuffer::buffer* shoutConnectionHandler::handleGet(const char* request)
 {
@@ -374,6 +1493,11 @@ nbuffer::buffer* shoutConnectionHandler::handleGet(const char* request)
 
 	string dataPath = ipc->getConfig("musicDB","path", ".");
 	string htmlPath = ipc->getConfig("shout","htmlPath", "./html" );
+	// Static files may be used this long without asking, 0 revalidates every time:
+	int cacheMaxAge = (int)ipc->getConfig("shout","cacheMaxAge", 3600 );
+	char cacheControl[32] = "no-cache";
+	if( cacheMaxAge > 0 )
+		sprintf(cacheControl, "max-age=%i", cacheMaxAge);
 
 	//Definition of the root file system:
 	const char *dynamicEntries[] = {
@@ -408,6 +1532,14 @@ nbuffer::buffer* shoutConnectionHandler::handleGet(const char* request)
 	http::parseRequestHeader hdr(request);
 	//map<string,string> *params = &(hdr.headerParam);
 
+	// HTTP/1.1 keeps the connection by default, HTTP/1.0 only when asked:
+	string connection = hdr.headerParam["Connection"];
+	pstring::tolower( connection );
+	req.http11    = (hdr.version == "HTTP/1.1");
+	req.keepAlive = req.http11 ? (connection.find("close") == string::npos)
+							   : (connection.find("keep-alive") != string::npos);
+	req.headOnly  = (hdr.method == "HEAD");
+
 	// Get current device:
 	string currentDeviceName = path::unescape( hdr.getCookie("device") );
 	if( currentDeviceName.size() == 0)
@@ -441,85 +1573,79 @@ nbuffer::buffer* shoutConnectionHandler::handleGet(const char* request)
 				std::string dirPage = htmlFileList(dirList);
 
 				//copy the string into the buffer:
-				response     = new nbuffer::bufferString( dirPage );
-				sendHeader("text/html");
+				response     = reply( new nbuffer::bufferString( dirPage ), "text/html" );
 			}
 			break;
 		case STREAM:	// Stream data
 			{
 				db_printf(2,">SHOUT: sending music stream\n");
+				writeClass = WRITE_STREAM;
 
 				// Get song to be played
 				const playList *list = ipc->getList( hdr.getUrlParam("player") );
-				if( list != NULL)
+				uint32_t startMs = atoi( hdr.getUrlParam("start").c_str() );	//play time to start from
+				if( req.headOnly )
+				{
+					sendHeader();
+					response     = new nbuffer::bufferMem(NULL, 0, 0);
+					break;
+				}
+				if( (list != NULL) && (list->currentItem < list->items.size()) )
 				{
 					vector<musicFile>::const_iterator it = list->begin() + list->currentItem;
 					const char *fname = it->url.c_str();
-					response     = new nbuffer::bufferFile(fname);
-				} else
+					const fileFormat *format = getFormat( strrchr(fname,'.') );
+
+					// Containers the player can't parse (wav, aiff) always go through the
+					// index, which skips their headers.
+					bool audioOnly = (format != NULL) && format->audioOnly;
+					nbuffer::bufferDeferred *status = new nbuffer::bufferDeferred();
+					nbuffer::bufferDeferred *head = new nbuffer::bufferDeferred();
+					nbuffer::bufferDeferred *body = new nbuffer::bufferDeferred();
+					write( status );
+					write( head );
+					response = body;
+
+					// A stream ends the connection, the header follows once the file is opened:
+					request_s streamReq = req;
+					streamReq.keepAlive = false;
+					closeAfterLastWrite = true;
+					offload( new openStream(status, head, body, streamReq,
+											(format != NULL) ? format->mime : "audio/mpeg",
+											hdr.headerParam["Range"], ipc, fname, hdr.getUrlParam("player"),
+											startMs, it->length, (startMs > 0) || audioOnly) );
+				} else {
+					sendHeader();
 					response     = new nbuffer::bufferMem(NULL, 0, 0);	//send an empty file
+				}
 				streamStatus = ST_START;
-				sendHeader();
 			}
 			break;
 		case DATA:		// music database
 			{
-				//response = handleVFS(request, dynamicEntries[DATA], dataPath.c_str() );
-				// only parse directories, not files:
-				string templateDir     = path::join( htmlPath, "dirlist.html" );
-				string templateDirItem = path::join( htmlPath, "dirlistItem.html" );
-				size_t sizeDir, sizeDirItem;
-				char *dataDir     = file::readfile( templateDir.c_str(), &sizeDir );
-				char *dataDirItem = file::readfile( templateDirItem.c_str(), &sizeDirItem );
-				const char *emptyStr    = "";
-
-
-				keywordMatcherIPC keywordMatcher(ipc, currentDeviceName,
-											     dataPath.c_str(), dynamicEntries[DATA],	//disk and http path
-												 emptyStr, emptyStr);	//song,playlist info
-
-				dHtmlVFS vfs( &keywordMatcher,
-							   hdr.path, dataPath,	//The VFS-path and disk-path
-							   dataDir, dataDirItem);			//the template files
-				string absPath = htmlRequestExtractPath( hdr.path.c_str(), dynamicEntries[dynIdx], dataPath.c_str() );
-				response = vfs.generateData( absPath );
-
+				// Listings and files come from disk, render them in the threadPool:
+				nbuffer::bufferDeferred *head = new nbuffer::bufferDeferred();
+				nbuffer::bufferDeferred *page = new nbuffer::bufferDeferred();
+				write( head );
+				offload( new renderVFS(head, page, req, hdr.headerParam, cacheControl, ipc, currentDeviceName,
+									   hdr.path, dynamicEntries[DATA],
+									   dataPath, dataPath, htmlPath, false) );
+				response = page;
 			}
 			break;
 		case HTML:		// html data, for user interface
 			{
-				//response = handleVFS(request, dynamicEntries[HTML], htmlPath.c_str() );
-
-				// Test the more generic system:
-				string templateDir     = path::join( htmlPath, "dirlist.html" );
-				string templateDirItem = path::join( htmlPath, "dirlistItem.html" );
-				string templatePLitem  = path::join( htmlPath, "playlistItem.html" );
-				string templateDevice  = path::join( htmlPath, "deviceListItem.html" );
-				size_t sizeDir, sizeDirItem, sizePLitem, sizeDevItem;
-				char *dataDir     = file::readfile( templateDir.c_str(), &sizeDir );
-				char *dataDirItem = file::readfile( templateDirItem.c_str(), &sizeDirItem );
-				char *dataPLitem  = file::readfile( templatePLitem.c_str(), &sizePLitem );
-				char *dataDevice  = file::readfile( templateDevice.c_str(), &sizeDevItem );
-
 				// TODO: combine all keyword matchers:
 				//		htmlTemplateGroup matcher;
 				//		matcher.add( htmlTemplateIPC(ipc) );
 				//		matcher.add( htmlTemplateLasFM(lastfm) );
-				keywordMatcherIPC keywordMatcher(ipc, currentDeviceName,
-											     dataPath.c_str(), dynamicEntries[DATA],	//disk and http path
-												 dataPLitem, dataDevice  					//playlist and dirlist templates
-												);	//song,playlist info
-
-				dHtmlVFS vfs( &keywordMatcher,
-							   hdr.path, htmlPath,	//The VFS-path and disk-path
-							   dataDir, dataDirItem);			//the template files
-				string absPath = htmlRequestExtractPath( hdr.path.c_str(), dynamicEntries[HTML], htmlPath.c_str() );
-				response = vfs.generateData( absPath );
-
-				free(dataDir);
-				free(dataDirItem);
-				free(dataPLitem);
-				free(dataDevice);
+				nbuffer::bufferDeferred *head = new nbuffer::bufferDeferred();
+				nbuffer::bufferDeferred *page = new nbuffer::bufferDeferred();
+				write( head );
+				offload( new renderVFS(head, page, req, hdr.headerParam, cacheControl, ipc, currentDeviceName,
+									   hdr.path, dynamicEntries[HTML],
+									   htmlPath, dataPath, htmlPath, true) );
+				response = page;
 			}
 			break;
 		case DYNAMIC:	// dynamic content, playlists, queries, statistics
@@ -534,28 +1660,19 @@ nbuffer::buffer* shoutConnectionHandler::handleGet(const char* request)
 				string groupName = ipc->getGroup( currentDeviceName );
 				string diskUrl = htmlRequestExtractPath( relUrl.c_str(), dynamicEntries[DATA], dataPath.c_str() );
 
-				if( cmd == "add" )
-				{
-					std::vector<musicFile> entries = makeEntries(diskUrl);
-					ipc->addToGroup( groupName, entries);
+				// The players belong to the slim server, so the commands run in its thread.
+				// Commands get an empty answer, which keeps the connection for the next one.
+				if( (cmd == "add") || ((cmd == "play") && (idx.size() == 0)) )
+				{	//the entries come from disk, made in the threadPool
+					nbuffer::bufferDeferred *answer = new nbuffer::bufferDeferred();
+					offload( new loadCommand(answer, req, ipc,
+											 new playerCommand(ipc, cmd, groupName, currentDeviceName, diskUrl)) );
+					response = answer;
 				}
-				else if( cmd == "play" )
+				else if( cmd == "play" )	//seek in the current playlist
 				{
-					if( idx.size() > 0 )
-					{	//seek in current playlist
-						ipc->seekList( groupName, atoi(idx.c_str()), SEEK_SET);
-					}
-					else
-					{	//replace playlist, then start playing
-						// replace the VFSbase with the absolute disk base path:
-
-						std::vector<musicFile> entries = makeEntries(diskUrl);
-						if( entries.size() > 0 )
-						{
-							ipc->setGroup( groupName, entries);
-							ipc->seekList( groupName, 0, SEEK_SET);
-						}
-					}
+					ipc->post( new playerCommand(ipc, cmd, groupName, currentDeviceName, "", idx) );
+					response = reply( new nbuffer::bufferMem(NULL, 0, 0), "text/plain" );
 				}
 				else if( cmd == "remove" )
 				{
@@ -564,19 +1681,40 @@ nbuffer::buffer* shoutConnectionHandler::handleGet(const char* request)
 				}
 				else if( cmd == "control" )
                 {
-                    string subCmd  = hdr.getUrlParam("action");
-					string subValue= hdr.getUrlParam("value");
-                    ipc->setDevice( currentDeviceName, subCmd, subValue );
+					ipc->post( new playerCommand(ipc, cmd, groupName, currentDeviceName, "",
+												 hdr.getUrlParam("action"), hdr.getUrlParam("value")) );
+					response = reply( new nbuffer::bufferMem(NULL, 0, 0), "text/plain" );
                 }
+				else if( cmd == "events" )
+				{
+					// State updates of the device, as server-sent events on a connection which stays open:
+					string templateFname = hdr.getUrlParam("url");
+					if( templateFname.size() == 0 )
+						templateFname = "song.json";
+					write( makeHeader( req, "text/event-stream", "200 OK", -1, "Cache-Control: no-cache" ) );
+					closeAfterLastWrite = true;
+					if( req.headOnly )
+						response = new nbuffer::bufferMem(NULL, 0, 0);
+					else
+					{
+						bufferEvents *events = new bufferEvents( this );
+						eventChannel::subscribe( events, ipc, currentDeviceName, path::join( htmlPath, templateFname ),
+											 ioPool(), getServer() );
+						response = events;
+						// Don't accept any incoming data anymore, the events end with the connection.
+						this->isReadBlocking = true;
+					}
+				}
 				else if( cmd == "notify" )
 				{
                     // Server this file upon return:
                     string respFile     = path::join( htmlPath, hdr.getUrlParam("url") );
 
                     // Keep the connection open until an update has occured:
-					response = new bufferNotify(ipc, currentDeviceName, respFile, true);
-                    // Don't accept any incoming data anymore.
+					response = new bufferNotify(ipc, currentDeviceName, respFile, this, true);
+                    // Don't accept any incoming data anymore, the answer ends with the connection.
                     this->isReadBlocking = true;
+					closeAfterLastWrite = true;
 				}
 
 				//TODO: send redirect response, to force updating of the browser
@@ -596,8 +1734,7 @@ nbuffer::buffer* shoutConnectionHandler::handleGet(const char* request)
 				errStr.append(request);
 				errStr.append("\r\n</body></html>\r\n\r\n");
 
-				response   = new nbuffer::bufferString( errStr );
-				sendHeader("","404 Not Found");
+				response   = reply( new nbuffer::bufferString( errStr ), "text/html", "404 Not Found" );
 			}
 	}
 	return response;
@@ -83,9 +83,12 @@ class shoutConnectionHandler: public connectionHandler
 private:
 	slimIPC *ipc;	//inter-proces-data, gives acces to clients and the music database
 
-	char bufferIn[1<<11];	//input buffer. Should be large enough to handle a single GET-request
-	size_t bufferInPos;
-	char sendBuffer[1<<16];	//output buffer.
+	static const size_t maxRequest = 1<<16;	//larger requests are refused
+	nbuffer::rxQueue bufferIn;	//input data, until a request is complete
+
+	// Parser state, so every byte is only scanned once:
+	size_t scanPos;			//bytes of bufferIn which have been scanned
+	uint32_t scanHistory;	//last four bytes before scanPos
 
     // This is used to not accept any more data after input has been accepted.
     // (necessary for /dynamic/notify connection handling)
@@ -98,91 +101,159 @@ private:
 	} streamStatus;
 	nbuffer::buffer *streamData;
 
+	static const size_t maxPipelined = 64;	//queued responses before reading is held back
 
 public:
+	/// How the response to a request is framed
+	struct request_s {
+		bool http11;		//answer with HTTP/1.1
+		bool keepAlive;		//connection stays open after the response
+		bool headOnly;		//HEAD request, only send the header
+	} req;			//request currently handled
+
 	shoutConnectionHandler(SOCKET socketFD, slimIPC *ipc ) :
 			connectionHandler(socketFD),
 			ipc(ipc)
 	{
 		streamData = NULL;
-		bufferInPos = 0;
+		scanPos     = 0;
+		scanHistory = 0;
 		streamStatus = ST_STOP;	//status of message sending
         isReadBlocking = false;
+		req.http11 = req.keepAlive = req.headOnly = false;
 	}
 
+    /// Pipelined requests are held back while many responses are queued
     virtual bool isReadBufBlocking(void)
     {
-        return isReadBlocking;
+        return isReadBlocking || (bufsRemaining() >= maxPipelined);
     }
 
 	/// Note that there's a non-blocking write function in the base class
+	/// Pipelined requests are all handled here, their responses are queued in order.
 	bool processRead(const void *data, size_t len)
 	{
 		bool keepConnection = true;
+		bufferIn.append(data, len);
 
-		//TODO: use htons or something, to make it work on little-endian systems:
-		uint32_t eoh4a = 0x0d0a0d0a;	//definition of end of request.
-		uint32_t eoh4b = 0x0a0d0a0d;	//too lazy to use htons, this is a bit wrong
-		uint32_t eoh2a = 0x0d0d;		//shouldn't happen, but who knows..
-		uint32_t eoh2b = 0x0a0a;		//shouldn't happen, but who knows..
-
-		//scan for termination code:
-		const char *req = (const char*)data;
-		size_t endIdx;
-		uint32_t h4=0;	//history
-		uint32_t h2=0;
-		for(endIdx=0; endIdx < len; endIdx++)
-		{
-			h4 <<= 8; h4 |= req[endIdx];
-			h2 <<= 8; h2 |= req[endIdx];
-			if(  (h4==eoh4a) || (h4==eoh4b) || (h2==eoh2a) || (h2==eoh2b) )
-					break;
-		}
-		bool complete = (endIdx < len);
-
-		//add data to the input buffer:
-		size_t maxCopy = util::min( sizeof(bufferIn) - bufferInPos, len);
-		if (maxCopy < len)
-			db_printf(0,"WARNING: dropping data (%llu > %llu)\n", (LLU)len, (LLU)maxCopy);	//not so nice to do this
-
-		memcpy(bufferIn + bufferInPos, data, maxCopy);
-		bufferInPos += maxCopy;
-
-		if(complete)
+		// Handle all complete requests, the rest waits for the next call:
+		while( keepConnection && !closeAfterLastWrite && (scanPos < bufferIn.size()) )
 		{
-			int msgLen = bufferInPos;
-			bufferIn[msgLen-1] = 0;		// force zero termination, this overwrite the last character of the message
-			nbuffer::buffer *response = NULL;
+			// Skip the empty lines some clients send between requests:
+			if( (scanPos == 0) && ((bufferIn[0] == '\r') || (bufferIn[0] == '\n')) )
+			{
+				bufferIn.consume( 1 );
+				continue;
+			}
+
+			//scan the new data for the termination code:
+			bool complete = false;
+			while( !complete && (scanPos < bufferIn.size()) )
+			{
+				scanHistory = (scanHistory << 8) | (uint8_t)bufferIn[scanPos];
+				scanPos++;
+				uint16_t h2 = scanHistory & 0xFFFF;
+				complete = (scanHistory == 0x0d0a0d0a) || (h2 == 0x0a0a)
+						|| (scanHistory == 0x0a0d0a0d) || (h2 == 0x0d0d);	//shouldn't happen, but who knows..
+			}
+
+			if( !complete )
+			{
+				if( bufferIn.size() > maxRequest )
+				{
+					db_printf(1,"request of more than %llu bytes, closing the connection\n", (LLU)maxRequest );
+					return false;
+				}
+				break;
+			}
+
+			// Copy it, since handleGet() needs a zero-terminated string:
+			size_t msgLen = scanPos;
+			std::string request( bufferIn.peek(msgLen), msgLen );
+			bufferIn.consume( msgLen );
+			scanPos = 0;
+			scanHistory = 0;
 
 			// process the data:
+			nbuffer::buffer *response = NULL;
+			req.keepAlive = false;
 			if( msgLen > 4)				// skip some remaining end-of-line characters
-				response = handleGet(bufferIn);
+				response = handleGet( request.c_str() );
 			if( response != NULL)
 				write( response );		// write will delete response;
-			else 
+			else
 				keepConnection = false;	//nothing left to do here
-			closeAfterLastWrite = true;	// done after write, close the connection
-			bufferInPos = 0;
+			if( !req.keepAlive )
+				closeAfterLastWrite = true;	// done after write, close the connection
 		}
 		return keepConnection;
 	}
 
 
-	int sendHeader(std::string contentType="audio/mpeg", std::string code="200 OK")
+	/// contentLength of a body which is sent with the chunked transfer-coding
+	static const int64_t chunkedLength = -2;
+
+	/// Build a response header in a pooled buffer, this is sent for every request.
+	/// A negative contentLength means the body ends when the connection closes,
+	/// or with the last chunk for chunkedLength on HTTP/1.1.
+	/// extra holds additional header lines, separated by "\r\n".
+	static nbuffer::bufferMem *makeHeader(const request_s& r, const char *contentType,
+										  const char *code, int64_t contentLength, const char *extra="")
 	{
-		std::ostringstream html;
-		html << "HTTP/1.0 " << code << "\r\n";
-		html << "Server: " << serverString << "\r\nConnection: close\r\n";
-		html << "Content-Type: " << contentType << "\r\n\r\n";
-
-		std::string hdr(html.str());
-		int strLen = hdr.size();
-		const char *data =  hdr.c_str();
-		db_printf(5,">SHOUT: sending header of %i bytes. Last character: '%i'\n", strLen, data[strLen-1] );
-		write( new nbuffer::bufferString( hdr ) );
+		bool noBody = (strncmp(code, "304", 3) == 0);	//never has one, whatever its length
+		bool chunked = (contentLength == chunkedLength) && r.http11 && !noBody;
+		char lengthLine[48] = "";
+		if( (contentLength >= 0) && !noBody )
+			sprintf( lengthLine, "\r\nContent-Length: %llu", (LLU)contentLength );
+		else if( chunked )
+			strcpy( lengthLine, "\r\nTransfer-Encoding: chunked" );
+		bool keepAlive = r.keepAlive && ((contentLength >= 0) || noBody || chunked);
+
+		const char *parts[] = { r.http11 ? "HTTP/1.1 " : "HTTP/1.0 ", code,
+								"\r\nServer: ", serverString,
+								"\r\nContent-Type: ", contentType, lengthLine,
+								(*extra != 0) ? "\r\n" : "", extra,
+								"\r\nConnection: ", keepAlive ? "keep-alive" : "close", "\r\n\r\n" };
+		size_t strLen = 0;
+		for(size_t i=0; i < array_size(parts); i++)
+			strLen += strlen( parts[i] );
+
+		nbuffer::bufferMem *hdr = new nbuffer::bufferMem( strLen );
+		char *dst = hdr->wptr();
+		for(size_t i=0; i < array_size(parts); i++)
+		{
+			size_t n = strlen( parts[i] );
+			memcpy( dst, parts[i], n );
+			dst += n;
+		}
+		db_printf(5,">SHOUT: header of %i bytes\n", (int)strLen );
+		return hdr;
+	}
+
+	/// Queue the header of the current request.
+	/// Without a contentLength, the connection closes after the body.
+	int sendHeader(const char *contentType="audio/mpeg", const char *code="200 OK", int64_t contentLength=-1)
+	{
+		if( contentLength < 0 )
+			closeAfterLastWrite = true;
+		nbuffer::bufferMem *hdr = makeHeader( req, contentType, code, contentLength );
+		int strLen = (int)hdr->size();
+		write( hdr );
 		return strLen;
 	}
 
+	/// Send the header of a complete response, returns the body to send
+	nbuffer::buffer *reply(nbuffer::buffer *body, const char *contentType, const char *code="200 OK")
+	{
+		sendHeader( contentType, code, body->size() );
+		if( req.headOnly )
+		{
+			delete body;
+			body = new nbuffer::bufferMem(NULL, 0, 0);
+		}
+		return body;
+	}
+
 	/// Main handler of complete messages
 	nbuffer::buffer *handleGet(const char* request);
 
@@ -22,6 +22,7 @@
 void musicFile::clear(void)
 {
 	format = '?';
+	pcmEndian = '?';
 	nChannels = 0;
 	nBits = 0;
 	sampleRate = 0;
@@ -109,11 +110,8 @@ bool musicFile::setFromFile(const char *fname, uint16_t defaultPort)
 			artist = finfo.tags["artist"];
 			album  = finfo.tags["album"];
 
-			format = '?';
-			if( finfo.mime == "audio/mpeg")
-				format = 'm';
-			if( finfo.mime == "audio/flac")
-				format = 'f';
+			format		= finfo.format->slimFormat;
+			pcmEndian	= finfo.format->pcmEndian;
 			nChannels	= finfo.nrChannels;
 			nBits		= finfo.nrBits;
 			sampleRate	= finfo.sampleRate;
@@ -247,6 +245,9 @@ slimIPC::slimIPC(musicDB *db, configParser	*config): db(db)
 	playListFile = path::join( config->get("config","path",".") , "slimIPC.ini" );
 	this->slimServer  = NULL;
 	this->shoutServer = NULL;
+	devicesVersion = 0;
+	configVersion  = 0;
+	lastVersion    = 0;
 
 #ifdef WIN32
 	pthread_mutexattr_t *mattr = NULL;
@@ -263,6 +264,7 @@ slimIPC::slimIPC(musicDB *db, configParser	*config): db(db)
 	pthread_mutex_init( &mutex.client, mattr);
 	pthread_mutex_init( &mutex.client, mattr);
 	pthread_mutex_init( &mutex.config, mattr);
+	pthread_mutex_init( &mutex.version, NULL);
 
 #ifndef WIN32
 	pthread_mutexattr_destroy( mattr );
@@ -305,6 +307,7 @@ slimIPC::~slimIPC(void)
 	pthread_mutex_destroy( &mutex.group );
 	pthread_mutex_destroy( &mutex.others );
 	pthread_mutex_destroy( &mutex.client );
+	pthread_mutex_destroy( &mutex.version );
 }
 
 
@@ -371,6 +374,19 @@ int slimIPC::getShoutPort(void)
 
 
 
+void slimIPC::post(eventTask *task)
+{
+	if( slimServer != NULL )
+		slimServer->post( task );
+	else
+	{
+		task->run();
+		delete task;
+	}
+}
+
+
+
 // Device control, for slimProto
 int slimIPC::addDevice(string clientName, client* dev)	//add a device to the current list
 {
@@ -380,6 +396,7 @@ int slimIPC::addDevice(string clientName, client* dev)	//add a device to the cur
 	//TODO: get group-name from a configuration file.
 	playList* group = &(this->group["all"]);
 	devices.push_back( dev_s(clientName, dev, group  ) );
+	devicesVersion = nextVersion();
 
 	e = pthread_mutex_unlock( &mutex.client );
 	if( e!=0)	printMutexError(e);
@@ -404,7 +421,9 @@ int slimIPC::delDevice(string clientName)
 		config->write( );
 
 		devices.erase( it );
+		devicesVersion = nextVersion();
 	}
+	playerBuffers.erase( clientName );
 
 	e = pthread_mutex_unlock( &mutex.client );
 	if( e!=0)	printMutexError(e);
@@ -412,6 +431,70 @@ int slimIPC::delDevice(string clientName)
 }
 
 
+void slimIPC::setPlayerBuffer(const string& devName, uint32_t size, uint32_t fill)
+{
+	int e = pthread_mutex_lock( &mutex.client );
+	if( e!=0)	printMutexError(e);
+	playerBuffer_s &buf = playerBuffers[devName];
+	buf.size = size;
+	buf.fill = fill;
+	e = pthread_mutex_unlock( &mutex.client );
+	if( e!=0)	printMutexError(e);
+}
+
+
+bool slimIPC::getPlayerBuffer(const string& devName, playerBuffer_s *status)
+{
+	int e = pthread_mutex_lock( &mutex.client );
+	if( e!=0)	printMutexError(e);
+	map<string, playerBuffer_s>::iterator it = playerBuffers.find(devName);
+	bool found = (it != playerBuffers.end());
+	if( found )
+		*status = it->second;
+	e = pthread_mutex_unlock( &mutex.client );
+	if( e!=0)	printMutexError(e);
+	return found;
+}
+
+
+
+/// Passes the real start of a stream on to its player, in the slim thread
+class streamStartTask : public eventTask
+{
+	slimIPC *ipc;
+	string devName;
+	uint32_t requestedMs, startMs;
+public:
+	streamStartTask(slimIPC *ipc, const string& devName, uint32_t requestedMs, uint32_t startMs):
+		ipc(ipc), devName(devName), requestedMs(requestedMs), startMs(startMs)
+	{ }
+
+	void run(void)
+	{
+		ipc->streamStarted(devName, requestedMs, startMs);
+	}
+};
+
+
+void slimIPC::setStreamStart(const string& devName, uint32_t requestedMs, uint32_t startMs)
+{
+	if( startMs != requestedMs )
+		post( new streamStartTask(this, devName, requestedMs, startMs) );
+}
+
+
+void slimIPC::streamStarted(const string& devName, uint32_t requestedMs, uint32_t startMs)
+{
+	int e = pthread_mutex_lock( &mutex.client );
+	if( e!=0)	printMutexError(e);
+	std::vector<dev_s>::iterator dev = devByName( devName );
+	if( dev != devices.end() )
+		dev->device->streamStarted( requestedMs, startMs );
+	e = pthread_mutex_unlock( &mutex.client );
+	if( e!=0)	printMutexError(e);
+}
+
+
 
 void slimIPC::setDevice(const string& devName, const string& cmd, const string& cmdParam)
 {   //'play','pause','stop'
@@ -422,7 +505,11 @@ void slimIPC::setDevice(const string& devName, const string& cmd, const string&
     string groupName = this->getGroup(devName);
 
     if( dev == devices.end() )
+    {
+        pthread_mutex_unlock( &mutex.client );
         return;
+    }
+    dev->version = nextVersion();
 
     if (cmd == "play" )			// TODO: This logic should be moved to whomever is calling this
 		if( dev->device->isPlaying() )
@@ -442,8 +529,10 @@ void slimIPC::setDevice(const string& devName, const string& cmd, const string&
         seekList(groupName, +1, SEEK_CUR, true);
     else if(cmd == "prev")
         seekList(groupName, -1, SEEK_CUR, true);
+    else if(cmd == "seek")
+        seekSong(groupName, (float)atof(cmdParam.c_str()) );
 	else if(cmd == "repeat")
-		dev->group->repeat = !(dev->group->repeat);
+		setRepeat(groupName, !dev->group->repeat);	//has no answer of the player, so notify now
 
 	e = pthread_mutex_unlock( &mutex.client );
 	if( e!=0)	printMutexError(e);
@@ -454,11 +543,17 @@ void slimIPC::setDevice(const string& devName, const string& cmd, const string&
 std::string slimIPC::getDevice(const string& devName, const string& field)
 {
 	char tmp[20];
+	int e = pthread_mutex_lock( &mutex.client );
+	if( e!=0)	printMutexError(e);
+
 	std::vector<dev_s>::iterator dev = devByName(devName);
     string groupName = this->getGroup(devName);
 
 	if( dev == devices.end() )
-        return string();
+	{
+		pthread_mutex_unlock( &mutex.client );
+		return string();
+	}
 
 	if( field == "volume" )
 		sprintf(tmp, "%i", dev->device->volume());
@@ -477,6 +572,9 @@ std::string slimIPC::getDevice(const string& devName, const string& field)
 		else
 			sprintf(tmp,"pause");
 	}
+
+	e = pthread_mutex_unlock( &mutex.client );
+	if( e!=0)	printMutexError(e);
 	return tmp;	//this will create string with a copy of 'tmp'
 }
 
@@ -487,6 +585,8 @@ string slimIPC::getGroup(string clientName)
 {
 	playList *group = NULL;
 	string groupName;
+	int e = pthread_mutex_lock( &mutex.client );
+	if( e!=0)	printMutexError(e);
 	size_t idx;
 	for( idx=0; idx < devices.size(); idx++)
 		if( devices[idx].name == clientName )
@@ -501,6 +601,9 @@ string slimIPC::getGroup(string clientName)
 		if( &(it->second) == group )
 			groupName = it->first;
 	}
+
+	e = pthread_mutex_unlock( &mutex.client );
+	if( e!=0)	printMutexError(e);
 	return groupName;
 }
 
@@ -518,6 +621,7 @@ int slimIPC::setGroup(string groupName, vector<musicFile>& items)
 	list->items.assign( items.begin(), items.end() );
 
 	list->currentItem = 0;
+	list->version = nextVersion();
 
 	save();		//store status to disk
 
@@ -542,6 +646,7 @@ int slimIPC::addToGroup(string groupName, vector<musicFile>& items, int offset)
 		it = list->items.begin() + offset;
 
 	list->items.insert( it, items.begin(), items.end() );
+	list->version = nextVersion();
 
 	save();		//store status to disk
 
@@ -557,6 +662,8 @@ int slimIPC::addToGroup(string groupName, vector<musicFile>& items, int offset)
 const playList* slimIPC::getList(string clientName, int *checksum)
 {
 	const playList *ret = NULL;
+	int e = pthread_mutex_lock( &mutex.client );
+	if( e!=0)	printMutexError(e);
 	std::vector<dev_s>::iterator it = devByName( clientName );
 	if( it != devices.end() )
 		ret	= it->group;
@@ -578,6 +685,9 @@ const playList* slimIPC::getList(string clientName, int *checksum)
 			*checksum = util::fletcher_finish( state );
 		}
 	}
+
+	e = pthread_mutex_unlock( &mutex.client );
+	if( e!=0)	printMutexError(e);
 	return ret; //->items;
 }
 
@@ -591,6 +701,7 @@ void slimIPC::setRepeat(string groupName,bool state)
 	if( *v != state )
 	{
 		*v = state;
+		targetGroup->version = nextVersion();
 		for(size_t i=0; i< devices.size(); i++)
 		{
 			if( devices[i].group == targetGroup )
@@ -647,6 +758,7 @@ int slimIPC::seekList(string groupName, int offset, int origin, bool stopCurrent
 	//if( list->currentItem != newIndex)
 	{
 		list->currentItem = newIndex;
+		list->version = nextVersion();
 		//tell all players to start a new song:
 		for(size_t i=0; i< devices.size(); i++)
 			if( devices[i].group == list)
@@ -668,6 +780,30 @@ int slimIPC::seekList(string groupName, int offset, int origin, bool stopCurrent
 
 
 
+// Seek time into current song, all listeners restart the stream from there
+void slimIPC::seekSong(string groupName, float seconds)
+{
+	if( group.find(groupName) == group.end() )
+		return;
+
+	int e = pthread_mutex_lock( &mutex.group );
+	if( e!=0)	printMutexError(e);
+
+	playList *list = &group[groupName];
+	uint32_t startMs = (uint32_t)( util::max(seconds, 0.f) * 1000 );
+	for(size_t i=0; i< devices.size(); i++)
+		if( devices[i].group == list)
+		{
+			devices[i].device->stop();
+			devices[i].device->play( startMs );
+		}
+
+	e = pthread_mutex_unlock( &mutex.group );
+	if( e!=0)	printMutexError(e);
+}
+
+
+
 // Get current song
 musicFile slimIPC::getSong(string groupName)
 {
@@ -684,11 +820,46 @@ musicFile slimIPC::getSong(string groupName)
 
 
 
+uint32_t slimIPC::nextVersion(void)
+{
+	pthread_mutex_lock( &mutex.version );
+	uint32_t v = ++lastVersion;
+	pthread_mutex_unlock( &mutex.version );
+	return v;
+}
+
+
+
+// Current versions of the state of a device
+slimIPC::stateVersion_s slimIPC::getVersion(const string& devName)
+{
+	int e = pthread_mutex_lock( &mutex.client );
+	if( e!=0)	printMutexError(e);
+
+	stateVersion_s v;
+	v.device = devicesVersion;
+	v.list   = 0;
+	v.config = configVersion;
+	std::vector<dev_s>::iterator dev = devByName( devName );
+	if( dev != devices.end() )
+	{
+		//both come from nextVersion(), so the newest one changes on any update:
+		v.device = util::max( v.device, dev->version );
+		v.list   = dev->group->version;
+	}
+
+	e = pthread_mutex_unlock( &mutex.client );
+	if( e!=0)	printMutexError(e);
+	return v;
+}
+
+
+
 // Register a callback function, to get an update once
 // the client status changes:
 void slimIPC::registerCallback(callbackFcn *callback, string clientName)
 {
-	pthread_mutex_unlock( &mutex.others );
+	pthread_mutex_lock( &mutex.others );
 
 	pair<string,callbackFcn*> cb(clientName,callback);
 	callbacks.push_back(cb);
@@ -724,9 +895,16 @@ void slimIPC::unregisterCallback(callbackFcn *callback)
 
 void slimIPC::notifyClientUpdate(client* device)
 {
-	int e = pthread_mutex_lock( &mutex.others );
+	//same order as setDevice(), which can end up here:
+	int e = pthread_mutex_lock( &mutex.client );
+	if( e!=0)	printMutexError(e);
+	e = pthread_mutex_lock( &mutex.others );
 	if( e!=0)	printMutexError(e);
 	int nrc = 0;
+	for( size_t i=0; i < devices.size(); i++)
+		if( devices[i].device == device )
+			devices[i].version = nextVersion();
+
 	///Execute all callback functions:
 	//vector<pair<string,callbackFcn*>>::iterator it;
 	//for(it = callbacks.begin(); it != callbacks.end(); it++)
@@ -749,10 +927,13 @@ void slimIPC::notifyClientUpdate(client* device)
 	}
 	e = pthread_mutex_unlock( &mutex.others );
 	if( e!=0)	printMutexError(e);
+	e = pthread_mutex_unlock( &mutex.client );
+	if( e!=0)	printMutexError(e);
 
-	//Open/close both servers, to wake them up out of the select() wait.
-	// So this would be the main motivation to make the whole thing single-threaded.
-	// It is indeed a bit ugly.
+	//The callbacks write to their connections, which wakes the eventLoop.
+	// Winsock has no eventfd, so open/close both servers there, to wake
+	// them up out of the select() wait.
+#ifdef WIN32
 	if( nrc > 0 )	//only if callbacks have been executed
 	{
 		const char *home = "127.0.0.1";
@@ -763,4 +944,5 @@ void slimIPC::notifyClientUpdate(client* device)
 		s.Connect(home, slimServer->getPort() );
 		s.Close();
 	}
+#endif
 }
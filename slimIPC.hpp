@@ -56,7 +56,8 @@ public:
     std::string album;
 
     // Datafile info:
-    char format;		///< Compression format: [m]p3, [p]cm, [f]lac, ogg
+    char format;		///< Compression format: [m]p3, [p]cm, [f]lac, [o]gg
+    char pcmEndian;		///< Byte order of pcm data, as slim code: '0' big, '1' little, '?' n.a.
     int nChannels;      ///< Number of channels
     int nBits;          ///< Uncompressed number of bits;
     int sampleRate;     ///< Samples per second
@@ -122,13 +123,14 @@ public:
 	size_t		currentItem;		// current seletect item, req
 	uint32_t	lastUpdate;		// time of last update
 	bool		repeat;			//repeat list, after it's completed
+	uint32_t	version;		// stamped on every change, see slimIPC::nextVersion()
 
 	//To handle transition to next song for multiple clients:
 	// first client to reach end-of-song, requests next.
 	// then request will pass a new play command to all clients.
 
 	// Default constructor:
-	playList(): currentItem(0), lastUpdate(0), repeat(false)
+	playList(): currentItem(0), lastUpdate(0), repeat(false), version(0)
 	{}
 
 	//allow read-only acces. is not thread safe.
@@ -175,12 +177,48 @@ private:
 		string name;
 		client* device;
 		playList* group;
+		uint32_t version;	//stamped on every update of the device, and when it changes group
 
 		dev_s(string name, client* device, playList* group):
-			name(name), device(device), group(group)
+			name(name), device(device), group(group), version(0)
 		{}
 	};
 	std::vector<dev_s> devices;
+	uint32_t devicesVersion;	//stamped when devices come or go
+	uint32_t configVersion;		//stamped on every change of the configuration
+	uint32_t lastVersion;		//last value handed out by nextVersion()
+
+	/// Next value of the process-wide version counter. Every part of the state
+	/// is stamped with it on a change, so a version is never reused.
+	uint32_t nextVersion(void);
+
+public:
+	/// Stream buffer of a player, as reported in its last STAT message
+	struct playerBuffer_s
+	{
+		uint32_t size;		///< bytes
+		uint32_t fill;		///< bytes
+	};
+
+	/// Versions of the state a page of a device is rendered from. Each
+	/// one increases when its part changes, so equal versions mean that the
+	/// page would be the same.
+	struct stateVersion_s
+	{
+		uint32_t device;	///< of the device itself, and the list of devices
+		uint32_t list;		///< of the playlist of its group
+		uint32_t config;
+
+		bool operator==(const stateVersion_s& v) const
+		{
+			return (device == v.device) && (list == v.list) && (config == v.config);
+		}
+	};
+private:
+	map<string, playerBuffer_s> playerBuffers;	///< protected by mutex.client
+
+	friend class streamStartTask;
+	void streamStarted(const string& devName, uint32_t requestedMs, uint32_t startMs);
 
 
 	/// Device reading,
@@ -202,6 +240,7 @@ private:
 		pthread_mutex_t client;	//all client changes
 		pthread_mutex_t others;	//for slimServer and shoutServer
 		pthread_mutex_t config;
+		pthread_mutex_t version;	//only for nextVersion()
 	} mutex;
 
 
@@ -231,6 +270,10 @@ public:
 
 	int getShoutPort(void);
 
+	/// Run a task in the thread of the slim server, which owns all players.
+	/// Other threads use this to control the players.
+	void post(eventTask *task);
+
 	/// Acces to the main configuration file
 	configValue getConfig(string section, string option, configValue defaultValue)
 	{
@@ -239,6 +282,7 @@ public:
 		//store a default for everything that's read:
 		if( !config->hasOption(section,option) )
 		{
+			configVersion = nextVersion();
 			config->set(section, option, defaultValue);
 			config->write();	//TODO: write this to disk, but not always
 		}
@@ -260,6 +304,7 @@ public:
 	{
 		pthread_mutex_lock( &mutex.config );
 
+		configVersion = nextVersion();
 		config->set(section, option, newValue);		//store a default for everything that's read
 		//TODO: write this to disk, but not always
 		config->write();
@@ -274,6 +319,17 @@ public:
 	/// forget about it
 	int delDevice(string clientName);
 
+	/// Update the stream buffer status of a player, for the shout server
+	void setPlayerBuffer(const string& devName, uint32_t size, uint32_t fill);
+
+	/// Stream buffer status of a player, false if it didn't report any yet.
+	/// Can be called from any thread.
+	bool getPlayerBuffer(const string& devName, playerBuffer_s *status);
+
+	/// The stream for a player, requested at 'requestedMs' into the song,
+	/// really starts at 'startMs'. Can be called from any thread.
+	void setStreamStart(const string& devName, uint32_t requestedMs, uint32_t startMs);
+
 
 	/// Get a list of all connected devices
 	vector<string> listDevices()
@@ -329,6 +385,9 @@ public:
 	/// Get current song
 	musicFile getSong(string groupName);
 
+	/// Current versions of the state of a device, to find out if it changed
+	stateVersion_s getVersion(const string& devName);
+
 	/// Link groups to clients
 	int connect(string clientName, string groupName);
 	int disconnect(string clientName, string groupName);
@@ -336,6 +395,7 @@ public:
 	/// Callback functions for updates: (web-gui)
 	class callbackFcn {
 	public:
+		virtual ~callbackFcn() {}
         // Should return false to unregister it.
 		virtual bool call(void)=0;
 	};
@@ -304,11 +304,18 @@ slimConnectionHandler::slimConnectionHandler(SOCKET socketFD, slimIPC *ipc) :
 	state   = new state_s;
 
 	state->currentScreen = menu->main;
+	writeClass = WRITE_CONTROL;
 
 	//Some other data:
 	memset( &IRdata, 0, sizeof(IRdata) );
 	memset( &device, 0, sizeof(device) );
 	memset( &status, 0, sizeof(status) );
+
+	redrawTimer.owner    = this;
+	redrawTimer.fcn      = &slimConnectionHandler::redraw;
+	heartbeatTimer.owner = this;
+	heartbeatTimer.fcn   = &slimConnectionHandler::heartbeat;
+	lastStat = util::msTime();
 }
 
 
@@ -347,7 +354,15 @@ int slimConnectionHandler::volume(void)
 
 int slimConnectionHandler::elapsed(void)
 {
-	return status.songMSec;
+	//the player counts from the start of the stream, which isn't the start of the song after a seek
+	return status.songMSec + stream.startMs;
+}
+
+void slimConnectionHandler::streamStarted(uint32_t requestedMs, uint32_t startMs)
+{
+	//a report of an earlier seek doesn't apply to the current stream:
+	if( stream.startMs == requestedMs )
+		stream.startMs = startMs;
 }
 
 
@@ -378,42 +393,35 @@ const musicFile& slimConnectionHandler::currentSong(void)
 // This is were the network data comes in
 bool slimConnectionHandler::processRead(const void *data, size_t len)
 {
-	bool keepConnection = true;
-	bool canAppend = rxBuf.end + len <= sizeof(rxBuf.data);   //new data can be appended to the buffer
-
-	if(!canAppend)
-	{
-		db_printf(1,"message is too long, dropping it\n");  //not so nice to do
-		return true;
-	}
+	const uint32_t maxMessage = 1<<16;	//larger messages mean the stream is corrupt
 
-	memcpy(rxBuf.data + rxBuf.end, data, len);    //append data to the input buffer
-	rxBuf.end += len;
+	rxBuf.append(data, len);    //append data to the input buffer
 
-	bool canValid  = rxBuf.end >= 8;   //might be a valid message
-	while(canValid)
+	// Handle all complete messages, the rest waits for the next call:
+	while( rxBuf.size() >= 8 )
 	{
-		uint32_t opU32 = *(uint32_t*)(rxBuf.data+rxBuf.start);
-		netBuffer buf( (char*)(rxBuf.data + rxBuf.start + 4 ) );
-		uint32_t  mlen = buf;   //length of message excluding the operation code and lenght (so total is mlen+8 bytes)
+		netBuffer hdr( (char*)rxBuf.peek(8) + 4 );
+		uint32_t  mlen = hdr;   //length of message excluding the operation code and lenght (so total is mlen+8 bytes)
+		if( mlen > maxMessage )
+		{
+			db_printf(1,"message of %u bytes is too long, closing the connection\n", mlen);
+			return false;
+		}
 
 		// Check if we have the whole message:
-		if( rxBuf.end - rxBuf.start < (mlen+8) )
+		if( rxBuf.size() < (mlen+8) )
 			break;
 
 		// Do something with it:
-		keepConnection = this->parseInput(opU32, buf, mlen);
+		const char *msg = rxBuf.peek( mlen+8 );
+		uint32_t opU32 = *(uint32_t*)msg;
+		netBuffer buf( (char*)(msg + 8) );
+		bool keepConnection = this->parseInput(opU32, buf, mlen);
+		rxBuf.consume( mlen+8 );
 		if(!keepConnection)
 			return false;
-
-		// If there's remaining data, copy it to front:
-		memcpy( rxBuf.data, rxBuf.data + rxBuf.start + 8 + mlen, rxBuf.end - rxBuf.start - (mlen+8) );
-		rxBuf.end -= (mlen+8);
-
-		//In case there are multiple messages send at once:
-		canValid  = rxBuf.end >= 8;   //might be a valid message
 	}
-	return keepConnection;
+	return true;
 }
 
 
@@ -539,6 +547,10 @@ void slimConnectionHandler::helo(netBuffer& buf, size_t len)
 	//stream.autostart = '1';
 	STRM();
 
+	lastStat = util::msTime();
+	if( timers() != NULL )
+		timers()->arm( &heartbeatTimer, heartbeatInterval );
+
 	/*
 	//for debug: start streaming a shoutcast stream:
 	stream.command = 's';	//start the stream
@@ -777,14 +789,44 @@ void slimConnectionHandler::stat(netBuffer& buf, int len)
 		db_printf(dbg_level+1,"<\tbufSize %u, bufOut %u/%u, #crlf %i\n", status.bufSize, status.bufDataOut, status.bufSizeOut, status.nrCrLF);
 	}
 
-	// Update the display:
-	state->currentScreen->draw();
+	lastStat = util::msTime();
+	ipc->setPlayerBuffer( state->uuid, status.bufSize, status.bufData );
+
+	// Update the display, once per burst of status messages:
+	if( timers() == NULL )
+		redraw();
+	else if( !redrawTimer.armed() )
+		timers()->arm( &redrawTimer, redrawDelay );
 
 	// Send notification of the update:
 	ipc->notifyClientUpdate(this);
 }
 
 
+void slimConnectionHandler::redraw(void)
+{
+	state->currentScreen->draw();
+}
+
+
+void slimConnectionHandler::heartbeat(void)
+{
+	if( util::msTime() - lastStat > 3*heartbeatInterval )
+	{
+		db_printf(1,"player %s stopped responding, closing\n", state->uuid);
+		closeAfterLastWrite = true;
+		wakeWrite();
+		return;
+	}
+
+	char command = stream.command;
+	stream.command = 't';
+	STRM();
+	stream.command = command;
+	timers()->arm( &heartbeatTimer, heartbeatInterval );
+}
+
+
 
 //--------------------------- Send functions ----------------------------
 
@@ -794,16 +836,17 @@ void slimConnectionHandler::stat(netBuffer& buf, int len)
 ///  See squeezeCenter\Slim\Player\SqueezeBox.pm, sub sendFrame {}
 int slimConnectionHandler::send(const char cmd[4], uint16_t len, void *data)
 {
-	//setup the header:
-	char hdr[6];
-	netBuffer buf(hdr);
+	//header and data go out as a single frame:
+	nbuffer::bufferMem *frame = new nbuffer::bufferMem( 6 + len );
+	netBuffer buf( frame->wptr() );
 	buf.write( (uint16_t)(4 + len) );	//write length of cmd+data
 	buf.write(cmd,4);
+	if( len > 0 )
+		memcpy(frame->wptr() + 6, data, len);
 
 	db_printf(4,"sending %c%c%c%c: %i bytes\n", cmd[0], cmd[1], cmd[2], cmd[3], len);
 
-	write( new nbuffer::bufferMem(hdr,    6, true) );
-	write( new nbuffer::bufferMem(data, len, true) );
+	write( frame );
 	return 0;
 }
 
@@ -875,7 +918,7 @@ void slimConnectionHandler::setVolume(uint8_t newVol)
 // look for "my $frame = pack"
 void slimConnectionHandler::STRM(uint32_t skipMs)
 {
-	char cmd[100];
+	char cmd[128];
 
 	netBuffer buf(cmd);
 	//if( stream.command == 's')
@@ -904,6 +947,8 @@ void slimConnectionHandler::STRM(uint32_t skipMs)
 			buf.write( stream.replayGain );
 		else if( stream.command == 'a')	//skip over a number of milliseconds
 			buf.write( skipMs );
+		else if( stream.command == 't')	//echoed back in the STMt status
+			buf.write( util::msTime() );
 		else
 			buf.write( (uint32_t)0 );
 
@@ -920,7 +965,10 @@ void slimConnectionHandler::STRM(uint32_t skipMs)
 		// Append the http-request-header to the end of the stream:
 		if( stream.serverIP == 0)
 		{	// Local file, rename the url
-			sprintf(http,"GET /stream.mp3?player=%s HTTP/1.0\r\n\r\n", state->uuid );
+			if( stream.startMs > 0 )
+				sprintf(http,"GET /stream.mp3?player=%s?start=%u HTTP/1.0\r\n\r\n", state->uuid, stream.startMs );
+			else
+				sprintf(http,"GET /stream.mp3?player=%s HTTP/1.0\r\n\r\n", state->uuid );
 		} else
 		{	// Remote file, keep the url, but do request meta-data:
 			sprintf(http,"GET %s HTTP/1.0\r\nIcy-MetaData: 1\r\n\r\n", stream.url.c_str() );
@@ -940,13 +988,14 @@ void slimConnectionHandler::STRM(uint32_t skipMs)
 //--------------------------- Playback control ----------------------------------------
 
 
-void slimConnectionHandler::play()
+void slimConnectionHandler::play(uint32_t startMs)
 {
 	int currentItem = ipc->getList( state->uuid )->currentItem;
 	menu->menuPlayList->currentItem = currentItem;
 	musicFile data = ipc->getList( state->uuid )->get(  currentItem  );
 
 	stream.format = data.format;
+	stream.pcmEndian = data.pcmEndian;
 	stream.pcmChannels = data.nChannels + '0';
 	stream.setSampleSize( data.nBits );
 	stream.setSampleRate( data.sampleRate );
@@ -954,6 +1003,7 @@ void slimConnectionHandler::play()
 	stream.url = data.url;
 	stream.serverIP  = data.ip;
 	stream.serverPort= data.port;
+	stream.startMs   = (data.ip == 0) ? startMs : 0;	//can only seek in local files
 	db_printf(1,"play(): %08x:%i GET %s\n", data.ip, data.port, stream.url.c_str() );
 
 	// 'smart' replay-gain:
@@ -258,13 +258,7 @@ public:
 private:
 
 
-	struct rxBuf_s {
-		char    data[1<<10];   ///< input buffer, doens't need to be big for the slim-protocol
-		size_t  start;		///< current start(read) position
-		size_t	end;		///< current end(write) position
-		rxBuf_s(): start(0), end(0)
-			{};	//initialize to zero
-	} rxBuf;
+	nbuffer::rxQueue rxBuf;		///< input data, until a message is complete
 
 
 	/// IR/keyboard status
@@ -283,6 +277,28 @@ private:
 	struct state_s *state;
 
 
+	/// Work scheduled on the event loop of this connection
+	class slimTimer: public util::timer
+	{
+	public:
+		slimConnectionHandler *owner;
+		void (slimConnectionHandler::*fcn)(void);
+		void expire(void)	{ (owner->*fcn)(); }
+	};
+
+	static const uint32_t redrawDelay       = 50;		///< ms, coalesces screen updates of STAT bursts
+	static const uint32_t heartbeatInterval = 10000;	///< ms between 'strm t' requests
+	slimTimer redrawTimer;
+	slimTimer heartbeatTimer;
+	uint32_t lastStat;		///< util::msTime() of the last STAT message
+
+	/// Redraw the current screen, see redrawTimer
+	void redraw(void);
+
+	/// Ask for a STAT, and drop the player if it stopped answering
+	void heartbeat(void);
+
+
 	/// Streaming status
     class Stream
 	{
@@ -308,9 +324,11 @@ private:
         uint32_t serverIP;		// 0 implies control server, 1 means squeezenetwork?
 
         std::string url;		//for network streaming, the url used in the GET command
+		uint32_t startMs;		//play time in the song at which the stream starts (local files only)
 
 		void setSampleSize(int nrBits)
 		{
+			pcmSampleSize = '?';	//let the decoder find out
 			if(nrBits == 8)	pcmSampleSize = '0';
 			if(nrBits ==16)	pcmSampleSize = '1';
 			if(nrBits ==24)	pcmSampleSize = '2';
@@ -319,10 +337,12 @@ private:
 
 		void setSampleRate(int Hz)
 		{
+			pcmSampleRate = '?';
 			if(Hz == 11025)	pcmSampleRate = '0';
 			if(Hz == 22050)	pcmSampleRate = '1';
-			if(Hz == 44100)	pcmSampleRate = '2';
-			if(Hz == 48000)	pcmSampleRate = '3';
+			if(Hz == 32000)	pcmSampleRate = '2';
+			if(Hz == 44100)	pcmSampleRate = '3';
+			if(Hz == 48000)	pcmSampleRate = '4';
 			if(Hz ==  8000)	pcmSampleRate = '5';
 			if(Hz == 12000)	pcmSampleRate = '6';
 			if(Hz == 16000)	pcmSampleRate = '7';
@@ -350,6 +370,7 @@ private:
 			replayGain = 0;
 			serverPort = 9000;
 			serverIP = 0;
+			startMs = 0;
 		}
     } stream;
 
@@ -437,6 +458,10 @@ public:
 	/// Song position in milliseconds
 	int elapsed(void);
 
+	/// The stream server found the stream requested at 'requestedMs' to
+	/// really start at 'startMs', e.g. at the preceding frame of an index.
+	void streamStarted(uint32_t requestedMs, uint32_t startMs);
+
 	/// is currently playing ?
 	bool isPlaying(void);
 
@@ -484,7 +509,8 @@ public:
 	void setVolume(uint8_t newVol);
 
     /// Various commands the server can perform:
-    void play();
+	/// play() starts the current song of the playlist, at 'startMs' into the song
+    void play(uint32_t startMs=0);
 
     void pause();
 
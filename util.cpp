@@ -4,7 +4,12 @@
 
 
 #include <string.h>
+#include <stdio.h>		//for snprintf
 #include <stdint.h>
+#include <stdlib.h>
+#include <new>			//for std::bad_alloc
+#include <list>
+#include <map>
 //#include <ctype.h> //for tolower()
 #include <cctype>
 
@@ -13,6 +18,11 @@
 	#define S_ISREG(a) (((a) & _S_IFREG)!=0)
 #else
 	#include <stdlib.h>     //for realpath
+	#include <time.h>		//for clock_gettime
+	#include <unistd.h>		//for usleep
+	#include <sys/mman.h>	//for mmap
+	#include <fcntl.h>
+	#include <errno.h>
 #endif
 
 
@@ -83,6 +93,344 @@ namespace util
         return checksum;
 	}
 
+
+	uint64_t fnv1a(const void *data, size_t len, uint64_t hash)
+	{
+		const uint8_t *src = (const uint8_t*)data;
+		for(size_t i=0; i < len; i++)
+		{
+			hash ^= src[i];
+			hash *= 1099511628211ULL;
+		}
+		return hash;
+	}
+
+
+
+	uint32_t msTime(void)
+	{
+#if defined(WIN32) && !defined(__CYGWIN__)
+		return GetTickCount();
+#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint32_t)( (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000 );
+#endif
+	}
+
+
+	void msSleep(uint32_t ms)
+	{
+#if defined(WIN32) && !defined(__CYGWIN__)
+		Sleep(ms);
+#else
+		usleep( (useconds_t)ms * 1000 );
+#endif
+	}
+
+
+
+	void timer::cancel(void)
+	{
+		if( wheel != NULL )
+			wheel->unlink(this);
+	}
+
+
+	timerWheel::timerWheel():
+		current(0),
+		lastMs( msTime() ),
+		count(0)
+	{
+		for(int i=0; i < nrSlots; i++)
+			slots[i] = NULL;
+	}
+
+
+	timerWheel::~timerWheel()
+	{
+		for(int i=0; i < nrSlots; i++)
+			while( slots[i] != NULL )
+				unlink( slots[i] );
+	}
+
+
+	/// Put a timer in the slot of its deadline, relative to the current tick
+	void timerWheel::insert(timer *t)
+	{
+		uint64_t delta = t->deadline - current;
+		int slot;
+		if( delta < (1<<bits0) )
+			slot = t->deadline & ((1<<bits0)-1);
+		else
+		{
+			int level = 1;
+			int shift = bits0;
+			while( (level < levels-1) && (delta >= ((uint64_t)1 << (shift + bitsN))) )
+			{
+				level++;
+				shift += bitsN;
+			}
+			if( delta >= ((uint64_t)1 << (shift + bitsN)) )
+			{
+				//too far, clip to the end of the last level:
+				t->deadline = current + ((uint64_t)1 << (shift + bitsN)) - 1;
+			}
+			slot = (1<<bits0) + (level-1)*(1<<bitsN) + ((t->deadline >> shift) & ((1<<bitsN)-1));
+		}
+
+		t->prev  = NULL;
+		t->next  = slots[slot];
+		if( t->next != NULL )
+			t->next->prev = t;
+		slots[slot] = t;
+		t->slot  = slot;
+		t->wheel = this;
+		count++;
+	}
+
+
+	void timerWheel::unlink(timer *t)
+	{
+		if( t->prev != NULL )
+			t->prev->next = t->next;
+		else
+			slots[t->slot] = t->next;
+		if( t->next != NULL )
+			t->next->prev = t->prev;
+		t->prev  = NULL;
+		t->next  = NULL;
+		t->wheel = NULL;
+		count--;
+	}
+
+
+	/// Move the timers of the current slot of a level down
+	void timerWheel::cascade(int level)
+	{
+		int shift = bits0 + (level-1)*bitsN;
+		int slot  = (1<<bits0) + (level-1)*(1<<bitsN) + ((current >> shift) & ((1<<bitsN)-1));
+		timer *t = slots[slot];
+		slots[slot] = NULL;
+		while( t != NULL )
+		{
+			timer *next = t->next;
+			count--;
+			insert(t);
+			t = next;
+		}
+	}
+
+
+	void timerWheel::arm(timer *t, uint32_t ms)
+	{
+		t->cancel();
+		//count from now, not from the last advance(). Round up, and at least
+		// one tick, so it never expires in the running advance()
+		uint64_t ticks = ((uint32_t)(msTime() - lastMs) + ms + tickMs - 1) / tickMs;
+		t->deadline = current + util::max<uint64_t>( ticks, 1 );
+		insert(t);
+	}
+
+
+	void timerWheel::advance(void)
+	{
+		uint32_t now = msTime();
+		uint64_t ticks = (uint32_t)(now - lastMs) / tickMs;
+		lastMs += ticks * tickMs;
+
+		if( count == 0 )
+		{
+			current += ticks;	//nothing to do on the way
+			return;
+		}
+
+		for( ; ticks > 0; ticks--)
+		{
+			current++;
+
+			// Moving to a new turn of a level, bring down the next slot of the level above:
+			for(int level=1; level < levels; level++)
+			{
+				int shift = bits0 + (level-1)*bitsN;
+				if( (current & (((uint64_t)1 << shift)-1)) != 0 )
+					break;
+				cascade(level);
+			}
+
+			// Expire everything in this slot. A timer may cancel others, so take them one by one:
+			timer **slot = &slots[ current & ((1<<bits0)-1) ];
+			while( *slot != NULL )
+			{
+				timer *t = *slot;
+				unlink(t);
+				t->expire();	//may delete or re-arm t
+			}
+			if( count == 0 )
+			{
+				current += ticks-1;
+				break;
+			}
+		}
+	}
+
+
+	int timerWheel::nextTimeout(void)
+	{
+		if( count == 0 )
+			return -1;
+
+		// First deadline in the first level:
+		uint64_t next = (uint64_t)-1;
+		for(uint64_t tick = current+1; tick <= current + (1<<bits0); tick++)
+			if( slots[ tick & ((1<<bits0)-1) ] != NULL )
+			{
+				next = tick;
+				break;
+			}
+
+		// or the first cascade which brings timers down:
+		for(int level=1; level < levels; level++)
+		{
+			int shift = bits0 + (level-1)*bitsN;
+			uint64_t idx = current >> shift;
+			for(uint64_t k=1; k <= (1<<bitsN); k++)
+				if( slots[ (1<<bits0) + (level-1)*(1<<bitsN) + ((idx + k) & ((1<<bitsN)-1)) ] != NULL )
+				{
+					next = util::min( next, (idx + k) << shift );
+					break;
+				}
+		}
+
+		uint32_t elapsed = msTime() - lastMs;	//part of the current tick which has passed
+		int64_t ms = (int64_t)(next - current) * tickMs - elapsed;
+		return (int)util::max<int64_t>(ms, 0);
+	}
+
+
+	threadPool::threadPool(int nrThreads):
+			first(0),
+			stopping(false)
+	{
+		pthread_mutex_init( &mutex, NULL );
+		pthread_cond_init( &cond, NULL );
+		for(int i=0; i < nrThreads; i++)
+		{
+			pthread_t t;
+			if( pthread_create( &t, NULL, threadMain, this ) == 0 )
+				threads.push_back( t );
+		}
+	}
+
+
+	threadPool::~threadPool()
+	{
+		pthread_mutex_lock( &mutex );
+		stopping = true;
+		pthread_cond_broadcast( &cond );
+		pthread_mutex_unlock( &mutex );
+
+		for(size_t i=0; i < threads.size(); i++)
+			pthread_join( threads[i], NULL );
+		for(size_t i=first; i < jobs.size(); i++)
+			jobs[i]->finished();
+
+		pthread_cond_destroy( &cond );
+		pthread_mutex_destroy( &mutex );
+	}
+
+
+	void threadPool::queue(job *j)
+	{
+		if( threads.empty() )
+		{	//no threads, run it right away:
+			j->work();
+			j->finished();
+			return;
+		}
+		pthread_mutex_lock( &mutex );
+		jobs.push_back( j );
+		pthread_cond_signal( &cond );
+		pthread_mutex_unlock( &mutex );
+	}
+
+
+	void* threadPool::threadMain(void *arg)
+	{
+		threadPool *pool = (threadPool*)arg;
+		pthread_mutex_lock( &pool->mutex );
+		while( true )
+		{
+			while( !pool->stopping && (pool->first >= pool->jobs.size()) )
+				pthread_cond_wait( &pool->cond, &pool->mutex );
+			if( pool->stopping )
+				break;
+
+			job *j = pool->jobs[ pool->first++ ];
+			if( pool->first >= pool->jobs.size() )
+			{	//all taken, reuse the vector
+				pool->jobs.clear();
+				pool->first = 0;
+			}
+			pthread_mutex_unlock( &pool->mutex );
+			j->work();
+			j->finished();
+			pthread_mutex_lock( &pool->mutex );
+		}
+		pthread_mutex_unlock( &pool->mutex );
+		return NULL;
+	}
+
+
+	tokenBucket::tokenBucket(uint32_t rate, uint32_t depth):
+			tokens(depth),
+			lastMs(msTime()),
+			rate(rate),
+			depth(depth)
+	{ }
+
+
+	void tokenBucket::refill(void)
+	{
+		uint32_t now = msTime();
+		uint32_t elapsed = now - lastMs;
+		uint64_t add = (uint64_t)elapsed * rate / 1000;
+		if( add == 0 )
+			return;		//keep the fraction for the next call
+		tokens = util::min<int64_t>(tokens + add, depth);
+		lastMs = (tokens == (int64_t)depth) ? now : lastMs + (uint32_t)(add * 1000 / rate);
+	}
+
+
+	size_t tokenBucket::available(void)
+	{
+		if( rate == 0 )
+			return (size_t)-1;
+		refill();
+		return (size_t)util::max<int64_t>(tokens, 0);
+	}
+
+
+	void tokenBucket::take(size_t n)
+	{
+		if( rate == 0 )
+			return;
+		refill();
+		tokens -= n;
+	}
+
+
+	uint32_t tokenBucket::waitMs(size_t n)
+	{
+		if( rate == 0 )
+			return 0;
+		refill();
+		int64_t missing = (int64_t)util::min<size_t>(n, depth) - tokens;
+		if( missing <= 0 )
+			return 0;
+		return (uint32_t)((missing * 1000 + rate - 1) / rate);
+	}
+
 } //namespace util
 
 
@@ -127,6 +475,20 @@ namespace pstring
 			str[i] = std::tolower( (char)str[i] );
 	}
 
+	void appendInt(std::string& out, int64_t value)
+	{
+		char tmp[24];
+		char *p = tmp + sizeof(tmp);
+		uint64_t v = (value < 0) ? -(uint64_t)value : value;
+		do {
+			*--p = '0' + (v % 10);
+			v /= 10;
+		} while( v > 0 );
+		if( value < 0 )
+			*--p = '-';
+		out.append( p, tmp + sizeof(tmp) - p );
+	}
+
     bool startswith(std::string& str, std::string& pattern)
     {
         //bool ret = false;
@@ -316,6 +678,27 @@ namespace path
 		return ret;
 	}
 
+	int64_t filesize(const std::string path)
+	{
+		struct stat fstat;
+		int e = stat( path.c_str(), &fstat);
+		if( (e==0) && S_ISREG(fstat.st_mode) )
+			return fstat.st_size;
+		return -1;
+	}
+
+	bool fileProps(const std::string path, fileProps_s *props)
+	{
+		struct stat fstat;
+		int e = stat( path.c_str(), &fstat);
+		if( (e!=0) || !S_ISREG(fstat.st_mode) )
+			return false;
+		props->size  = fstat.st_size;
+		props->inode = fstat.st_ino;
+		props->mtime = fstat.st_mtime;
+		return true;
+	}
+
 
 	//join two parts of a path, make sure there's 1 separator in the middle;
 	std::string join(const std::string& p1, const std::string& p2)
@@ -425,12 +808,258 @@ namespace file
 		return out;
 	}
 
+
+	namespace cache
+	{
+		struct node : entry {
+			std::string fname;
+			int refs;				//users, plus one while it's in the cache
+			uint32_t checkedMs;		//last compared with the file
+			std::list<node*>::iterator lru;
+			void *derived;			//see attach()
+			void (*destroy)(void*);
+		};
+
+		static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+		static std::map<std::string, node*> nodes;
+		static std::list<node*> lru;	//most recently used first
+		static size_t budget = 8<<20, maxFile = 1<<20;
+		static uint32_t validateMs = 1000;
+		static stats_s counters;
+
+		static void statFile(const std::string& fname, path::fileProps_s *props)
+		{
+			if( !path::fileProps(fname, props) )
+			{
+				props->size  = -1;	//missing
+				props->inode = 0;
+				props->mtime = 0;
+			}
+		}
+
+		static void unref(node *n)
+		{
+			if( --n->refs == 0 )
+			{
+				if( n->derived != NULL )
+					n->destroy( n->derived );
+				free( (void*)n->data );
+				delete n;
+			}
+		}
+
+		static void drop(std::map<std::string, node*>::iterator it)
+		{
+			node *n = it->second;
+			counters.bytes -= n->size;
+			lru.erase( n->lru );
+			nodes.erase( it );
+			unref( n );
+		}
+
+		static const entry *use(node *n)
+		{
+			if( n->data == NULL )
+				return NULL;
+			n->refs++;
+			return n;
+		}
+
+		const entry *get(const std::string& fname)
+		{
+			uint32_t now = util::msTime();
+			pthread_mutex_lock( &mutex );
+			std::map<std::string, node*>::iterator it = nodes.find( fname );
+			if( it != nodes.end() )
+			{
+				node *n = it->second;
+				bool valid = (now - n->checkedMs) < validateMs;
+				if( !valid )
+				{
+					path::fileProps_s props;
+					statFile( fname, &props );
+					valid = (props.size == n->props.size) && (props.mtime == n->props.mtime)
+							&& (props.inode == n->props.inode);
+					n->checkedMs = now;
+				}
+				if( valid )
+				{
+					counters.hits++;
+					lru.splice( lru.begin(), lru, n->lru );
+					const entry *out = use( n );
+					pthread_mutex_unlock( &mutex );
+					return out;
+				}
+				drop( it );
+			}
+			counters.misses++;
+			pthread_mutex_unlock( &mutex );
+
+			// Read it without holding the lock:
+			node *n = new node;
+			n->fname = fname;
+			n->refs = 1;
+			n->checkedMs = now;
+			n->data = NULL;
+			n->size = 0;
+			n->derived = NULL;
+			n->destroy = NULL;
+			statFile( fname, &n->props );
+			if( (n->props.size >= 0) && ((size_t)n->props.size <= maxFile) )
+				n->data = readfile( fname.c_str(), &n->size );
+
+			pthread_mutex_lock( &mutex );
+			it = nodes.find( fname );
+			if( it != nodes.end() )		//another thread was faster
+				drop( it );
+			nodes[fname] = n;
+			lru.push_front( n );
+			n->lru = lru.begin();
+			counters.bytes += n->size;
+
+			// Entries which are still used stay alive through their references:
+			while( (counters.bytes > budget) && (lru.size() > 1) )
+				drop( nodes.find( lru.back()->fname ) );
+			const entry *out = use( n );
+			pthread_mutex_unlock( &mutex );
+			return out;
+		}
+
+		void release(const entry *e)
+		{
+			if( e == NULL )
+				return;
+			pthread_mutex_lock( &mutex );
+			unref( (node*)static_cast<const node*>(e) );
+			pthread_mutex_unlock( &mutex );
+		}
+
+		void *attached(const entry *e)
+		{
+			pthread_mutex_lock( &mutex );
+			void *out = static_cast<const node*>(e)->derived;
+			pthread_mutex_unlock( &mutex );
+			return out;
+		}
+
+		void *attach(const entry *e, void *data, void (*destroy)(void*))
+		{
+			node *n = (node*)static_cast<const node*>(e);
+			pthread_mutex_lock( &mutex );
+			if( n->derived == NULL )
+			{
+				n->derived = data;
+				n->destroy = destroy;
+				data = NULL;
+			}
+			void *out = n->derived;
+			pthread_mutex_unlock( &mutex );
+			if( data != NULL )
+				destroy( data );
+			return out;
+		}
+
+		void setLimits(size_t budgetBytes, size_t maxFileBytes, uint32_t ms)
+		{
+			pthread_mutex_lock( &mutex );
+			budget     = budgetBytes;
+			maxFile    = maxFileBytes;
+			validateMs = ms;
+			pthread_mutex_unlock( &mutex );
+		}
+
+		stats_s stats(void)
+		{
+			pthread_mutex_lock( &mutex );
+			stats_s out = counters;
+			pthread_mutex_unlock( &mutex );
+			return out;
+		}
+	} //namespace cache
+
 } //namespace file
 
 
 namespace nbuffer
 {
 
+	namespace pool
+	{
+		const size_t minShift   = 5;		//32 bytes
+		const size_t nrClasses  = 12;		//up to 64kB
+		const size_t maxFree    = 64;		//max. blocks kept per class and thread,
+		const size_t maxFreeBytes = 1<<18;	//  and max. 256kB, for the large classes
+
+		struct block_s { block_s *next; };
+
+		// zero-initialized for every thread:
+		static THREAD_LOCAL block_s *freeList[nrClasses];
+		static THREAD_LOCAL size_t   nrFree[nrClasses];
+		static THREAD_LOCAL uint64_t nrHits, nrMisses;
+
+		/// Size class of an allocation, nrClasses if it's too large
+		static size_t sizeClass(size_t size)
+		{
+			size_t c = 0;
+			while( (c < nrClasses) && ((size_t)1 << (c + minShift)) < size )
+				c++;
+			return c;
+		}
+
+
+		void *alloc(size_t size)
+		{
+			size_t c = sizeClass(size);
+			if( (c < nrClasses) && (freeList[c] != NULL) )
+			{
+				block_s *b = freeList[c];
+				freeList[c] = b->next;
+				nrFree[c]--;
+				nrHits++;
+				return b;
+			}
+			nrMisses++;
+			return malloc( (c < nrClasses) ? ((size_t)1 << (c + minShift)) : size );
+		}
+
+
+		void release(void *block, size_t size)
+		{
+			if( block == NULL )
+				return;
+			size_t c = sizeClass(size);
+			size_t limit = util::min( maxFree, maxFreeBytes >> (c + minShift) );
+			if( (c >= nrClasses) || (nrFree[c] >= limit) )
+			{
+				free(block);
+				return;
+			}
+			block_s *b = (block_s*)block;
+			b->next = freeList[c];
+			freeList[c] = b;
+			nrFree[c]++;
+		}
+
+
+		stats_s stats(void)
+		{
+			stats_s s;
+			s.hits   = nrHits;
+			s.misses = nrMisses;
+			return s;
+		}
+	} //namespace pool
+
+
+	void* buffer::operator new(size_t size)
+	{
+		void *block = pool::alloc(size);
+		if( block == NULL )
+			throw std::bad_alloc();
+		return block;
+	}
+
+
 	/// Generic buffer, derived classes read from memory, file or network.
 	char buffer::eof(void)
 	{
@@ -448,9 +1077,128 @@ namespace nbuffer
 	}
 
 
+	bufferDeferred::bufferDeferred():
+			data(NULL),
+			ready(false)
+	{
+		_size = 0;
+		_pos  = 0;
+	}
+
+	bufferDeferred::~bufferDeferred()
+	{
+		delete data;
+	}
+
+	void bufferDeferred::set(buffer *b)
+	{
+		delete data;
+		data  = b;
+		ready = true;
+		_pos  = (data != NULL) ? data->pos() : 0;
+	}
+
+	char bufferDeferred::eof(void)
+	{
+		if( !ready )
+			return false;
+		sync();
+		return (data == NULL) || data->eof();
+	}
+
+	size_t bufferDeferred::size(void)
+	{
+		return (data != NULL) ? data->size() : 0;
+	}
+
+	int bufferDeferred::read(void *dst, size_t len)
+	{
+		if( data == NULL )
+			return 0;
+		sync();
+		int n = data->read(dst, len);
+		_pos = data->pos();
+		return n;
+	}
+
+	int bufferDeferred::close(void)
+	{
+		return (data != NULL) ? data->close() : 0;
+	}
+
+
+	bufferGenerator::bufferGenerator(bool chunked, const std::string& first):
+			partStart(0),
+			finished(false),
+			chunked(chunked)
+	{
+		_size = 0;
+		_pos  = 0;
+		append( first );
+	}
+
+	void bufferGenerator::append(const std::string& data)
+	{
+		if( !chunked )
+			part.append( data );
+		else if( !data.empty() )
+		{
+			char len[20];
+			snprintf( len, sizeof(len), "%lx\r\n", (unsigned long)data.size() );
+			part.append( len );
+			part.append( data );
+			part.append( "\r\n" );
+		}
+	}
+
+	void bufferGenerator::fill(void)
+	{
+		std::string data;
+		while( (_pos >= partStart + part.size()) && !finished )
+		{
+			partStart += part.size();
+			part.clear();
+			data.clear();
+			finished = !generate( data );
+			append( data );
+			if( chunked && finished )
+				part.append( "0\r\n\r\n" );		//last-chunk, no trailers
+		}
+	}
+
+	char bufferGenerator::eof(void)
+	{
+		return finished && (_pos >= partStart + part.size());
+	}
+
+	size_t bufferGenerator::size(void)
+	{
+		fill();
+		return partStart + part.size();
+	}
+
+	int bufferGenerator::read(void *dst, size_t len)
+	{
+		fill();
+		size_t nrCopy = util::min( len, partStart + part.size() - _pos );
+		memcpy( dst, part.data() + (_pos - partStart), nrCopy );
+		_pos += nrCopy;
+		return nrCopy;
+	}
+
+	int bufferGenerator::close(void)
+	{
+		part.clear();
+		finished = true;
+		partStart = _pos;
+		return 0;
+	}
+
+
 	bufferFile::bufferFile(const char *fname)
 	{
 		this->fname = std::string(fname);
+		start = 0;
 		handle = fopen(fname,"rb");
 		if(handle != NULL)
 		{
@@ -462,6 +1210,24 @@ namespace nbuffer
 		_pos = 0;
 	}
 
+	bufferFile::bufferFile(const char *fname, size_t start, size_t end)
+	{
+		this->fname = std::string(fname);
+		handle = fopen(fname,"rb");
+		_size = 0;
+		if(handle != NULL)
+		{
+			fseek(handle, 0, SEEK_END);
+			size_t fsize = ftell(handle);
+			end   = util::min(end, fsize);
+			start = util::min(start, end);
+			fseek(handle, start, SEEK_SET);
+			_size = end - start;
+		}
+		this->start = start;
+		_pos = 0;
+	}
+
 	bufferFile::~bufferFile()
 	{
 		fclose(handle);
@@ -475,18 +1241,26 @@ namespace nbuffer
 
 		if( handle != NULL)
 		{
-			//TODO: verify _pos and ftell(handle), since seek() is not inherited correctly
-			n = fread(dst, nrCopy, 1, handle);
-			if( n != 1) {
-				db_printf(1,"bufferFile(): error reading %s: %llu\n", fname.c_str(), (LLU)n );
-			} else
-				_pos += nrCopy;
+			// seek() and sendfile() don't move the file position:
+			long filePos = (long)(start + _pos);
+			if( ftell(handle) != filePos )
+				fseek(handle, filePos, SEEK_SET);
+			n = fread(dst, 1, nrCopy, handle);
+			if( n < (size_t)nrCopy )
+				db_printf(1,"bufferFile(): error reading %s: %llu of %i bytes\n", fname.c_str(), (LLU)n, nrCopy );
+			_pos += n;
 		}
 
 		return n;
 	}
 
 
+	int bufferFile::fd(void)
+	{
+		return (handle != NULL) ? fileno(handle) : -1;
+	}
+
+
 	char bufferFile::eof(void)
 	{
 		if (handle==NULL)
@@ -503,6 +1277,194 @@ namespace nbuffer
 
 
 
+	bufferMap::bufferMap(const char *fname, size_t start, size_t end):
+		data(NULL),
+		map(NULL),
+		mapSize(0)
+	{
+		this->fname = std::string(fname);
+		_size = 0;
+		_pos  = 0;
+
+		struct stat st;
+		if( (stat(fname, &st) != 0) || !S_ISREG(st.st_mode) )
+			return;
+		end   = util::min<size_t>(end, st.st_size);
+		start = util::min(start, end);
+		if( start >= end )
+			return;
+
+#if defined(WIN32) && !defined(__CYGWIN__)
+		// No mmap(), keep a copy in memory:
+		FILE *f = fopen(fname, "rb");
+		if( f == NULL )
+			return;
+		map = malloc(end - start);
+		fseek(f, start, SEEK_SET);
+		if( map != NULL )
+			mapSize = fread(map, 1, end - start, f);
+		fclose(f);
+		data  = (char*)map;
+		_size = mapSize;
+#else
+		int fd = open(fname, O_RDONLY);
+		if( fd < 0 )
+			return;
+
+		// mmap() needs a page-aligned offset:
+		size_t pageSize = sysconf(_SC_PAGESIZE);
+		size_t mapStart = start - (start % pageSize);
+		mapSize = end - mapStart;
+		map = mmap(NULL, mapSize, PROT_READ, MAP_SHARED, fd, mapStart);
+		::close(fd);	//the mapping stays valid
+		if( map == MAP_FAILED )
+		{
+			db_printf(1,"bufferMap(): can't map %s: %s\n", fname, strerror(errno) );
+			map = NULL;
+			mapSize = 0;
+			return;
+		}
+		madvise(map, mapSize, MADV_SEQUENTIAL);
+		data  = (char*)map + (start - mapStart);
+		_size = end - start;
+#endif
+	}
+
+	bufferMap::~bufferMap()
+	{
+		close();
+	}
+
+	int bufferMap::read(void *dst, size_t len)
+	{
+		size_t nrCopy = util::min<size_t>(len, _size - _pos);
+		if( data == NULL )
+			return 0;
+		memcpy(dst, data+_pos, nrCopy);
+		_pos += nrCopy;
+		return nrCopy;
+	}
+
+	int bufferMap::close(void)
+	{
+		if( map != NULL )
+		{
+#if defined(WIN32) && !defined(__CYGWIN__)
+			free(map);
+#else
+			munmap(map, mapSize);
+#endif
+		}
+		map  = NULL;
+		data = NULL;
+		mapSize = 0;
+		_size = 0;
+		_pos  = 0;
+		return 0;
+	}
+
+
+	buffer *fileBuffer(const char *fname, size_t start, size_t end)
+	{
+#if defined(__linux__)
+		return new bufferFile(fname, start, end);
+#else
+		return new bufferMap(fname, start, end);
+#endif
+	}
+
+
+
+	void rxQueue::append(const void *data, size_t len)
+	{
+		const char *src = (const char*)data;
+		_size += len;
+		while( len > 0 )
+		{
+			if( segs.empty() || (segs.back().end >= segSize) )
+			{
+				segment seg;
+				seg.data  = (char*)pool::alloc(segSize);
+				seg.start = 0;
+				seg.end   = 0;
+				segs.push_back( seg );
+			}
+			segment &seg = segs.back();
+			size_t n = util::min( len, segSize - seg.end );
+			memcpy( seg.data + seg.end, src, n );
+			seg.end += n;
+			src += n;
+			len -= n;
+		}
+	}
+
+
+	const char* rxQueue::peek(size_t len)
+	{
+		if( len > _size )
+			return NULL;
+		if( segs.empty() )
+			return "";
+		if( segs[0].end - segs[0].start >= len )
+			return segs[0].data + segs[0].start;	//in place
+
+		releaseScratch();
+		scratch     = (char*)pool::alloc(len);
+		scratchSize = len;
+		size_t copied = 0;
+		for(size_t s=0; copied < len; s++)
+		{
+			size_t n = util::min( len - copied, segs[s].end - segs[s].start );
+			memcpy( scratch + copied, segs[s].data + segs[s].start, n );
+			copied += n;
+		}
+		return scratch;
+	}
+
+
+	void rxQueue::consume(size_t len)
+	{
+		releaseScratch();
+		len = util::min( len, _size );
+		_size -= len;
+		size_t done = 0;	//number of segments which are fully consumed
+		while( len > 0 )
+		{
+			segment &seg = segs[done];
+			size_t n = util::min( len, seg.end - seg.start );
+			seg.start += n;
+			len -= n;
+			if( (seg.start >= seg.end) && (seg.end >= segSize) )
+				done++;		//full and read, won't be used again
+		}
+		for(size_t s=0; s < done; s++)
+			pool::release( segs[s].data, segSize );
+		segs.erase( segs.begin(), segs.begin() + done );
+
+		if( _size == 0 )
+			clear();	//don't hold any memory while idle
+	}
+
+
+	void rxQueue::clear(void)
+	{
+		releaseScratch();
+		for(size_t s=0; s < segs.size(); s++)
+			pool::release( segs[s].data, segSize );
+		segs.clear();
+		_size = 0;
+	}
+
+
+	void rxQueue::releaseScratch(void)
+	{
+		pool::release( scratch, scratchSize );
+		scratch     = NULL;
+		scratchSize = 0;
+	}
+
+
+
 	bufferString::bufferString(std::string str)
 	{
 		data = str; //copy the string
@@ -534,15 +1496,59 @@ namespace nbuffer
 						)
 	{
 		if(doCopy) {
-			this->data = new char[size];
+			this->data = (char*)pool::alloc(size);
 			memcpy(this->data, data, size);
 		} else
 			this->data = (char*)data;
 		this->ownsData = doCopy;
+		this->capacity = size;
+		_size = size;
+		_pos = 0;
+	}
+
+	bufferMem::bufferMem(size_t size)
+	{
+		this->data = (char*)pool::alloc(size);
+		this->ownsData = true;
+		this->capacity = size;
 		_size = size;
 		_pos = 0;
 	}
 
+	bufferCached::bufferCached(const file::cache::entry *entry, size_t start, size_t end)
+	{
+		this->entry = entry;
+		end   = util::min(end, entry->size);
+		start = util::min(start, end);
+		data  = entry->data + start;
+		_size = end - start;
+		_pos  = 0;
+	}
+
+	bufferCached::~bufferCached()
+	{
+		close();
+	}
+
+	int bufferCached::read(void *dst, size_t len)
+	{
+		size_t nrCopy = util::min<size_t>(len, _size - _pos);
+		memcpy(dst, data+_pos, nrCopy);
+		_pos += nrCopy;
+		return nrCopy;
+	}
+
+	int bufferCached::close(void)
+	{
+		file::cache::release( entry );
+		entry = NULL;
+		data  = NULL;
+		_size = 0;
+		_pos  = 0;
+		return 0;
+	}
+
+
 	bufferMem::~bufferMem()
 	{
 		close();
@@ -559,7 +1565,7 @@ namespace nbuffer
 	int bufferMem::close(void)
 	{
 		if( ownsData )
-			delete data;
+			pool::release(data, capacity);
 		ownsData = false;
 		data = NULL;
 		_size = 0;
@@ -12,6 +12,7 @@
 #include <sys/stat.h>
 
 #include <stdint.h>	//for uint8_t
+#include <pthread.h>
 
 
 //platform dependend stuff:
@@ -143,6 +144,144 @@ namespace util
 	/// Generate a hash code from the current state
 	uint16_t fletcher_finish(fletcher_state_t state);
 
+	/// 64-bit FNV-1a hash, pass the previous result to continue it
+	uint64_t fnv1a(const void *data, size_t len, uint64_t hash=14695981039346656037ULL);
+
+
+	/// Monotonic clock in milliseconds, wraps after ~49 days
+	uint32_t msTime(void);
+
+	/// Suspend the calling thread
+	void msSleep(uint32_t ms);
+
+
+	class timerWheel;
+
+	/// Something to do at a deadline. Derived classes implement expire(),
+	/// which is called once, by timerWheel::advance(). A timer which is
+	/// destroyed is cancelled, copies are never armed.
+	class timer
+	{
+		friend class timerWheel;
+	private:
+		timer *prev, *next;		//list of the wheel slot
+		timerWheel *wheel;		//NULL if not armed
+		int slot;
+		uint64_t deadline;		//in ticks of the wheel
+	public:
+		timer(): prev(NULL), next(NULL), wheel(NULL), slot(0), deadline(0) {}
+		timer(const timer&): prev(NULL), next(NULL), wheel(NULL), slot(0), deadline(0) {}
+		timer& operator=(const timer&)	{ return *this; }
+		virtual ~timer()	{ cancel(); }
+
+		bool armed(void)	{ return wheel != NULL; }
+		void cancel(void);
+
+		virtual void expire(void)=0;
+	};
+
+
+	/// Hierarchical timing wheel: arming and cancelling a timer is O(1).
+	/// The first level has a slot per tick, each next level a slot per
+	/// turn of the previous one, which is moved down when it's reached.
+	/// Timers are rounded up to ticks of 10 ms, and limited to ~7 days.
+	/// Not thread safe, it's used by a single eventLoop.
+	class timerWheel
+	{
+		friend class timer;
+	public:
+		static const uint32_t tickMs = 10;
+	private:
+		static const int levels    = 4;
+		static const int bits0     = 8;		//256 slots in the first level
+		static const int bitsN     = 6;		//64 slots in the others
+		static const int nrSlots   = (1<<bits0) + (levels-1)*(1<<bitsN);
+
+		timer *slots[nrSlots];
+		uint64_t current;		//current tick
+		uint32_t lastMs;		//msTime() at the current tick
+		size_t count;			//number of armed timers
+
+		void insert(timer *t);
+		void unlink(timer *t);
+		void cascade(int level);
+
+	public:
+		timerWheel();
+		~timerWheel();
+
+		/// Call t->expire() after ms milliseconds, replaces an earlier deadline.
+		void arm(timer *t, uint32_t ms);
+
+		/// Expire all timers up to msTime()
+		void advance(void);
+
+		/// Milliseconds until the next expire() or cascade, -1 if there are no timers.
+		int nextTimeout(void);
+
+		size_t size(void)	{ return count; }
+	};
+
+
+	/// Rate limiter: hands out 'rate' bytes per second, and saves up to
+	/// 'depth' bytes while nothing is taken. Not thread safe.
+	class tokenBucket
+	{
+	private:
+		int64_t tokens;		//can go negative, when more was taken than available
+		uint32_t lastMs;	//msTime() of the last refill
+		void refill(void);
+	public:
+		uint32_t rate;		///< bytes per second, 0 is unlimited
+		uint32_t depth;		///< max. bytes saved up
+
+		tokenBucket(uint32_t rate=0, uint32_t depth=(1<<16));
+
+		/// Bytes which can be taken now
+		size_t available(void);
+
+		/// Account for bytes which were sent
+		void take(size_t n);
+
+		/// Milliseconds until n bytes are available, 0 if they are
+		uint32_t waitMs(size_t n);
+	};
+
+
+	/// Work for a threadPool. work() runs in a pool thread, then finished()
+	/// in the same thread, which deletes the job by default.
+	class job
+	{
+	public:
+		virtual ~job() {}
+		virtual void work(void)=0;
+		virtual void finished(void)	{ delete this; }
+	};
+
+
+	/// A fixed number of threads, running jobs in the order they are queued.
+	/// Meant for calls which can block, like disk access, so the event loops don't.
+	class threadPool
+	{
+	private:
+		pthread_mutex_t mutex;
+		pthread_cond_t  cond;		//signalled when a job is queued, or when stopping
+		std::vector<job*> jobs;		//queued, jobs[first] is next
+		size_t first;
+		std::vector<pthread_t> threads;
+		bool stopping;
+
+		static void* threadMain(void *arg);
+	public:
+		threadPool(int nrThreads);
+
+		/// Waits for the running jobs. Queued jobs are finished() without work().
+		~threadPool();
+
+		/// Run j->work() in one of the threads, takes ownership. Can be called from any thread.
+		void queue(job *j);
+	};
+
 
 	/// helper function for sort()
 	/*template <class T>
@@ -179,6 +318,9 @@ namespace pstring
 	/// Convert a string to lower case
 	void tolower(std::string& str);
 
+	/// Append a number in decimal, without going through sprintf()
+	void appendInt(std::string& out, int64_t value);
+
     bool startswith(std::string& str, std::string& pattern);
 }
 
@@ -203,6 +345,19 @@ namespace path {
 
 	bool isfile(const std::string path);
 
+	/// Size of a regular file in bytes, or -1 if it isn't one
+	int64_t filesize(const std::string path);
+
+	/// Properties of a regular file, which change when it's replaced or written
+	struct fileProps_s {
+		int64_t size;
+		uint64_t inode;
+		time_t mtime;
+	};
+
+	/// Returns false if it isn't a regular file
+	bool fileProps(const std::string path, fileProps_s *props);
+
 	/// List the contenst of a directory. in python, this is os.listdir()
 	std::vector<std::string> listdir(const std::string path, bool doSort=false);
 
@@ -224,6 +379,41 @@ namespace file {
 	/// Note: return value must be free()-ed by the user
 	char* readfile(const char *fname,  size_t *size, const char *mode="rb");
 
+	/// Process-wide cache of file contents, so the web interface doesn't read its
+	/// templates and assets from disk for every request. An entry is compared with
+	/// the file at most once per validateMs, and the least recently used entries are
+	/// dropped when the contents exceed the budget. Missing and too large files are
+	/// remembered as well, get() returns NULL for those.
+	namespace cache
+	{
+		/// Contents of a file, valid until release(), even when the file changes
+		struct entry {
+			const char *data;		///< zero-terminated, for templates
+			size_t size;
+			path::fileProps_s props;
+		};
+
+		struct stats_s {
+			uint64_t hits;		///< lookups which didn't read the file
+			uint64_t misses;
+			size_t bytes;		///< contents held
+		};
+
+		/// NULL if it isn't a regular file, or larger than maxFile
+		const entry *get(const std::string& fname);
+		void release(const entry *e);
+
+		/// Data derived from an entry, e.g. a compiled template, NULL if there's none yet
+		void *attached(const entry *e);
+
+		/// Attach derived data, which is destroyed together with the entry.
+		/// If another thread was faster, data is destroyed and theirs is returned.
+		void *attach(const entry *e, void *data, void (*destroy)(void*));
+
+		void setLimits(size_t budget, size_t maxFile, uint32_t validateMs=1000);
+		stats_s stats(void);
+	}
+
 
 	/*
 	/// Python-like file I/O
@@ -287,8 +477,36 @@ namespace file {
 
 
 
+//thread local storage:
+#if defined(_MSC_VER)
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
+
 namespace nbuffer {
 
+	/// Per-thread free lists of memory blocks, in power-of-two size classes
+	/// from 32 bytes to 64kB. Freed blocks are kept for re-use, linked through
+	/// their first bytes, so steady traffic doesn't call malloc().
+	/// A block may be released by another thread than the one which allocated it.
+	namespace pool
+	{
+		struct stats_s {
+			uint64_t hits;		///< allocations served from a free list
+			uint64_t misses;	///< allocations which needed malloc()
+		};
+
+		void *alloc(size_t size);
+		/// size must be the size passed to alloc()
+		void release(void *block, size_t size);
+
+		/// Counters of the calling thread
+		stats_s stats(void);
+	}
+
+
 	/// Generic buffer, derived classes read from memory, file or network.
 	class buffer {
 	private:
@@ -300,6 +518,10 @@ namespace nbuffer {
 		virtual ~buffer()
 		{ }
 
+		// All buffers come from the pool:
+		static void* operator new(size_t size);
+		static void  operator delete(void *block, size_t size)	{ pool::release(block, size); }
+
 		/// Indicate end-of-stream
 		virtual char eof(void);
 		/// Number of bytes
@@ -314,6 +536,13 @@ namespace nbuffer {
 		/// read data into *dst, returns number of bytes read
 		virtual int read(void *dst, size_t len)=0;
 
+		/// File descriptor holding the data, for zero-copy sending with
+		/// sendfile(). -1 if the data is not in a file.
+		virtual int fd(void)	{return -1; }
+
+		/// Offset in fd() of the byte at pos()
+		virtual uint64_t fdOffset(void)	{return 0; }
+
         /// Returns true if read() will not block.
         virtual bool canRead(void)
         {
@@ -330,16 +559,140 @@ namespace nbuffer {
 	{
 	private:
 		FILE *handle;
+		size_t start;		//file offset of the first byte
 		std::string fname;	//for debug
 	public:
 		bufferFile(const char *fname);
+		/// Only the bytes [start,end) of the file, end is clipped to the file size
+		bufferFile(const char *fname, size_t start, size_t end);
 		~bufferFile();
 		int read(void *dst, size_t len);
 		char eof(void);
 		int close(void);
+		int fd(void);
+		uint64_t fdOffset(void)	{return start + _pos; }
 	};
 
 
+	/// Buffer from a memory-mapped file, for systems without sendfile().
+	/// The data is sent straight from the page cache, without a copy through user space.
+	class bufferMap : public buffer
+	{
+	private:
+		char *data;			//start of the requested range
+		void *map;			//start of the mapping, page aligned
+		size_t mapSize;
+		std::string fname;	//for debug
+	public:
+		/// Only the bytes [start,end) of the file, end is clipped to the file size
+		bufferMap(const char *fname, size_t start=0, size_t end=(size_t)-1);
+		~bufferMap();
+		const char* ptr(void) { return data; }
+		int read(void *dst, size_t len);
+		int close(void);
+	};
+
+
+	/// FIFO of buffers, kept in a ring which doubles in size when it's full.
+	/// Unlike a std::vector, taking the front doesn't move the other entries.
+	class queue
+	{
+	private:
+		std::vector<buffer*> ring;	//size is a power of two
+		size_t head, count;
+
+		void grow(void)
+		{
+			std::vector<buffer*> larger( ring.size()*2, (buffer*)NULL );
+			for(size_t i=0; i < count; i++)
+				larger[i] = (*this)[i];
+			ring.swap( larger );
+			head = 0;
+		}
+
+	public:
+		queue(): ring(8, (buffer*)NULL), head(0), count(0) {}
+
+		size_t size(void)	{ return count; }
+		buffer* front(void)	{ return ring[head]; }
+		buffer* operator[](size_t i)	{ return ring[(head + i) & (ring.size()-1)]; }
+
+		void push_back(buffer *buf)
+		{
+			if( count == ring.size() )
+				grow();
+			ring[(head + count) & (ring.size()-1)] = buf;
+			count++;
+		}
+
+		/// Remove the front entry, without deleting it
+		void pop_front(void)
+		{
+			ring[head] = NULL;
+			head = (head + 1) & (ring.size()-1);
+			count--;
+		}
+	};
+
+
+	/// Receive queue for incoming data. The data is appended in segments from
+	/// the pool, and never moved until it's consumed. An empty queue holds no
+	/// memory. Parsers can look at a message in place, unless it crosses
+	/// a segment boundary.
+	class rxQueue
+	{
+	private:
+		static const size_t segSize = 1<<11;
+		struct segment {
+			char *data;
+			size_t start;	//first unconsumed byte
+			size_t end;		//end of the received data
+		};
+		std::vector<segment> segs;
+		size_t _size;
+
+		char *scratch;		//copy of a message which crosses segments, see peek()
+		size_t scratchSize;
+		void releaseScratch(void);
+
+	public:
+		rxQueue(): _size(0), scratch(NULL), scratchSize(0) {}
+		~rxQueue()	{ clear(); }
+
+		/// Number of unconsumed bytes
+		size_t size(void)	{ return _size; }
+
+		void append(const void *data, size_t len);
+
+		/// Byte at offset i of the unconsumed data
+		char operator[](size_t i)
+		{
+			for(size_t s=0; s < segs.size(); s++)
+			{
+				size_t n = segs[s].end - segs[s].start;
+				if( i < n )
+					return segs[s].data[ segs[s].start + i ];
+				i -= n;
+			}
+			return 0;
+		}
+
+		/// Pointer to the first len bytes, contiguous. Valid until the next
+		/// call to peek(), consume() or clear().
+		const char* peek(size_t len);
+
+		/// Remove len bytes from the front
+		void consume(size_t len);
+
+		void clear(void);
+	};
+
+
+	/// The cheapest buffer to stream (part of) a file to a socket:
+	/// a bufferFile where connectionHandler can use sendfile(), otherwise a bufferMap.
+	buffer *fileBuffer(const char *fname, size_t start=0, size_t end=(size_t)-1);
+
+
 	/// Buffer from a std::string
 	class bufferString :  public buffer
 	{
@@ -353,16 +706,92 @@ namespace nbuffer {
 	};
 
 
+	/// Placeholder for data which isn't there yet, e.g. while a page is
+	/// rendered in a threadPool. It blocks until set() hands over the real
+	/// data, and then passes it through. Call set() in the sending thread.
+	class bufferDeferred : public buffer
+	{
+	private:
+		buffer *data;	//NULL until set()
+		bool ready;
+		void sync(void)	{ if( data != NULL ) data->seek( (int)(_pos - data->pos()) ); }
+	public:
+		bufferDeferred();
+		~bufferDeferred();
+
+		/// Provide the data, takes ownership. NULL sends nothing.
+		void set(buffer *b);
+
+		bool canRead(void)		{ return ready && ((data == NULL) || data->canRead()); }
+		char eof(void);
+		size_t size(void);
+		const char* ptr(void)	{ return (data != NULL) ? data->ptr() : NULL; }
+		int fd(void)			{ return (data != NULL) ? data->fd() : -1; }
+		uint64_t fdOffset(void)	{ sync(); return (data != NULL) ? data->fdOffset() : 0; }
+		int read(void *dst, size_t len);
+		int close(void);
+	};
+
+
+	/// Buffer for data of unknown size, which is produced while it is sent,
+	/// one part at a time: a large page doesn't have to be in memory at once.
+	/// Derived classes implement generate(). With chunked set, the parts are
+	/// framed with the HTTP/1.1 chunked transfer-coding.
+	class bufferGenerator : public buffer
+	{
+	private:
+		std::string part;	//framed data of the current part
+		size_t partStart;	//position of part[0]
+		bool finished;		//generate() is done
+		bool chunked;
+		void append(const std::string& data);
+		void fill(void);
+	protected:
+		/// Append the next part to out, returns false after the last one.
+		/// Called in the sending thread, when the previous part is sent.
+		virtual bool generate(std::string& out)=0;
+	public:
+		/// first is sent before anything is generated
+		bufferGenerator(bool chunked, const std::string& first="");
+
+		char eof(void);
+		/// Bytes produced up to now, more are generated if all of these are read
+		size_t size(void);
+		int read(void *dst, size_t len);
+		int close(void);
+	};
+
+
+	/// Buffer from a file::cache entry, which is released with the buffer
+	class bufferCached : public buffer
+	{
+	private:
+		const file::cache::entry *entry;
+		const char *data;
+	public:
+		/// Only the bytes [start,end) of the file, end is clipped to the file size
+		bufferCached(const file::cache::entry *entry, size_t start=0, size_t end=(size_t)-1);
+		~bufferCached();
+		const char* ptr(void) { return data; }
+		int read(void *dst, size_t len);
+		int close(void);
+	};
+
+
 	/// Buffer from a memory location
 	class bufferMem :  public buffer
 	{
 	private:
 		char *data;
-		bool ownsData;	//does this class new/delete *data?
+		bool ownsData;	//does this class allocate *data? it's from the pool then
+		size_t capacity;	//allocated size of *data
 	public:
 		bufferMem(const void* data, size_t size, bool doCopy);
+		/// An owned, uninitialized buffer, to be filled through wptr()
+		explicit bufferMem(size_t size);
 		~bufferMem();
 		const char* ptr(void) { return data; }
+		char* wptr(void) { return data; }
 		int read(void *dst, size_t len);
 		int close(void);
 	};